@@ -15,6 +15,7 @@
 #ifndef BUFFER_QUEUE_H
 #define BUFFER_QUEUE_H
 
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 
@@ -47,6 +48,7 @@ class buffer_queue
     void close();
     bool is_closed();
     bool is_empty();
+    void reopen();
 
     Value value_pop();
     queue_op_status wait_pop(Value&);
@@ -62,6 +64,9 @@ class buffer_queue
     queue_op_status try_push(Value&& x);
     queue_op_status nonblocking_push(Value&& x);
 
+    size_t wait_pop_n(Value* x, size_t n, std::chrono::microseconds linger);
+    queue_op_status wait_push_n(Value* x, size_t n);
+
   private:
     std::mutex mtx_;
     std::condition_variable not_empty_;
@@ -80,6 +85,8 @@ class buffer_queue
     void iter_init(size_t max_elems, Iter first, Iter last);
 
     size_t next(size_t idx) { return (idx + 1) % num_slots_; }
+    size_t count()
+        { return (push_index_ + num_slots_ - pop_index_) % num_slots_; }
 
     queue_op_status try_pop_common(Value& x);
     queue_op_status try_push_common(const Value& x);
@@ -192,6 +199,16 @@ void buffer_queue<Value>::close()
     not_full_.notify_all();
 }
 
+template <typename Value>
+void buffer_queue<Value>::reopen()
+{
+    std::lock_guard<std::mutex> hold( mtx_ );
+    if ( closed_ ) {
+        pop_index_ = push_index_;
+        closed_ = false;
+    }
+}
+
 template <typename Value>
 bool buffer_queue<Value>::is_closed()
 {
@@ -458,6 +475,84 @@ void buffer_queue<Value>::push(Value&& elem)
         throw queue_op_status::closed;
 }
 
+template <typename Value>
+size_t buffer_queue<Value>::wait_pop_n(Value* elems, size_t n,
+                                       std::chrono::microseconds linger)
+{
+    /* This try block is here to catch exceptions from the mutex
+       operations or from the user-defined copy assignment operator
+       in the pop_from operation. */
+    try {
+        std::unique_lock<std::mutex> hold( mtx_ );
+        /* A full queue cannot fill any further. */
+        size_t want = n < num_slots_ - 1 ? n : num_slots_ - 1;
+        for (;;) {
+            if ( pop_index_ == push_index_ ) {
+                if ( closed_ )
+                    return 0;
+                ++waiting_empty_;
+                not_empty_.wait( hold );
+                continue;
+            }
+            if ( linger.count() <= 0 || count() >= want )
+                break;
+            std::chrono::steady_clock::time_point deadline
+                = std::chrono::steady_clock::now() + linger;
+            while ( count() < want && !closed_ ) {
+                /* A timed-out wait leaves waiting_empty_ one too high,
+                   which costs at most a spurious notification. */
+                ++waiting_empty_;
+                if ( not_empty_.wait_until( hold, deadline )
+                     == std::cv_status::timeout )
+                    break;
+            }
+            /* Another consumer may have emptied the queue while the
+               lock was released; then wait for an element again. */
+            if ( pop_index_ != push_index_ || closed_ )
+                break;
+        }
+        size_t popped = 0;
+        while ( popped < n && pop_index_ != push_index_ ) {
+            pop_from( elems[popped], pop_index_ );
+            ++popped;
+        }
+        return popped;
+    } catch (...) {
+        close();
+        throw;
+    }
+}
+
+template <typename Value>
+queue_op_status buffer_queue<Value>::wait_push_n(Value* elems, size_t n)
+{
+    /* This try block is here to catch exceptions from the mutex
+       operations or from the user-defined copy assignment
+       operator in push_at. */
+    try {
+        std::unique_lock<std::mutex> hold( mtx_ );
+        for ( size_t i = 0; i < n; ++i ) {
+            size_t hdx;
+            size_t nxt;
+            for (;;) {
+                if ( closed_ )
+                    return queue_op_status::closed;
+                hdx = push_index_;
+                nxt = next( hdx );
+                if ( nxt != pop_index_ )
+                    break;
+                ++waiting_full_;
+                not_full_.wait( hold );
+            }
+            push_at( std::move(elems[i]), hdx, nxt );
+        }
+        return queue_op_status::success;
+    } catch (...) {
+        close();
+        throw;
+    }
+}
+
 } // namespace gcl
 
 #endif
@@ -45,6 +45,10 @@ public:
   // throws std::system_error.
   void count_down();
 
+  // Sets the count again, so that the latch can be reused. No thread may
+  // be blocked in wait() or invoking count_down().
+  void reset(unsigned int count);
+
 private:
   // The counter for this latch.
   unsigned int count_;
@@ -12,11 +12,25 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#ifndef GCL_COUNTER_
+#define GCL_COUNTER_
+
 #include "dynarray.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <type_traits>
 #include <unordered_set>
 
 #include <atomic>
+#include <condition_variable>
 #include <mutex>
+#include <thread>
+
+#if defined( __AVX2__ )
+#include <immintrin.h>
+#endif
 
 namespace gcl {
 
@@ -129,6 +143,36 @@ The lifetime of the counter must be strictly larger than
 the lifetimes of any buffers attached to it.
 
 
+EPOCH BUFFERS
+
+A long-lived buffer hides its counts until it is pushed,
+which tempts programmers to push within hot loops.
+An epoch buffer instead pushes itself
+when a shared epoch has advanced since its last push,
+or when its count reaches a threshold.
+
+    counter::simplex<int> red_count;
+    counter::epoch red_epoch;
+    counter::epoch_ticker ticker( red_epoch, std::chrono::milliseconds( 100 ) );
+
+    void count_red_forever( Queue& queue ) {
+        counter::epoch_buffer<int> local_red( red_count, red_epoch, 1000 );
+        for ( ;; )
+            if ( is_red( queue.pop() ) )
+                ++local_red;
+    }
+
+The increment is a serial add, a relaxed load of the epoch,
+and two comparisons; there is no atomic read-modify-write.
+The epoch ticker advances the epoch on a background thread,
+though any thread may call advance on the epoch.
+Hence red_count.load() lags an actively counting buffer
+by at most one epoch period or one threshold of counts.
+A buffer that stops counting publishes nothing until its next update,
+push, or destruction,
+so call push when a thread goes idle.
+
+
 DUPLEX COUNTERS
 
 The push model of buffers sometimes yields an unacceptable lag
@@ -222,9 +266,23 @@ E.g. ++ctr_ary[i].
 
 The load and exchange operations take an additional index parameter.
 
+Reading a whole array one index at a time
+polls every broker once per index.
+Instead, the bulk operations read the entire array
+into a caller buffer of size() elements.
+
+void load_all( integer* out ):
+Stores the value of every counter in the array into out.
+
+void exchange_all( integer* out, integer to ):
+Replaces every count by the parameter
+and stores the previous counts into out.
+As with exchange, every count is extracted by exactly one exchange.
+
+The bulk operations sum each broker's array in one contiguous pass,
+which uses AVX2 vector additions when compiled for AVX2.
+
 Do we want to initialize a counter array with an initializer list?
-Do we want to return a dynarray for the load operation?
-Do we want to pass and return a dynarray for the exchange operation?
 
 
 ATOMICITY
@@ -284,6 +342,143 @@ at appropriate times.
 Another solution is to use duplex counters.
 
 
+GAUGES
+
+A gauge is a simplex counter that may also be set,
+such as the current depth of a queue.
+
+    counter::gauge<int> queue_depth;
+
+    queue_depth.store( q.size() );
+    ++queue_depth;
+
+void store( integer ):
+Replaces the value of the gauge.
+
+Gauges have no brokers or buffers,
+because a store cannot be split across them.
+A gauge cannot be the prime of a buffer.
+Gauges have the same atomicity parameter as simplex counters.
+
+
+EXTREMA
+
+The extremum counters track the largest or smallest value offered,
+such as a queue high-water mark or peak concurrency.
+
+    counter::max_simplex<int> peak_depth;
+
+    peak_depth.offer( depth );
+
+void offer( integer ):
+Replaces the value if the offered value is more extreme.
+
+integer load():
+Returns the most extreme value offered.
+
+integer exchange( integer ):
+Replaces the value and returns the previous extreme,
+e.g. to start a new reporting interval.
+
+An offer that does not change the value only reads the counter,
+so concurrent offers below the current peak do not contend.
+A fully atomic offer that does change the value
+uses a compare-exchange loop.
+
+As with additive counters, there are duplex versions with brokers.
+Each broker holds the extreme of its own offers,
+and a load of the duplex combines the brokers' values.
+
+    counter::max_duplex<int> peak_concurrency;
+    thread_local counter::max_broker<int> thread_peak( peak_concurrency );
+
+    thread_peak.offer( active );
+
+Each broker has a single writer,
+so broker offers need no read-modify-write operations.
+The exchange on a duplex exchanges every broker,
+and an offer that races with the exchange
+may land in either the old or the new interval.
+
+The min_simplex, min_duplex and min_broker types track the smallest value.
+An extremum counter constructed without a value
+starts at the least extreme value of its type,
+so the first offer always replaces it.
+
+
+RATES
+
+A rate counter is a simplex counter
+that also reports its rate of increase over a recent window of time.
+
+    counter::rate<long> requests( std::chrono::seconds( 10 ) );
+
+    ++requests;
+    double qps = requests.per_second();
+
+Increments cost the same as a simplex counter;
+there is no clock read in the counting code.
+Instead, per_second and sample record a timestamped load
+in a small ring of samples,
+and the rate is the change between the newest sample
+and the oldest sample still within the window.
+Call sample periodically if per_second is called
+less often than the window length.
+When no earlier sample falls within the window,
+such as on the first call, there is no data for a rate,
+and per_second returns a quiet NaN.
+Because a rate counter is a bumper,
+it can be the prime of buffers.
+
+
+APPROXIMATE COUNTERS
+
+For events so frequent that even buffered counting is too costly,
+an approximate counter trades exactness for throughput.
+It stores only an exponent c in a small unsigned integer,
+and increments it with probability b^-c,
+where the base b is 1 + 2^-Precision.
+The estimated count is (b^c - 1) / (b - 1).
+
+    counter::approximate<unsigned short, 4> red_count;
+
+    void count_red( Bag bag ) {
+        for ( Bag::iterator i = bag.begin(); i != bag.end(); i++ )
+            if ( is_red( *i ) )
+                ++red_count;
+    }
+
+Most increments only read the shared exponent
+and draw a thread-local random number,
+so concurrent increments rarely write the shared cache line.
+
+The estimate is unbiased,
+and its relative standard error is sqrt( 2^-(Precision+1) ),
+e.g. about 18% for precision 4 and 4.4% for precision 8.
+Counts within three standard errors cover 99.7% of cases.
+The relative_error function returns the standard error.
+Larger precisions reduce the error but also reduce the capacity,
+which is the estimate at the largest exponent the storage can hold;
+an unsigned char with precision 4 holds about 8*10^7 counts
+and an unsigned short with precision 8 holds about 10^113.
+Increments beyond the capacity are ignored,
+and load and exchange saturate at the largest unsigned long long.
+Storage wider than unsigned short works,
+but increments at exponents past 65535 cost a call to pow.
+
+Approximate counters support only increment, load, and exchange,
+and they have no buffers or brokers.
+
+An approximate increment draws a random number every time,
+so it costs a few nanoseconds even when it writes nothing,
+several times a non-atomic buffer increment.
+Approximate counters pay off in the size of the counter
+and in leaving the shared cache line unwritten.
+Where raw increment throughput matters most,
+use an epoch buffer with a threshold,
+which defers the flush to the prime without losing counts.
+
+
 GUIDELINES FOR USE
 
 Use a simplex counter
@@ -391,6 +586,7 @@ protected:
     Integral load() { return value_; }
     Integral exchange( Integral to )
         { Integral tmp = value_; value_ = to; return tmp; }
+    void store( Integral to ) { value_ = to; }
     Integral value_;
     template< typename, atomicity >
     friend class bumper_array;
@@ -422,6 +618,8 @@ protected:
     Integral exchange( Integral to )
         { Integral tmp = value_.load( std::memory_order_relaxed );
           value_.store( to, std::memory_order_relaxed ); return tmp; }
+    void store( Integral to )
+        { value_.store( to, std::memory_order_relaxed ); }
     std::atomic< Integral > value_;
     template< typename, atomicity >
     friend class bumper_array;
@@ -450,6 +648,8 @@ protected:
     Integral load() { return value_.load( std::memory_order_relaxed ); }
     Integral exchange( Integral to )
         { return value_.exchange( to, std::memory_order_relaxed ); }
+    void store( Integral to )
+        { value_.store( to, std::memory_order_relaxed ); }
     std::atomic< Integral > value_;
     template< typename, atomicity >
     friend class bumper_array;
@@ -477,6 +677,31 @@ public:
     Integral exchange( Integral to ) { return base_type::exchange( to ); }
 };
 
+/*
+   Gauges are simplex counters that may also be stored.
+   They are not bumpers, so that they cannot be the prime of a buffer.
+*/
+
+template< typename Integral,
+          atomicity Atomicity = atomicity::full >
+class gauge
+: private bumper< Integral, Atomicity >
+{
+    typedef bumper< Integral, Atomicity > base_type;
+public:
+    using base_type::operator +=;
+    using base_type::operator -=;
+    using base_type::operator ++;
+    using base_type::operator --;
+    constexpr gauge() : base_type( 0 ) {}
+    constexpr gauge( Integral in ) : base_type( in ) {}
+    gauge( const gauge& ) = delete;
+    gauge& operator=( const gauge& ) = delete;
+    void store( Integral to ) { base_type::store( to ); }
+    Integral load() { return base_type::load(); }
+    Integral exchange( Integral to ) { return base_type::exchange( to ); }
+};
+
 /*
    Buffers reduce contention on counters.
    They require template parameters to specify the atomicity
@@ -507,6 +732,85 @@ private:
     prime_type& prime_;
 };
 
+/*
+   Epoch buffers push when a shared epoch advances
+   or when their count reaches a threshold.
+   The epoch and the prime must outlive the buffer.
+*/
+
+class epoch
+{
+public:
+    epoch() : tick_( 0 ) {}
+    epoch( const epoch& ) = delete;
+    epoch& operator=( const epoch& ) = delete;
+    void advance() { tick_.fetch_add( 1, std::memory_order_relaxed ); }
+    unsigned long current() { return tick_.load( std::memory_order_relaxed ); }
+private:
+    std::atomic< unsigned long > tick_;
+};
+
+class epoch_ticker
+{
+public:
+    epoch_ticker( epoch& e, std::chrono::steady_clock::duration period )
+        : epoch_( e ), period_( period ), stopping_( false ),
+          thread_( &epoch_ticker::run, this ) {}
+    epoch_ticker( const epoch_ticker& ) = delete;
+    epoch_ticker& operator=( const epoch_ticker& ) = delete;
+    ~epoch_ticker()
+        { { std::lock_guard< std::mutex > _( serializer_ );
+            stopping_ = true; }
+          wakeup_.notify_all();
+          thread_.join(); }
+private:
+    void run()
+        { std::unique_lock< std::mutex > lock( serializer_ );
+          while ( !wakeup_.wait_for( lock, period_,
+                                     [this] { return stopping_; } ) )
+              epoch_.advance(); }
+    epoch& epoch_;
+    std::chrono::steady_clock::duration period_;
+    std::mutex serializer_;
+    std::condition_variable wakeup_;
+    bool stopping_;
+    std::thread thread_;
+};
+
+template< typename Integral,
+          atomicity PrimeAtomicity = atomicity::full >
+class epoch_buffer
+{
+    typedef bumper< Integral, PrimeAtomicity > prime_type;
+public:
+    epoch_buffer() = delete;
+    epoch_buffer( prime_type& p, epoch& e,
+                  Integral threshold = std::numeric_limits< Integral >::max() )
+        : value_( 0 ), threshold_( threshold ), prime_( p ), epoch_( e ),
+          seen_( e.current() ) {}
+    epoch_buffer( const epoch_buffer& ) = delete;
+    epoch_buffer& operator=( const epoch_buffer& ) = delete;
+    void operator +=( Integral by ) { value_ += by; check(); }
+    void operator -=( Integral by ) { value_ -= by; check(); }
+    void operator ++() { *this += 1; }
+    void operator ++(int) { *this += 1; }
+    void operator --() { *this -= 1; }
+    void operator --(int) { *this -= 1; }
+    void push()
+        { seen_ = epoch_.current();
+          Integral value = value_; value_ = 0;
+          if ( value != 0 ) prime_ += value; }
+    ~epoch_buffer() { push(); }
+private:
+    void check()
+        { if ( value_ >= threshold_ || epoch_.current() != seen_ ) push(); }
+    Integral value_;
+    Integral threshold_;
+    prime_type& prime_;
+    epoch& epoch_;
+    unsigned long seen_;
+};
+
 /*
    Duplex counters enable a "pull" model of counting.
    Each counter, the prime, may have one or more brokers.
@@ -717,6 +1021,53 @@ weak_broker< Integral >::~weak_broker()
 
 // Counter arrays.
 
+/*
+   Vector summation of contiguous counts for the bulk array operations.
+   The add function returns the number of leading elements it summed;
+   the caller finishes the remainder with scalar loads.
+   The vector loads read the counter storage directly.
+   On x86 the naturally aligned elements of a vector load
+   are each read atomically,
+   which is all that the relaxed scalar loads provide.
+*/
+
+template< size_t Size >
+struct vector_sum
+{
+    static size_t add( void*, const void*, size_t ) { return 0; }
+};
+
+#if defined( __AVX2__ )
+
+#define GCL_COUNTER_VECTOR_SUM( SIZE, TYPE, LANES, ADD ) \
+template<> \
+struct vector_sum< SIZE > \
+{ \
+    static size_t add( void* sum, const void* from, size_t size ) \
+    { \
+        TYPE* s = static_cast< TYPE* >( sum ); \
+        const TYPE* f = static_cast< const TYPE* >( from ); \
+        size_t idx = 0; \
+        for ( ; idx + LANES <= size; idx += LANES ) { \
+            __m256i a = _mm256_loadu_si256( \
+                reinterpret_cast< const __m256i* >( s + idx ) ); \
+            __m256i b = _mm256_loadu_si256( \
+                reinterpret_cast< const __m256i* >( f + idx ) ); \
+            _mm256_storeu_si256( reinterpret_cast< __m256i* >( s + idx ), \
+                                 ADD( a, b ) ); \
+        } \
+        return idx; \
+    } \
+};
+
+GCL_COUNTER_VECTOR_SUM( 1, char, 32, _mm256_add_epi8 )
+GCL_COUNTER_VECTOR_SUM( 2, short, 16, _mm256_add_epi16 )
+GCL_COUNTER_VECTOR_SUM( 4, int, 8, _mm256_add_epi32 )
+GCL_COUNTER_VECTOR_SUM( 8, long long, 4, _mm256_add_epi64 )
+
+#undef GCL_COUNTER_VECTOR_SUM
+
+#endif
 
 template< typename Integral,
           atomicity Atomicity = atomicity::full >
@@ -738,10 +1089,34 @@ protected:
     Integral load( size_type idx ) { return storage[ idx ].load(); }
     Integral exchange( size_type idx, Integral value )
         { return storage[ idx ].exchange( value ); }
+    void add_to( Integral* sum );
+    void drain_to( Integral* sum, Integral value )
+        { size_type size = storage.size();
+          for ( size_type idx = 0; idx < size; ++idx )
+              sum[ idx ] += storage[ idx ].exchange( value ); }
+    void load_all( Integral* out )
+        { std::fill( out, out + storage.size(), Integral( 0 ) );
+          add_to( out ); }
+    void exchange_all( Integral* out, Integral value )
+        { std::fill( out, out + storage.size(), Integral( 0 ) );
+          drain_to( out, value ); }
 private:
     storage_type storage;
 };
 
+template< typename Integral, atomicity Atomicity >
+void bumper_array< Integral, Atomicity >::add_to( Integral* sum )
+{
+    size_type size = storage.size();
+    size_type idx = 0;
+    if ( std::is_integral< Integral >::value
+         && sizeof( value_type ) == sizeof( Integral ) )
+        idx = vector_sum< sizeof( Integral ) >::add(
+                  sum, storage.data(), size );
+    for ( ; idx < size; ++idx )
+        sum[ idx ] += storage[ idx ].load();
+}
+
 template< typename Integral,
           atomicity Atomicity = atomicity::full >
 class simplex_array
@@ -758,6 +1133,9 @@ public:
     Integral load( size_type idx ) { return base_type::load( idx ); }
     Integral exchange( size_type idx, Integral value )
         { return base_type::exchange( idx, value ); }
+    void load_all( Integral* out ) { base_type::load_all( out ); }
+    void exchange_all( Integral* out, Integral value )
+        { base_type::exchange_all( out, value ); }
     value_type& operator[]( int idx ) { return base_type::operator[]( idx ); }
     size_type size() { return base_type::size(); }
 };
@@ -817,19 +1195,23 @@ public:
     strong_duplex_array& operator=( const strong_duplex_array& ) = delete;
     value_type& operator[]( int idx ) { return base_type::operator[]( idx ); }
     size_type size() { return base_type::size(); }
+    Integral load( size_type idx );
+    Integral exchange( size_type idx, Integral value );
+    void load_all( Integral* out );
+    void exchange_all( Integral* out, Integral value );
     ~strong_duplex_array();
 private:
     void insert( broker_type* child );
-    void erase( broker_type* child, Integral by );
+    void erase( broker_type* child );
     std::mutex serializer_;
     typedef std::unordered_set< broker_type* > set_type;
     set_type children_;
 };
 
 template< typename Integral > class strong_broker_array
-: public bumper_array< Integral, atomicity::semi >
+: public bumper_array< Integral, atomicity::full >
 {
-    typedef bumper_array< Integral, atomicity::semi > base_type;
+    typedef bumper_array< Integral, atomicity::full > base_type;
     typedef strong_duplex_array< Integral > duplex_type;
     friend class strong_duplex_array< Integral >;
 public:
@@ -843,12 +1225,89 @@ public:
     ~strong_broker_array();
 private:
     Integral poll( size_type idx )
-      { return base_type::operator[]( idx ).load(); }
+      { return base_type::load( idx ); }
     Integral drain( size_type idx )
-      { return base_type::operator[]( idx ).exchange( 0 ); }
+      { return base_type::exchange( idx, 0 ); }
+    void poll_all( Integral* sum ) { base_type::add_to( sum ); }
+    void drain_all( Integral* sum ) { base_type::drain_to( sum, 0 ); }
     duplex_type& prime_;
 };
 
+template< typename Integral >
+void strong_duplex_array< Integral >::insert( broker_type* child )
+{
+    std::lock_guard< std::mutex > _( serializer_ );
+    assert( children_.insert( child ).second );
+}
+
+template< typename Integral >
+void strong_duplex_array< Integral >::erase( broker_type* child )
+{
+    std::lock_guard< std::mutex > _( serializer_ );
+    size_type size = base_type::size();
+    for ( size_type idx = 0; idx < size; ++idx )
+        base_type::operator[]( idx ) += child->drain( idx );
+    assert( children_.erase( child ) == 1 );
+}
+
+template< typename Integral >
+Integral strong_duplex_array< Integral >::load( size_type idx )
+{
+    typedef typename set_type::iterator iterator;
+    Integral tmp = 0;
+    {
+        std::lock_guard< std::mutex > _( serializer_ );
+        iterator rollcall = children_.begin();
+        for ( ; rollcall != children_.end(); rollcall++ )
+            tmp += (*rollcall)->poll( idx );
+    }
+    return tmp + base_type::load( idx );
+}
+
+template< typename Integral >
+Integral strong_duplex_array< Integral >::exchange( size_type idx,
+                                                    Integral value )
+{
+    typedef typename set_type::iterator iterator;
+    Integral tmp = 0;
+    {
+        std::lock_guard< std::mutex > _( serializer_ );
+        iterator rollcall = children_.begin();
+        for ( ; rollcall != children_.end(); rollcall++ )
+            tmp += (*rollcall)->drain( idx );
+    }
+    return tmp + base_type::exchange( idx, value );
+}
+
+template< typename Integral >
+void strong_duplex_array< Integral >::load_all( Integral* out )
+{
+    typedef typename set_type::iterator iterator;
+    std::fill( out, out + base_type::size(), Integral( 0 ) );
+    {
+        std::lock_guard< std::mutex > _( serializer_ );
+        iterator rollcall = children_.begin();
+        for ( ; rollcall != children_.end(); rollcall++ )
+            (*rollcall)->poll_all( out );
+    }
+    base_type::add_to( out );
+}
+
+template< typename Integral >
+void strong_duplex_array< Integral >::exchange_all( Integral* out,
+                                                    Integral value )
+{
+    typedef typename set_type::iterator iterator;
+    std::fill( out, out + base_type::size(), Integral( 0 ) );
+    {
+        std::lock_guard< std::mutex > _( serializer_ );
+        iterator rollcall = children_.begin();
+        for ( ; rollcall != children_.end(); rollcall++ )
+            (*rollcall)->drain_all( out );
+    }
+    base_type::drain_to( out, value );
+}
+
 template< typename Integral >
 strong_duplex_array< Integral >::~strong_duplex_array()
 {
@@ -868,7 +1327,7 @@ strong_broker_array< Integral >::strong_broker_array( duplex_type& p )
 template< typename Integral >
 strong_broker_array< Integral >::~strong_broker_array()
 {
-    prime_.erase( this, base_type::load() );
+    prime_.erase( this );
 }
 
 
@@ -890,10 +1349,12 @@ public:
     weak_duplex_array& operator=( const weak_duplex_array& ) = delete;
     value_type& operator[]( int idx ) { return base_type::operator[]( idx ); }
     size_type size() { return base_type::size(); }
+    Integral load( size_type idx );
+    void load_all( Integral* out );
     ~weak_duplex_array();
 private:
     void insert( broker_type* child );
-    void erase( broker_type* child, Integral by );
+    void erase( broker_type* child );
     std::mutex serializer_;
     typedef std::unordered_set< broker_type* > set_type;
     set_type children_;
@@ -916,10 +1377,55 @@ public:
     ~weak_broker_array();
 private:
     Integral poll( size_type idx )
-      { return base_type::operator[]( idx ).load(); }
+      { return base_type::load( idx ); }
+    void poll_all( Integral* sum ) { base_type::add_to( sum ); }
     duplex_type& prime_;
 };
 
+template< typename Integral >
+void weak_duplex_array< Integral >::insert( broker_type* child )
+{
+    std::lock_guard< std::mutex > _( serializer_ );
+    assert( children_.insert( child ).second );
+}
+
+template< typename Integral >
+void weak_duplex_array< Integral >::erase( broker_type* child )
+{
+    std::lock_guard< std::mutex > _( serializer_ );
+    size_type size = base_type::size();
+    for ( size_type idx = 0; idx < size; ++idx )
+        base_type::operator[]( idx ) += child->poll( idx );
+    assert( children_.erase( child ) == 1 );
+}
+
+template< typename Integral >
+Integral weak_duplex_array< Integral >::load( size_type idx )
+{
+    typedef typename set_type::iterator iterator;
+    Integral tmp = 0;
+    {
+        std::lock_guard< std::mutex > _( serializer_ );
+        iterator rollcall = children_.begin();
+        for ( ; rollcall != children_.end(); rollcall++ )
+            tmp += (*rollcall)->poll( idx );
+        tmp += base_type::load( idx );
+    }
+    return tmp;
+}
+
+template< typename Integral >
+void weak_duplex_array< Integral >::load_all( Integral* out )
+{
+    typedef typename set_type::iterator iterator;
+    std::fill( out, out + base_type::size(), Integral( 0 ) );
+    std::lock_guard< std::mutex > _( serializer_ );
+    iterator rollcall = children_.begin();
+    for ( ; rollcall != children_.end(); rollcall++ )
+        (*rollcall)->poll_all( out );
+    base_type::add_to( out );
+}
+
 template< typename Integral >
 weak_duplex_array< Integral >::~weak_duplex_array()
 {
@@ -939,11 +1445,486 @@ weak_broker_array< Integral >::weak_broker_array( duplex_type& p )
 template< typename Integral >
 weak_broker_array< Integral >::~weak_broker_array()
 {
-    prime_.erase( this, base_type::load() );
+    prime_.erase( this );
+}
+
+
+// Extremum counters.
+
+/*
+   The extremum policies define the comparison
+   and the least extreme value, which is the default initial value.
+*/
+
+template< typename Integral >
+struct maximum
+{
+    static bool beyond( Integral offer, Integral current )
+        { return offer > current; }
+    static constexpr Integral initial()
+        { return std::numeric_limits< Integral >::min(); }
+};
+
+template< typename Integral >
+struct minimum
+{
+    static bool beyond( Integral offer, Integral current )
+        { return offer < current; }
+    static constexpr Integral initial()
+        { return std::numeric_limits< Integral >::max(); }
+};
+
+/*
+   The extremum bumpers provide the offer interface,
+   in the same three atomicities as the additive bumpers.
+*/
+
+template< typename Integral, typename Extremum, atomicity Atomicity >
+class extremum_bumper;
+
+template< typename Integral, typename Extremum >
+class extremum_bumper< Integral, Extremum, atomicity::none >
+{
+    extremum_bumper( const extremum_bumper& ) = delete;
+    extremum_bumper& operator=( const extremum_bumper& ) = delete;
+public:
+    void offer( Integral value )
+        { if ( Extremum::beyond( value, value_ ) ) value_ = value; }
+protected:
+    constexpr extremum_bumper( Integral in ) : value_( in ) {}
+    Integral load() { return value_; }
+    Integral exchange( Integral to )
+        { Integral tmp = value_; value_ = to; return tmp; }
+    Integral value_;
+};
+
+template< typename Integral, typename Extremum >
+class extremum_bumper< Integral, Extremum, atomicity::semi >
+{
+    extremum_bumper( const extremum_bumper& ) = delete;
+    extremum_bumper& operator=( const extremum_bumper& ) = delete;
+public:
+    void offer( Integral value )
+        { if ( Extremum::beyond( value,
+                   value_.load( std::memory_order_relaxed ) ) )
+              value_.store( value, std::memory_order_relaxed ); }
+protected:
+    constexpr extremum_bumper( Integral in ) : value_( in ) {}
+    Integral load() { return value_.load( std::memory_order_relaxed ); }
+    Integral exchange( Integral to )
+        { return value_.exchange( to, std::memory_order_relaxed ); }
+    std::atomic< Integral > value_;
+};
+
+template< typename Integral, typename Extremum >
+class extremum_bumper< Integral, Extremum, atomicity::full >
+{
+    extremum_bumper( const extremum_bumper& ) = delete;
+    extremum_bumper& operator=( const extremum_bumper& ) = delete;
+public:
+    void offer( Integral value )
+        { Integral current = value_.load( std::memory_order_relaxed );
+          while ( Extremum::beyond( value, current )
+                  && !value_.compare_exchange_weak(
+                         current, value, std::memory_order_relaxed ) ) {} }
+protected:
+    constexpr extremum_bumper( Integral in ) : value_( in ) {}
+    Integral load() { return value_.load( std::memory_order_relaxed ); }
+    Integral exchange( Integral to )
+        { return value_.exchange( to, std::memory_order_relaxed ); }
+    std::atomic< Integral > value_;
+};
+
+template< typename Integral, typename Extremum,
+          atomicity Atomicity = atomicity::full >
+class extremum_simplex
+: public extremum_bumper< Integral, Extremum, Atomicity >
+{
+    typedef extremum_bumper< Integral, Extremum, Atomicity > base_type;
+public:
+    constexpr extremum_simplex() : base_type( Extremum::initial() ) {}
+    constexpr extremum_simplex( Integral in ) : base_type( in ) {}
+    extremum_simplex( const extremum_simplex& ) = delete;
+    extremum_simplex& operator=( const extremum_simplex& ) = delete;
+    Integral load() { return base_type::load(); }
+    Integral exchange( Integral to ) { return base_type::exchange( to ); }
+};
+
+template< typename Integral, typename Extremum > class extremum_broker;
+
+template< typename Integral, typename Extremum > class extremum_duplex
+: public extremum_bumper< Integral, Extremum, atomicity::full >
+{
+    typedef extremum_bumper< Integral, Extremum, atomicity::full > base_type;
+    typedef extremum_broker< Integral, Extremum > broker_type;
+    friend class extremum_broker< Integral, Extremum >;
+public:
+    extremum_duplex() : base_type( Extremum::initial() ) {}
+    extremum_duplex( Integral in ) : base_type( in ) {}
+    extremum_duplex( const extremum_duplex& ) = delete;
+    extremum_duplex& operator=( const extremum_duplex& ) = delete;
+    Integral load();
+    Integral exchange( Integral to );
+    ~extremum_duplex();
+private:
+    void insert( broker_type* child );
+    void erase( broker_type* child );
+    std::mutex serializer_;
+    typedef std::unordered_set< broker_type* > set_type;
+    set_type children_;
+};
+
+template< typename Integral, typename Extremum > class extremum_broker
+: public extremum_bumper< Integral, Extremum, atomicity::semi >
+{
+    typedef extremum_bumper< Integral, Extremum, atomicity::semi > base_type;
+    typedef extremum_duplex< Integral, Extremum > duplex_type;
+    friend class extremum_duplex< Integral, Extremum >;
+public:
+    extremum_broker( duplex_type& p );
+    extremum_broker() = delete;
+    extremum_broker( const extremum_broker& ) = delete;
+    extremum_broker& operator=( const extremum_broker& ) = delete;
+    ~extremum_broker();
+private:
+    Integral poll() { return base_type::load(); }
+    Integral drain( Integral to ) { return base_type::exchange( to ); }
+    duplex_type& prime_;
+};
+
+template< typename Integral, typename Extremum >
+void extremum_duplex< Integral, Extremum >::insert( broker_type* child )
+{
+    std::lock_guard< std::mutex > _( serializer_ );
+    assert( children_.insert( child ).second );
 }
 
+template< typename Integral, typename Extremum >
+void extremum_duplex< Integral, Extremum >::erase( broker_type* child )
+{
+    std::lock_guard< std::mutex > _( serializer_ );
+    this->offer( child->poll() );
+    assert( children_.erase( child ) == 1 );
+}
 
+template< typename Integral, typename Extremum >
+Integral extremum_duplex< Integral, Extremum >::load()
+{
+    typedef typename set_type::iterator iterator;
+    Integral tmp = base_type::load();
+    std::lock_guard< std::mutex > _( serializer_ );
+    iterator rollcall = children_.begin();
+    for ( ; rollcall != children_.end(); rollcall++ ) {
+        Integral value = (*rollcall)->poll();
+        if ( Extremum::beyond( value, tmp ) )
+            tmp = value;
+    }
+    return tmp;
+}
+
+template< typename Integral, typename Extremum >
+Integral extremum_duplex< Integral, Extremum >::exchange( Integral to )
+{
+    typedef typename set_type::iterator iterator;
+    Integral tmp = base_type::exchange( to );
+    std::lock_guard< std::mutex > _( serializer_ );
+    iterator rollcall = children_.begin();
+    for ( ; rollcall != children_.end(); rollcall++ ) {
+        Integral value = (*rollcall)->drain( to );
+        if ( Extremum::beyond( value, tmp ) )
+            tmp = value;
+    }
+    return tmp;
+}
+
+template< typename Integral, typename Extremum >
+extremum_duplex< Integral, Extremum >::~extremum_duplex()
+{
+    std::lock_guard< std::mutex > _( serializer_ );
+    assert( children_.size() == 0 );
+}
+
+template< typename Integral, typename Extremum >
+extremum_broker< Integral, Extremum >::extremum_broker( duplex_type& p )
+:
+    base_type( Extremum::initial() ),
+    prime_( p )
+{
+    prime_.insert( this );
+}
+
+template< typename Integral, typename Extremum >
+extremum_broker< Integral, Extremum >::~extremum_broker()
+{
+    prime_.erase( this );
+}
+
+template< typename Integral, atomicity Atomicity = atomicity::full >
+using max_simplex
+    = extremum_simplex< Integral, maximum< Integral >, Atomicity >;
+template< typename Integral, atomicity Atomicity = atomicity::full >
+using min_simplex
+    = extremum_simplex< Integral, minimum< Integral >, Atomicity >;
+
+template< typename Integral >
+using max_duplex = extremum_duplex< Integral, maximum< Integral > >;
+template< typename Integral >
+using max_broker = extremum_broker< Integral, maximum< Integral > >;
+template< typename Integral >
+using min_duplex = extremum_duplex< Integral, minimum< Integral > >;
+template< typename Integral >
+using min_broker = extremum_broker< Integral, minimum< Integral > >;
+
+// Rate counters.
+
+template< typename Integral,
+          atomicity Atomicity = atomicity::full >
+class rate
+: public bumper< Integral, Atomicity >
+{
+    typedef bumper< Integral, Atomicity > base_type;
+    typedef std::chrono::steady_clock clock;
+public:
+    typedef clock::duration duration;
+    rate() = delete;
+    rate( duration window, size_t samples = 16 )
+        : base_type( 0 ), window_( window ), ring_( samples ),
+          next_( 0 ), filled_( 0 ) {}
+    rate( const rate& ) = delete;
+    rate& operator=( const rate& ) = delete;
+    Integral load() { return base_type::load(); }
+    Integral exchange( Integral to ) { return base_type::exchange( to ); }
+    void sample();
+    double per_second();
+private:
+    struct point
+    {
+        clock::time_point when;
+        Integral count;
+    };
+    void record( const point& now );
+    duration window_;
+    std::mutex serializer_;
+    std::dynarray< point > ring_;
+    size_t next_;
+    size_t filled_;
+};
+
+template< typename Integral, atomicity Atomicity >
+void rate< Integral, Atomicity >::record( const point& now )
+{
+    // Keep at most one sample per ring slot's share of the window,
+    // so that the ring always reaches back across the whole window.
+    if ( filled_ > 0 ) {
+        const point& last = ring_[ ( next_ + ring_.size() - 1 )
+                                   % ring_.size() ];
+        if ( now.when - last.when < window_ / ring_.size() )
+            return;
+    }
+    ring_[ next_ ] = now;
+    next_ = ( next_ + 1 ) % ring_.size();
+    if ( filled_ < ring_.size() )
+        ++filled_;
+}
+
+template< typename Integral, atomicity Atomicity >
+void rate< Integral, Atomicity >::sample()
+{
+    point now = { clock::now(), base_type::load() };
+    std::lock_guard< std::mutex > _( serializer_ );
+    record( now );
+}
+
+template< typename Integral, atomicity Atomicity >
+double rate< Integral, Atomicity >::per_second()
+{
+    point now = { clock::now(), base_type::load() };
+    std::lock_guard< std::mutex > _( serializer_ );
+    // Find the oldest sample still within the window.
+    const point* oldest = NULL;
+    for ( size_t age = filled_; age > 0; --age ) {
+        const point& p = ring_[ ( next_ + ring_.size() - age )
+                                % ring_.size() ];
+        if ( now.when - p.when <= window_ ) {
+            oldest = &p;
+            break;
+        }
+    }
+    // With no sample to measure from, there is no rate to report.
+    double result = std::numeric_limits< double >::quiet_NaN();
+    if ( oldest != NULL && now.when > oldest->when ) {
+        std::chrono::duration< double > elapsed = now.when - oldest->when;
+        result = ( now.count - oldest->count ) / elapsed.count();
+    }
+    record( now );
+    return result;
+}
+// Approximate counters.
+
+/*
+   The scale of an approximate counter gives the probability
+   of incrementing the exponent c, which is b^-c.
+   It is the product of two table entries,
+   so that sixteen-bit exponents do not need a large table.
+   Wider exponents, which only wider storage reaches,
+   compute the power directly.
+*/
+
+template< unsigned Precision >
+class approximate_scale
+{
+public:
+    static const approximate_scale& get()
+        { static const approximate_scale the_scale; return the_scale; }
+    double probability( unsigned long exponent ) const
+        { if ( exponent > 0xffff )
+              return std::pow( base(), -double( exponent ) );
+          return low_[ exponent & 0xff ] * high_[ exponent >> 8 ]; }
+    static double base() { return 1.0 + std::ldexp( 1.0, -int( Precision ) ); }
+    static double estimate( unsigned long exponent )
+        { return ( std::pow( base(), double( exponent ) ) - 1.0 )
+                 / ( base() - 1.0 ); }
+private:
+    approximate_scale()
+    {
+        double inverse = 1.0 / base();
+        double p = 1.0;
+        for ( int i = 0; i < 256; ++i ) {
+            low_[ i ] = p;
+            p *= inverse;
+        }
+        double q = 1.0;
+        for ( int i = 0; i < 256; ++i ) {
+            high_[ i ] = q;
+            q *= p;
+        }
+    }
+    double low_[ 256 ];
+    double high_[ 256 ];
+};
+
+// A uniform random number in [0,1) from a thread-local xorshift generator.
+inline double approximate_random()
+{
+    static thread_local unsigned long long state = 0;
+    if ( state == 0 )
+        state = reinterpret_cast< unsigned long long >( &state )
+                | 1;  // any nonzero per-thread seed
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return ( ( state * 2685821657736338717ULL ) >> 11 )
+           * ( 1.0 / 9007199254740992.0 );
+}
+
+/*
+   The exponent cells hold the exponent with the requested atomicity.
+   The bump operation increments from an expected exponent,
+   and fails if the exponent has changed.
+*/
+
+template< typename Storage, atomicity Atomicity >
+class exponent_cell;
+
+template< typename Storage >
+class exponent_cell< Storage, atomicity::none >
+{
+public:
+    exponent_cell() : value_( 0 ) {}
+    Storage load() { return value_; }
+    bool bump( Storage expected ) { value_ = expected + 1; return true; }
+    Storage exchange( Storage to )
+        { Storage tmp = value_; value_ = to; return tmp; }
+private:
+    Storage value_;
+};
+
+template< typename Storage >
+class exponent_cell< Storage, atomicity::semi >
+{
+public:
+    exponent_cell() : value_( 0 ) {}
+    Storage load() { return value_.load( std::memory_order_relaxed ); }
+    bool bump( Storage expected )
+        { value_.store( expected + 1, std::memory_order_relaxed );
+          return true; }
+    Storage exchange( Storage to )
+        { return value_.exchange( to, std::memory_order_relaxed ); }
+private:
+    std::atomic< Storage > value_;
+};
+
+template< typename Storage >
+class exponent_cell< Storage, atomicity::full >
+{
+public:
+    exponent_cell() : value_( 0 ) {}
+    Storage load() { return value_.load( std::memory_order_relaxed ); }
+    bool bump( Storage expected )
+        { return value_.compare_exchange_strong(
+              expected, Storage( expected + 1 ),
+              std::memory_order_relaxed ); }
+    Storage exchange( Storage to )
+        { return value_.exchange( to, std::memory_order_relaxed ); }
+private:
+    std::atomic< Storage > value_;
+};
+
+template< typename Storage = unsigned short,
+          unsigned Precision = 4,
+          atomicity Atomicity = atomicity::full >
+class approximate
+{
+    static_assert( std::is_unsigned< Storage >::value,
+                   "approximate counters need unsigned storage" );
+    typedef approximate_scale< Precision > scale_type;
+public:
+    approximate() {}
+    approximate( const approximate& ) = delete;
+    approximate& operator=( const approximate& ) = delete;
+    void operator ++() { increment(); }
+    void operator ++(int) { increment(); }
+    unsigned long long load()
+        { return estimate( exponent_.load() ); }
+    // Note that the parameter is the new exponent, not a count.
+    unsigned long long exchange( Storage exponent )
+        { return estimate( exponent_.exchange( exponent ) ); }
+    Storage exponent() { return exponent_.load(); }
+    static double relative_error()
+        { return std::sqrt( std::ldexp( 1.0, -int( Precision ) - 1 ) ); }
+    static double capacity()
+        { return scale_type::estimate(
+              std::numeric_limits< Storage >::max() ); }
+private:
+    // Estimates beyond the range of the result saturate,
+    // as converting them would be undefined.
+    static unsigned long long estimate( Storage exponent )
+        { double count = scale_type::estimate( exponent ) + 0.5;
+          if ( count >= std::ldexp( 1.0, 64 ) )
+              return std::numeric_limits< unsigned long long >::max();
+          return static_cast< unsigned long long >( count ); }
+    void increment();
+    exponent_cell< Storage, Atomicity > exponent_;
+};
+
+template< typename Storage, unsigned Precision, atomicity Atomicity >
+void approximate< Storage, Precision, Atomicity >::increment()
+{
+    const scale_type& scale = scale_type::get();
+    for (;;) {
+        Storage current = exponent_.load();
+        if ( current == std::numeric_limits< Storage >::max() )
+            return;
+        if ( approximate_random() >= scale.probability( current ) )
+            return;
+        if ( exponent_.bump( current ) )
+            return;
+        // Another thread bumped the exponent; decide again at the new one.
+    }
+}
 
 } // namespace counter
 
 } // namespace gcl
+
+#endif  // GCL_COUNTER_
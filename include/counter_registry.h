@@ -0,0 +1,350 @@
+// Copyright 2013 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GCL_COUNTER_REGISTRY_
+#define GCL_COUNTER_REGISTRY_
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "counter.h"
+
+namespace gcl {
+
+namespace counter {
+
+/*
+
+
+REGISTRY
+
+A registry maps names to counters, counter arrays, and histograms,
+so that monitoring code can read all of them
+without knowing their individual types.
+There is one process-wide registry, registry::global(),
+but independent registries may also be constructed.
+
+    counter::weak_duplex<int> red_count;
+    counter::simplex_array<long> shard_requests( 64 );
+
+    counter::registration r1( "red_count", red_count );
+    counter::registration r2( "shard_requests", shard_requests );
+
+A registration inserts its counter on construction
+and erases it on destruction,
+so declare the registration after the counter it names.
+Registering a name that is already present throws std::invalid_argument.
+
+Any type with an Integral load() is registered as a scalar.
+Any type with size() and Integral load( index ) is registered as an array.
+A histogram is an array with one upper bound per bucket,
+the last bucket counting everything above the last bound.
+
+    counter::simplex_array<int> latency_ms( 4 );
+    counter::registration r3( "latency_ms", latency_ms,
+                              { 1, 10, 100 } );
+
+
+SNAPSHOTS
+
+The snapshot operation reads every registered counter with its load method.
+Counter loads never block incrementing threads,
+so taking a snapshot does not show up in the counting code.
+The registry lock is held for the duration of the snapshot,
+which serializes snapshots with registration and deregistration,
+and hence a counter is never read after its registration is destroyed.
+Counts held in buffers are not visible until they are pushed.
+
+A snapshot may be formatted as text, one line per value,
+
+    # gcl.counter 1365000000000
+    red_count 42
+    shard_requests[0] 17
+    latency_ms[<=1] 3
+    latency_ms[>100] 1
+
+or in a compact binary form of variable-length integers.
+The binary form is the magic "GCLC", a version byte,
+the timestamp in milliseconds, and the number of samples.
+Each sample is a name length and name bytes, a kind byte, a value count,
+the zig-zag encoded values and, for histograms, the bounds.
+
+
+EXPORTERS
+
+An exporter periodically snapshots a registry on a background thread
+and hands the formatted bytes to a sink.
+The snapshot and the output buffer are reused between intervals,
+so a steady-state export does not allocate.
+
+    counter::memory_sink latest;
+    counter::exporter ex( counter::registry::global(),
+                          std::chrono::seconds( 10 ),
+                          counter::export_format::text,
+                          latest.sink() );
+
+The file_sink function returns a sink that appends to a file.
+The exporter stops, after one final export, on destruction.
+
+
+*/
+
+typedef long long sample_value;
+
+enum class sample_kind
+{
+    scalar,
+    array,
+    histogram
+};
+
+struct sample
+{
+    std::string name;
+    sample_kind kind;
+    std::vector< sample_value > values;
+    std::vector< sample_value > bounds;
+};
+
+struct snapshot
+{
+    long long timestamp_ms;
+    std::vector< sample > samples;
+};
+
+class registry
+{
+public:
+    typedef std::function< sample_value () > scalar_reader;
+    typedef std::function< void ( std::vector< sample_value >& ) > array_reader;
+
+    registry() {}
+    registry( const registry& ) = delete;
+    registry& operator=( const registry& ) = delete;
+
+    // The process-wide registry.
+    static registry& global();
+
+    // Registers a scalar or, if ctr has load( index ), an array.
+    template< typename Counter >
+    void insert( const std::string& name, Counter& ctr )
+        { insert( name, ctr, is_array< Counter >() ); }
+    template< typename Array >
+    void insert_histogram( const std::string& name, Array& ary,
+                           const std::vector< sample_value >& bounds );
+
+    // Returns false if the name is not registered.
+    bool erase( const std::string& name );
+    size_t size();
+
+    // Reads every registered counter into out, reusing its storage.
+    void take( snapshot& out );
+
+private:
+    template< typename T >
+    class has_indexed_load
+    {
+        template< typename U >
+        static char test( decltype( std::declval< U& >().load( 0 ) )* );
+        template< typename U >
+        static long test( ... );
+    public:
+        static const bool value = sizeof( test< T >( 0 ) ) == 1;
+    };
+    template< typename T >
+    struct is_array
+    : std::integral_constant< bool, has_indexed_load< T >::value > {};
+
+    template< typename Counter >
+    void insert( const std::string& name, Counter& ctr, std::false_type );
+    template< typename Array >
+    void insert( const std::string& name, Array& ary, std::true_type );
+    template< typename Array >
+    static array_reader make_array_reader( Array& ary );
+
+    struct entry
+    {
+        sample_kind kind;
+        scalar_reader scalar;
+        array_reader array;
+        std::vector< sample_value > bounds;
+    };
+    void insert_entry( const std::string& name, const entry& e );
+
+    std::mutex serializer_;
+    typedef std::map< std::string, entry > map_type;
+    map_type entries_;
+};
+
+template< typename Counter >
+void registry::insert( const std::string& name, Counter& ctr,
+                       std::false_type )
+{
+    entry e;
+    e.kind = sample_kind::scalar;
+    e.scalar = [&ctr]() -> sample_value { return ctr.load(); };
+    insert_entry( name, e );
+}
+
+template< typename Array >
+registry::array_reader registry::make_array_reader( Array& ary )
+{
+    return [&ary]( std::vector< sample_value >& out ) {
+        out.resize( ary.size() );
+        for ( size_t i = 0; i < out.size(); ++i )
+            out[ i ] = ary.load( i );
+    };
+}
+
+template< typename Array >
+void registry::insert( const std::string& name, Array& ary,
+                       std::true_type )
+{
+    entry e;
+    e.kind = sample_kind::array;
+    e.array = make_array_reader( ary );
+    insert_entry( name, e );
+}
+
+template< typename Array >
+void registry::insert_histogram( const std::string& name, Array& ary,
+                                 const std::vector< sample_value >& bounds )
+{
+    if ( bounds.size() + 1 != ary.size() )
+        throw std::invalid_argument( "histogram needs one bound per bucket" );
+    entry e;
+    e.kind = sample_kind::histogram;
+    e.array = make_array_reader( ary );
+    e.bounds = bounds;
+    insert_entry( name, e );
+}
+
+/*
+   A registration ties the lifetime of a name to a scope.
+*/
+
+class registration
+{
+public:
+    template< typename Counter >
+    registration( const std::string& name, Counter& ctr,
+                  registry& reg = registry::global() )
+        : registry_( reg ), name_( name )
+        { registry_.insert( name, ctr ); }
+    template< typename Array >
+    registration( const std::string& name, Array& ary,
+                  const std::vector< sample_value >& bounds,
+                  registry& reg = registry::global() )
+        : registry_( reg ), name_( name )
+        { registry_.insert_histogram( name, ary, bounds ); }
+    registration( const registration& ) = delete;
+    registration& operator=( const registration& ) = delete;
+    ~registration() { registry_.erase( name_ ); }
+private:
+    registry& registry_;
+    std::string name_;
+};
+
+/*
+   Formatting of snapshots.
+   Both functions replace the contents of out.
+*/
+
+enum class export_format
+{
+    text,
+    binary
+};
+
+void write_text( const snapshot& in, std::string& out );
+void write_binary( const snapshot& in, std::string& out );
+void write_snapshot( const snapshot& in, export_format fmt,
+                     std::string& out );
+
+// Decodes the output of write_binary; returns false on malformed input.
+bool read_binary( const std::string& in, snapshot& out );
+
+/*
+   Exporters and their sinks.
+*/
+
+typedef std::function< void ( const std::string& ) > export_sink;
+
+// Returns a sink that appends each export to the file at path.
+export_sink file_sink( const std::string& path );
+
+// Retains the most recent export in memory.
+class memory_sink
+{
+public:
+    memory_sink() : exports_( 0 ) {}
+    memory_sink( const memory_sink& ) = delete;
+    memory_sink& operator=( const memory_sink& ) = delete;
+    export_sink sink();
+    std::string contents();
+    size_t exports();
+private:
+    void receive( const std::string& bytes );
+    std::mutex serializer_;
+    std::string contents_;
+    size_t exports_;
+};
+
+class exporter
+{
+public:
+    exporter( registry& reg, std::chrono::milliseconds interval,
+              export_format fmt, export_sink sink );
+    exporter( const exporter& ) = delete;
+    exporter& operator=( const exporter& ) = delete;
+    ~exporter();
+
+    // Exports immediately on the calling thread.
+    void export_now();
+
+    // Stops the background thread after a final export.
+    void stop();
+
+private:
+    void run();
+
+    registry& registry_;
+    std::chrono::milliseconds interval_;
+    export_format format_;
+    export_sink sink_;
+
+    std::mutex export_mu_;
+    snapshot snapshot_;
+    std::string bytes_;
+
+    std::mutex state_mu_;
+    std::condition_variable wakeup_;
+    bool stopping_;
+    std::thread thread_;
+};
+
+} // namespace counter
+
+} // namespace gcl
+
+#endif  // GCL_COUNTER_REGISTRY_
@@ -16,8 +16,10 @@
 #define LOCK_FREE_BUFFER_QUEUE_H
 
 #include <atomic>
+#include <chrono>
 #include <iostream>
 #include <stdint.h>
+#include <thread>
 
 #include "debug.h"
 #include "queue_base.h"
@@ -50,6 +52,24 @@ class lock_free_buffer_queue
     bool is_empty();
     bool is_full();
 
+    // After close, pushes fail and pops fail once the queue is empty.
+    // Pushes must have completed before close is called, or they may be
+    // lost.
+    void close();
+    bool is_closed();
+    // Empties a closed queue and opens it again. No other thread may be
+    // using the queue.
+    void reopen();
+
+    // The waiting operations spin, then yield, then sleep briefly, so the
+    // queue suits busy links better than idle ones.
+    Value value_pop();
+    queue_op_status wait_pop(Value&);
+    void push(const Value& x);
+    queue_op_status wait_push(const Value& x);
+    void push(Value&& x);
+    queue_op_status wait_push(Value&& x);
+
     queue_op_status try_pop(Value&);
     queue_op_status nonblocking_pop(Value&);
     queue_op_status try_push(const Value& x);
@@ -75,6 +95,7 @@ class lock_free_buffer_queue
     // push/pop 2^64 times while one thread sleeps).
     atomic<uint_least64_t> head_;
     atomic<uint_least64_t> tail_;
+    atomic<bool> closed_;
     atomic<value_state> *value_state_;
     Value *values_;
 
@@ -91,6 +112,7 @@ class lock_free_buffer_queue
     // Helper functions.
     void clear_value(value_state old_value, size_t pos);
     void set_state(value_state new_value, size_t pos);
+    static void back_off(unsigned int attempt);
 };
 
 template <typename Value>
@@ -103,6 +125,7 @@ void lock_free_buffer_queue<Value>::init()
     // Set everything empty with no value.
     head_ = 0ULL;
     tail_ = 0ULL;
+    closed_ = false;
     values_ = new Value[cardinality_];    
     value_state_ = new atomic<value_state>[cardinality_];    
     for (unsigned int i = 0; i < cardinality_; ++i) {
@@ -173,6 +196,105 @@ bool lock_free_buffer_queue<Value>::is_full()
     return tail_.load() == (head_.load() + cardinality_);
 }
 
+template <typename Value>
+void lock_free_buffer_queue<Value>::close()
+{
+    closed_.store(true, std::memory_order_release);
+}
+
+template <typename Value>
+void lock_free_buffer_queue<Value>::reopen()
+{
+    if ( !closed_.load(std::memory_order_acquire) )
+        return;
+    head_ = 0ULL;
+    tail_ = 0ULL;
+    for (unsigned int i = 0; i < cardinality_; ++i) {
+        value_state_[i] = value_state::waiting;
+    }
+    closed_.store(false, std::memory_order_release);
+}
+
+template <typename Value>
+bool lock_free_buffer_queue<Value>::is_closed()
+{
+    return closed_.load(std::memory_order_acquire);
+}
+
+template <typename Value>
+void lock_free_buffer_queue<Value>::back_off(unsigned int attempt)
+{
+    if (attempt < 64) {
+        return;
+    } else if (attempt < 128) {
+        std::this_thread::yield();
+    } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+}
+
+template <typename Value>
+queue_op_status lock_free_buffer_queue<Value>::wait_pop(Value& elem)
+{
+    for (unsigned int attempt = 0;; ++attempt) {
+        queue_op_status status = try_pop(elem);
+        if (status != queue_op_status::empty) {
+            return status;
+        }
+        back_off(attempt);
+    }
+}
+
+template <typename Value>
+Value lock_free_buffer_queue<Value>::value_pop()
+{
+    Value elem;
+    if (wait_pop(elem) == queue_op_status::closed) {
+        throw queue_op_status::closed;
+    }
+    return elem;
+}
+
+template <typename Value>
+queue_op_status lock_free_buffer_queue<Value>::wait_push(const Value& elem)
+{
+    for (unsigned int attempt = 0;; ++attempt) {
+        queue_op_status status = try_push(elem);
+        if (status != queue_op_status::full) {
+            return status;
+        }
+        back_off(attempt);
+    }
+}
+
+template <typename Value>
+queue_op_status lock_free_buffer_queue<Value>::wait_push(Value&& elem)
+{
+    for (unsigned int attempt = 0;; ++attempt) {
+        queue_op_status status = try_push(std::move(elem));
+        if (status != queue_op_status::full) {
+            return status;
+        }
+        back_off(attempt);
+    }
+}
+
+template <typename Value>
+void lock_free_buffer_queue<Value>::push(const Value& elem)
+{
+    if (wait_push(elem) == queue_op_status::closed) {
+        throw queue_op_status::closed;
+    }
+}
+
+template <typename Value>
+void lock_free_buffer_queue<Value>::push(Value&& elem)
+{
+    if (wait_push(std::move(elem)) == queue_op_status::closed) {
+        throw queue_op_status::closed;
+    }
+}
+
 template <typename Value>
 queue_op_status lock_free_buffer_queue<Value>::try_pop(Value& elem)
 {
@@ -210,9 +332,11 @@ void lock_free_buffer_queue<Value>::set_state(value_state new_value,
 template <typename Value>
 queue_op_status lock_free_buffer_queue<Value>::nonblocking_pop(Value& elem)
 {
+    // Read closed_ first, so that pushes finished before close are seen.
+    bool closed = closed_.load(std::memory_order_acquire);
     uint_least64_t head = head_.load(std::memory_order_relaxed);
     if (head == tail_.load(std::memory_order_relaxed)) {
-        return queue_op_status::empty;
+        return closed ? queue_op_status::closed : queue_op_status::empty;
     }
 
     // Check that there is a value and head didn't move.
@@ -277,6 +401,9 @@ template <typename Value>
 queue_op_status lock_free_buffer_queue<Value>::nonblocking_push(
     const Value& elem)
 {
+    if (closed_.load(std::memory_order_relaxed)) {
+        return queue_op_status::closed;
+    }
     // Ordering of head and tail lookups don't matter too much since seeing a
     // stale version of head would cause us to think that the queue is full
     // when it no longer is. Though seeing a stale version of tail would be
@@ -338,6 +465,9 @@ queue_op_status lock_free_buffer_queue<Value>::try_push(Value&& elem)
 template <typename Value>
 queue_op_status lock_free_buffer_queue<Value>::nonblocking_push(Value&& elem)
 {
+    if (closed_.load(std::memory_order_relaxed)) {
+        return queue_op_status::closed;
+    }
     // Ordering of head and tail lookups don't matter too much since seeing a
     // stale version of head would cause us to think that the queue is full
     // when it no longer is. Though seeing a stale version of tail would be
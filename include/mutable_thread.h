@@ -16,6 +16,7 @@
 #define GCL_MUTABLE_THREAD__
 
 #include <functional>
+#include <vector>
 
 #include <atomic>
 #include <mutex>
@@ -70,6 +71,14 @@ class mutable_thread {
   // Returns the id of this mutable thread.
   std::thread::id get_id();
 
+  // Restricts the thread to the given CPUs, or if cpus is empty, lets it
+  // run again on the CPUs it could before it was first restricted. Returns
+  // false if the system refuses or does not support it.
+  bool set_affinity(const std::vector<int>& cpus);
+
+  // Whether set_affinity has restricted the thread.
+  bool is_pinned();
+
  private:
   enum thread_state {
     IDLE = 0,    // Ready to run
@@ -100,12 +109,20 @@ class mutable_thread {
   std::mutex thread_state_mu_;
   std::condition_variable thread_paused_cond_;
   std::atomic<int> thread_state_;
+  std::atomic<bool> pinned_;
+  // Where the thread could run before set_affinity restricted it.
+  std::vector<int> unpinned_cpus_;
 
   // Actively running function.
   std::function<void()> run_fn_;
   std::function<void()> queued_fn_;
 };
 
+// The CPUs this process may run on, ordered so that the hardware threads of
+// a core come together, and the cores of a package (socket). Work pinned to
+// neighbouring entries shares caches as far as the machine allows.
+std::vector<int> cpus_by_locality();
+
 }  // namespace gcl
 
 #endif
@@ -16,7 +16,15 @@
 #define GCL_PIPELINE_
 
 #include <assert.h>
+#include <limits.h>
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <set>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -25,13 +33,20 @@
 #include <stdexcept>
 
 #include <functional>
+#include <type_traits>
+#include <utility>
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include "barrier.h"
 #include "buffer_queue.h"
 #include "countdown_latch.h"
 #include "debug.h"
 #include "flex_barrier.h"
+#include "lock_free_buffer_queue.h"
 #include "queue_base.h"
 #include "simple_thread_pool.h"
 
@@ -78,55 +93,564 @@ class segment;
 template <typename IN, typename OUT>
 class __segment_base;
 
+// Selects how the stages of a running plan are mapped onto threads.
+enum class execution_mode {
+  // Every stage gets its own thread from the pool.
+  threads,
+  // Stages that handle one item at a time (make(f) with OUT f(IN), to(f)
+  // with void f(IN), and fan-ins) become tasks that are multiplexed over a
+  // fixed number of worker threads. A task runs only when its input has
+  // data and its output has space. Stages that take a queue_front or
+  // queue_back may block, so they still get their own thread, as do queue
+  // sources. A task on a queue the plan did not make gets a thread to
+  // forward between that queue and one of the plan's.
+  tasks,
+  // The whole plan runs on the thread that calls run(), which returns once
+  // the plan has finished. Each item goes through every stage before the
+  // next is taken, by direct calls instead of queues, and parallel
+  // segments run inline. Only plans made of a source, OUT(IN) functions and
+  // a void(IN) or queue consumer can run this way; run() throws
+  // std::invalid_argument for others. A queue source must be filled and
+  // closed by other threads.
+  serial,
+  // Runs the plan serially on one thread from the pool while timing the
+  // first items. If they cost more than run_options::serial_limit each,
+  // the rest go through the stages on threads of their own, as in
+  // execution_mode::threads; only a queue source can be handed over so.
+  // Plans that cannot run serially run on threads from the start.
+  automatic
+};
+
+// The queue implementation used for a link between two stages.
+enum class queue_kind {
+  buffer,    // buffer_queue: a mutex and condition variables.
+  lock_free  // lock_free_buffer_queue: waits by spinning, for hot links.
+};
+
+struct run_options {
+  run_options() : mode(execution_mode::threads), workers(0),
+                  queue(queue_kind::buffer), queue_capacity(10),
+                  profile(false), trace_every(0),
+                  serial_limit(std::chrono::microseconds(20)) {}
+
+  execution_mode mode;
+  // Worker threads used in tasks mode; zero means one per hardware thread.
+  // Never more workers than tasks are started.
+  size_t workers;
+  // The queue for every link that segment::with_queue has not configured.
+  queue_kind queue;
+  size_t queue_capacity;
+  // Records a stage_profile for every stage; see execution::profile.
+  bool profile;
+  // If not zero, traces one item in trace_every from where it enters the
+  // plan, and records its latency at every stage and through the plan; see
+  // execution::latency. An item is followed by its place in each queue, so
+  // where several stages push to one queue, or pop from it, a trace may
+  // pass to a neighbouring item. Untraced plans pay nothing for this.
+  size_t trace_every;
+  // If not empty, pins each thread the plan starts to one of these CPUs in
+  // turn, in the order of the plan's stages, so that neighbouring stages run
+  // on neighbouring CPUs. Order the CPUs with cpus_by_locality() to keep a
+  // stage and the next on one core or socket. Threads of segments made with
+  // segment::pinned keep their own CPUs.
+  std::vector<int> cpus;
+  // In execution_mode::automatic, the time through the whole plan per item
+  // above which the plan moves from one thread to many.
+  std::chrono::nanoseconds serial_limit;
+};
+
+// What one stage of a running plan has done. A stage is one function of
+// the plan, or a queue source or fan-in the plan adds; each replica of a
+// parallel segment is a stage of its own.
+struct stage_profile {
+  string name;
+  unsigned long long items_in;
+  unsigned long long items_out;
+  // Time in the stage's function, less its waits on the stage's queues.
+  std::chrono::nanoseconds busy;
+  // Time blocked popping input and pushing output.
+  std::chrono::nanoseconds wait_in;
+  std::chrono::nanoseconds wait_out;
+  // The length of the input queue, sampled at every pop. There are no
+  // samples when the input is filled from outside the plan.
+  unsigned long long queue_samples;
+  double queue_mean;
+  long long queue_max;
+};
+
+const int kLatencyBuckets = 48;
+
+// Latencies of the items a plan traced, counted by powers of two: bucket i
+// holds those of at least 2^i ns and under 2^(i+1) ns, and bucket 0 also
+// those under a nanosecond.
+struct latency_histogram {
+  latency_histogram() : count(0), total(0), max(0) {}
+
+  unsigned long long count;
+  std::chrono::nanoseconds total;
+  std::chrono::nanoseconds max;
+  std::vector<unsigned long long> buckets;  // Empty if count is zero.
+
+  std::chrono::nanoseconds mean() const {
+    return count == 0 ? total : std::chrono::nanoseconds(total.count() / count);
+  }
+  // A latency that the fraction q of the samples do not exceed: the top of
+  // the bucket holding the q-quantile, or max if that is less.
+  std::chrono::nanoseconds quantile(double q) const {
+    unsigned long long rank = std::ceil(q * count);
+    unsigned long long seen = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+      seen += buckets[i];
+      if (seen >= rank && seen > 0) {
+        return std::min(max, std::chrono::nanoseconds(2LL << i));
+      }
+    }
+    return max;
+  }
+};
+
+// The latency of traced items at one stage; see run_options::trace_every.
+struct stage_latency {
+  string name;
+  // From the push of an item into the stage's input to the stage's pop of
+  // it. There are no samples when the input is filled from outside the
+  // plan.
+  latency_histogram queued;
+  // From the pop of an item to the stage's push of it, or of what it made
+  // of it, onward; or, if the item goes no further, to the stage's next
+  // pop.
+  latency_histogram in_stage;
+};
+
+// What execution::advise makes of a stage of the plan, counting the
+// replicas of a parallel segment together.
+struct stage_advice {
+  string name;
+  size_t replicas;
+  // The time a replica spends in the stage's function per item.
+  std::chrono::nanoseconds cost;
+  // The fractions of the stage's time spent in its function, blocked
+  // popping input and blocked pushing output.
+  double busy;
+  double blocked_in;
+  double blocked_out;
+  // The replicas the stage needs to keep up with the target rate, which
+  // parallel() can give it. Sources and fan-ins cannot be replicated, so
+  // for them this is replicas.
+  size_t advised_replicas;
+};
+
+// Which stage of a profiled plan limits its throughput, and what to do
+// about it.
+struct plan_advice {
+  plan_advice() : bottleneck(0), max_rate(0), headroom(0) {}
+
+  // In plan order; empty if the plan was not profiled.
+  std::vector<stage_advice> stages;
+  // The index in stages of the stage with the highest cost per item, for
+  // its replicas.
+  size_t bottleneck;
+  // The items per second the bottleneck can take, at most.
+  double max_rate;
+  // How many times faster the bottleneck would have to get before the
+  // next slowest stage limited the plan; 0 if there is no other stage.
+  double headroom;
+  // Stages that were often blocked waiting on their input queue while
+  // the stage before them was often blocked on the queue being full, so
+  // that both stalled on bursts. A larger with_queue capacity for these
+  // stages would absorb them. Fan-ins are never listed.
+  std::vector<string> small_queues;
+
+  // The advice as text.
+  string report() const;
+};
+
+// The fraction of its time a stage must stall on a queue before the queue
+// is advised to grow.
+const double kAdviceStall = 0.1;
+
+// Collects a latency_histogram from any number of threads.
+class __latency_recorder {
+ public:
+  __latency_recorder() { reset(); }
+
+  void add(long long ns) {
+    ns = std::max(ns, 0LL);
+    int bucket = 0;
+    while (bucket < kLatencyBuckets - 1 && (ns >> (bucket + 1)) != 0) {
+      ++bucket;
+    }
+    ++buckets_[bucket];
+    ++count_;
+    total_ += ns;
+    long long max = max_;
+    while (ns > max && !max_.compare_exchange_weak(max, ns)) {
+    }
+  }
+  latency_histogram histogram() {
+    latency_histogram h;
+    h.count = count_;
+    h.total = std::chrono::nanoseconds(total_);
+    h.max = std::chrono::nanoseconds(max_);
+    if (h.count > 0) {
+      h.buckets.assign(buckets_, buckets_ + kLatencyBuckets);
+    }
+    return h;
+  }
+  void reset() {
+    for (int i = 0; i < kLatencyBuckets; ++i) {
+      buckets_[i] = 0;
+    }
+    count_ = 0;
+    total_ = 0;
+    max_ = 0;
+  }
+
+ private:
+  std::atomic<unsigned long long> buckets_[kLatencyBuckets];
+  std::atomic<unsigned long long> count_;
+  std::atomic<long long> total_;
+  std::atomic<long long> max_;
+};
+
+// Items pushed to and popped from one queue by the stages of a profiled or
+// traced plan, from which the stages sample its length.
+struct __queue_tally {
+  __queue_tally() :
+      pushed(0), popped(0), fed(false), read(false),
+      next_traced(kNoneTraced) {}
+  std::atomic<long long> pushed;
+  std::atomic<long long> popped;
+  bool fed;  // Whether a stage pushes to the queue.
+  bool read;  // Whether a stage pops from it.
+
+  // The traced items in the queue, by their place in it: for each, when
+  // it entered the plan and when it was pushed. next_traced is the first
+  // place, so that pops can pass untraced items without the lock.
+  static const long long kNoneTraced = LLONG_MAX;
+  std::mutex trace_mu;
+  std::map<long long, std::pair<long long, long long> > traced;
+  std::atomic<long long> next_traced;
+};
+
+class __instance;
+class __stage;
+
+// Whether an execution has been cancelled, for stage functions that should
+// give up long-running work early. A token is valid while its execution is.
+class cancellation_token {
+ public:
+  // A token that is never cancelled.
+  cancellation_token() : flag_(NULL) {}
+  explicit cancellation_token(const std::atomic<bool>* flag) : flag_(flag) {}
+
+  bool is_cancelled() const {
+    return flag_ != NULL && flag_->load();
+  }
+
+ private:
+  const std::atomic<bool>* flag_;
+};
+
+// The cancellation flag of the execution whose stage runs on this thread.
+inline const std::atomic<bool>*& __current_cancel_flag() {
+  static thread_local const std::atomic<bool>* flag = NULL;
+  return flag;
+}
+
+// The instance whose task worker is running on this thread, if any.
+inline __instance*& __current_task_worker() {
+  static thread_local __instance* inst = NULL;
+  return inst;
+}
+
+// The traced item a stage on this thread has popped and not yet passed on.
+struct __trace_context {
+  __stage* stage;  // NULL if there is none.
+  long long start;  // When the item entered the plan.
+  long long popped;
+};
+
+inline __trace_context& __current_trace() {
+  static thread_local __trace_context context = { NULL, 0, 0 };
+  return context;
+}
+
+// A traced item on its way into a queue.
+struct __trace_mark {
+  __trace_mark() : traced(false) {}
+  bool traced;
+  long long start;
+  long long pushing;  // When the push began.
+  long long place;  // The item's place in the queue.
+  __trace_context context;  // The context before the push, to restore.
+};
+
+// The token of the execution whose stage is running on the calling thread,
+// or outside of a stage, a token that is never cancelled.
+inline cancellation_token current_cancellation_token() {
+  return cancellation_token(__current_cancel_flag());
+}
+
+enum class __task_status {
+  progress,  // Moved at least one item; run again soon.
+  blocked,   // Input empty or output full; run again once a neighbour moves.
+  done       // Input closed and drained; never run again.
+};
+
+class __task {
+ public:
+  virtual ~__task() {}
+  // Moves as many items as possible without ever blocking.
+  virtual __task_status step() = 0;
+  // Readies the task for another run of a prepared_plan.
+  virtual void reset() {}
+};
+
+// Given the nanoseconds the last item took, whether a serial run should
+// take another.
+typedef std::function<bool (long long)> __serial_budget;
+// Runs a plan serially, as long as an empty budget or the budget allows.
+// Returns true if the plan finished, or false if the budget stopped it
+// before its source was done.
+typedef std::function<bool (__serial_budget)> __serial_loop;
+
 class __instance {
  public:
+  // Throws std::runtime_error if the pool cannot supply enough threads, in
+  // which case no stage has started. Unless launch is false, the stages
+  // start at once; otherwise they wait for relaunch().
   __instance(simple_thread_pool* pool,
-           __segment_base<terminated, terminated>* p);
+             __segment_base<terminated, terminated>* p,
+             const run_options& options,
+             bool launch = true);
   ~__instance();
 
+  // Starts the stages again on the threads they ran on last time, once
+  // they have finished. Throws std::logic_error if they have not.
+  void relaunch();
+
   bool is_done() {
     return done_;
   }
   void wait() {
     end_.wait();
-    thread_end_->arrive_and_wait();
+    std::unique_lock<std::mutex> lock(join_mu_);
+    if (thread_end_ != NULL && !joined_) {
+      thread_end_->arrive_and_wait();
+      joined_ = true;
+    }
     assert(is_done());
   }
 
   void thread_start() {
+    enter_thread();
     start_.wait();
   }
   void thread_done() {
+    leave_thread();
     thread_end_->arrive_and_wait();
   }
+  // Make current_cancellation_token() on this thread refer to the instance,
+  // for threads that do not call thread_start() and thread_done().
+  void enter_thread() {
+    __current_cancel_flag() = &cancelled_;
+  }
+  void leave_thread() {
+    __current_cancel_flag() = NULL;
+  }
+
+  // Closes every queue and stops every stage; see execution::cancel.
+  void cancel();
+  bool cancelled() {
+    return cancelled_;
+  }
+  cancellation_token token() {
+    return cancellation_token(&cancelled_);
+  }
+  // Runs func on its own thread once the instance starts.
   void execute(std::function<void ()> func) {
     num_threads_++;
-    // TODO(aberkan): handle errors
-    pool_->try_get_unused_thread()->execute(func);
+    startup_.push_back(func);
+    thread_cpus_.push_back(std::vector<int>());
+  }
+  // The number of calls to execute() so far.
+  size_t executed() {
+    return startup_.size();
+  }
+  // Pins the threads of the calls to execute() from the first-th on.
+  void pin(size_t first, const std::vector<int>& cpus) {
+    for (size_t i = first; i < thread_cpus_.size(); ++i) {
+      thread_cpus_[i] = cpus;
+    }
+  }
+
+  // Whether stages that support it should schedule() a task instead of
+  // calling execute().
+  bool runs_tasks() {
+    return options_.mode == execution_mode::tasks;
+  }
+  // Takes ownership of task.
+  void schedule(__task* task) {
+    tasks_.push_back(task);
+  }
+  // Whether the stages' queues should wake blocked tasks when they change.
+  bool wakes_tasks() {
+    return options_.mode != execution_mode::serial;
+  }
+  // Called after a thread other than a task worker has changed a queue of
+  // the plan: readies the blocked tasks, which may now move.
+  void wake_tasks() {
+    if (tasks_.empty() || __current_task_worker() == this) {
+      return;  // The workers see their own tasks' changes.
+    }
+    ++wakes_;
+    if (blocked_ != 0) {
+      std::unique_lock<std::mutex> lock(task_mu_);
+      unblock_tasks();
+      task_ready_.notify_all();
+    }
+  }
+
+  // Makes a queue of the kind in the run_options. A capacity of zero means
+  // the run_options capacity.
+  template<typename T>
+  queue_base<T>* make_queue(size_t capacity = 0) {
+    if (capacity == 0) {
+      capacity = options_.queue_capacity;
+    }
+    queue_base<T>* queue;
+    if (options_.queue == queue_kind::lock_free) {
+      queue = new queue_object<lock_free_buffer_queue<T> >(capacity);
+    } else {
+      queue = new queue_object<buffer_queue<T> >(capacity);
+    }
+    made_queue(queue);
+    return queue;
+  }
+  // Records that queue is one of the plan's own, whose every use goes
+  // through a stage.
+  void made_queue(const void* queue) {
+    made_queues_.insert(queue);
+  }
+  bool made(const void* queue) {
+    return made_queues_.count(unalias(queue)) != 0;
+  }
+  // Makes alias, a queue that only passes items on to queue, stand for it
+  // in tallies and made().
+  void alias_queue(const void* alias, const void* queue) {
+    aliases_[alias] = queue;
+  }
+  size_t queue_capacity() {
+    return options_.queue_capacity;
+  }
+  // For stages that take threads beyond those the plan starts with.
+  simple_thread_pool* pool() {
+    return pool_;
   }
 
+  // Registers a stage of the plan; the instance owns it.
+  __stage* add_stage(const string& name);
+  bool profiling() {
+    return options_.profile;
+  }
+  size_t trace_every() {
+    return options_.trace_every;
+  }
+  // The tally of a queue, shared by every stage using it.
+  __queue_tally* tally(const void* queue);
+  const void* unalias(const void* queue) {
+    std::map<const void*, const void*>::iterator it = aliases_.find(queue);
+    return it == aliases_.end() ? queue : it->second;
+  }
+  std::vector<stage_profile> profile();
+  void add_end_to_end(long long ns) {
+    end_to_end_.add(ns);
+  }
+  latency_histogram end_to_end() {
+    return end_to_end_.histogram();
+  }
+  std::vector<stage_latency> latency();
+  plan_advice advise(double items_per_second);
+  size_t stage_count() {
+    return stages_.size();
+  }
+  // Records that the stages from first on make up n replicas of one
+  // segment, each with the same stages in the same order.
+  void mark_replicas(size_t first, size_t n);
+
   size_t all_threads_done() {
     // This method is invoked after all threads have called
     // count_down_and_wait(), but not before they have all exited. To ensure
     // that a caller cannot return from wait() until all threads have exited
     // count_down_and_wait(), we reset the barrier, and re-use it for a final
-    // test in __instance::wait().
-    bool do_count_down = done_ ? false : true;
-    done_ = true;
-    if (do_count_down) {
-      end_.count_down();
+    // test in __instance::wait(). After that test, the barrier is reset for
+    // the threads of the next run.
+    if (done_) {
+      return num_threads_;
     }
+    done_ = true;
+    end_.count_down();
     return 1;
   }
 
  private:
+  void prepare();
+  void launch();
+  void release_threads();
+  void run_tasks();
+  // Moves every blocked task to the ready ones; needs task_mu_.
+  void unblock_tasks() {
+    ready_tasks_.insert(ready_tasks_.end(), blocked_tasks_.begin(),
+                        blocked_tasks_.end());
+    blocked_tasks_.clear();
+    blocked_ = 0;
+  }
+  void run_automatic();
+  void delete_stages();
+
   countdown_latch start_;
   countdown_latch end_;
   int num_threads_;
   bool done_;
+  std::mutex join_mu_;
+  bool joined_;  // Whether wait() has passed the final barrier.
+  bool prepared_;  // Whether threads are kept for relaunch().
+  std::atomic<bool> cancelled_;
   flex_barrier* thread_end_;
   simple_thread_pool* pool_;
-  queue_object<buffer_queue<terminated> > dummy_queue_;
+  run_options options_;
+
+  // The function of each thread, the CPUs it is pinned to, if any, and the
+  // threads claimed for them.
+  std::vector<std::function<void ()> > startup_;
+  std::vector<std::vector<int> > thread_cpus_;
+  std::vector<mutable_thread*> threads_;
+
+  // All tasks, and the scheduler state shared by the task workers.
+  std::vector<__task*> tasks_;
+  std::mutex task_mu_;
+  std::condition_variable task_ready_;
+  std::deque<__task*> ready_tasks_;
+  std::vector<__task*> blocked_tasks_;
+  size_t live_tasks_;
+  // The number of blocked tasks, and of calls to wake_tasks(), which pair
+  // up so that a task never blocks on a change it missed.
+  std::atomic<size_t> blocked_;
+  std::atomic<unsigned long long> wakes_;
+  std::set<const void*> made_queues_;
+  std::map<const void*, const void*> aliases_;
+
+  // The plan as one loop, in execution_mode::serial and automatic; and in
+  // automatic, the instance running the rest of the items on threads.
+  __serial_loop serial_;
+  std::mutex sub_mu_;
+  __instance* sub_;
+
+  // Stages in the order the plan ran them, and the tallies of their queues.
+  std::vector<__stage*> stages_;
+  std::map<const void*, __queue_tally*> tallies_;
+  __latency_recorder end_to_end_;
 
   __segment_base<terminated, terminated>* plan_;
 
@@ -135,10 +659,16 @@ class __instance {
 
 class execution {
  public:
-  execution(__instance* inst) : inst_(inst) {}
+  // Unless owns is false, the execution deletes inst when it is destroyed;
+  // otherwise it only waits for it.
+  execution(__instance* inst, bool owns = true) : inst_(inst), owns_(owns) {}
   execution(const execution& exec); // undefined
   ~execution() {
-    delete inst_;
+    if (owns_) {
+      delete inst_;
+    } else {
+      inst_->wait();
+    }
   }
   bool is_done() {
     return inst_->is_done();
@@ -147,14 +677,697 @@ class execution {
     inst_->wait();
   }
 
+  // Stops the plan without letting queued items flow through it. Every
+  // queue of the plan is closed, including any it was given, which wakes
+  // blocked stages; each stage stops before its next item, and the items
+  // still queued are discarded. A stage function already working on an
+  // item finishes it first, so long-running functions should poll
+  // current_cancellation_token(). Returns once every thread of the plan is
+  // back in the pool, or for a prepared_plan, idle. Must not be called from
+  // a stage of the plan.
+  void cancel() {
+    inst_->cancel();
+  }
+  bool is_cancelled() {
+    return inst_->cancelled();
+  }
+  // The token stage functions see, for use outside the plan.
+  cancellation_token token() {
+    return inst_->token();
+  }
+
+  // One entry per stage, in plan order, if the plan ran with
+  // run_options.profile; otherwise empty. May be called while the plan
+  // runs, in which case the figures are a snapshot.
+  std::vector<stage_profile> profile() {
+    return inst_->profile();
+  }
+  // The profile as a table, one line per stage.
+  string report();
+
+  // The latency of traced items from where they entered the plan to where
+  // they left it, if the plan ran with run_options.trace_every. An item
+  // leaves the plan when a stage pushes it to a queue no stage pops, or
+  // takes it and pushes nothing onward. May be called while the plan runs.
+  latency_histogram end_to_end_latency() {
+    return inst_->end_to_end();
+  }
+  // The latency of traced items at each stage, in plan order, if the plan
+  // ran with run_options.trace_every; otherwise empty.
+  std::vector<stage_latency> latency() {
+    return inst_->latency();
+  }
+
+  // Finds the stage that limits a profiled plan, and advises replicas for
+  // every stage to keep up with items_per_second, or if that is zero, to
+  // take the bottleneck as fast as the next slowest stage goes. May be
+  // called while the plan runs, to advise on what it has done so far.
+  plan_advice advise(double items_per_second = 0) {
+    return inst_->advise(items_per_second);
+  }
+
 private:
 
   // TODO(aberkan): should be shared_ptr
   __instance* inst_;
+  bool owns_;
 };
 
 typedef segment<terminated, terminated> plan;
 
+// The queue feeding a stage. It is made when the plan runs, as the segment
+// chose with with_queue or else as the run_options say. Copies share the
+// choice but not the queue.
+template<typename T>
+class __link {
+ public:
+  typedef std::function<queue_base<T>* (size_t)> maker;
+
+  __link() : queue_(NULL), capacity_(0) {}
+  __link(const __link<T>& other) :
+      queue_(NULL), maker_(other.maker_), capacity_(other.capacity_) {}
+  ~__link() { delete queue_; }
+
+  // An empty maker keeps the run_options kind; a zero capacity keeps the
+  // run_options capacity.
+  void choose(maker m, size_t capacity) {
+    if (m) {
+      maker_ = m;
+    }
+    capacity_ = capacity;
+  }
+  void choose_as(const __link<T>& other) {
+    maker_ = other.maker_;
+    capacity_ = other.capacity_;
+  }
+
+  queue_base<T>* get(__instance* inst) {
+    if (queue_ == NULL) {
+      if (maker_) {
+        queue_ = maker_(capacity_ != 0 ? capacity_ : inst->queue_capacity());
+        inst->made_queue(queue_);
+      } else {
+        queue_ = inst->make_queue<T>(capacity_);
+      }
+    }
+    return queue_;
+  }
+
+ private:
+  __link<T>& operator=(const __link<T>&);  // undefined
+
+  queue_base<T>* queue_;
+  maker maker_;
+  size_t capacity_;
+};
+
+// A stage of a running plan. Worker threads and tasks reach the instance
+// through it and, when the plan is profiled, record what they do in it.
+class __stage {
+ public:
+  __stage(__instance* inst, const string& name) :
+      inst_(inst), name_(name), profiling_(inst->profiling()),
+      primary_(NULL), fan_in_(false), trace_every_(inst->trace_every()),
+      reads_(false),
+      since_(now()),
+      items_in_(0), items_out_(0), busy_(0), wait_in_(0), wait_out_(0),
+      samples_(0), sample_sum_(0), sample_max_(0), entered_(0) {}
+
+  __instance* instance() { return inst_; }
+  bool profiling() { return profiling_; }
+  bool tracing() { return trace_every_ != 0; }
+
+  // For the stages of a parallel segment's replicas but the first, the
+  // stage of the first replica they copy.
+  void replicate(__stage* primary) { primary_ = primary; }
+  __stage* primary() { return primary_ != NULL ? primary_ : this; }
+  // Whether the stage forwards from several queues into one.
+  void mark_fan_in() { fan_in_ = true; }
+  bool fan_in() { return fan_in_; }
+
+  void start() { inst_->thread_start(); }
+  void done() { inst_->thread_done(); }
+
+  bool cancelled() { return inst_->cancelled(); }
+  // Adds something to do, such as waking the stage, when the plan is
+  // cancelled. The cancellation is visible by then.
+  void on_cancel(std::function<void ()> action) {
+    cancel_actions_.push_back(action);
+  }
+  void cancel() {
+    for (size_t i = 0; i < cancel_actions_.size(); ++i) {
+      cancel_actions_[i]();
+    }
+  }
+  // Adds something to do, such as resetting the stage's state, before
+  // another run of a prepared_plan.
+  void on_rerun(std::function<void ()> action) {
+    rerun_actions_.push_back(action);
+  }
+  void rerun() {
+    items_in_ = 0;
+    items_out_ = 0;
+    busy_ = 0;
+    wait_in_ = 0;
+    wait_out_ = 0;
+    samples_ = 0;
+    sample_sum_ = 0;
+    sample_max_ = 0;
+    since_ = now();
+    entered_ = 0;
+    queued_.reset();
+    in_stage_.reset();
+    for (size_t i = 0; i < rerun_actions_.size(); ++i) {
+      rerun_actions_[i]();
+    }
+  }
+
+  // Registers q to be closed if the plan is cancelled, and reopened before
+  // it runs again. Returns the queue for the stage to use in q's place,
+  // which records the stage's use of q when profiling or tracing, and
+  // wakes the plan's blocked tasks when q changes.
+  template<typename T>
+  queue_front<T> watch(queue_front<T> q);
+  template<typename T>
+  queue_back<T> watch(queue_back<T> q);
+  // Like watch(), for a task. The task workers learn of changes to the
+  // plan's own queues only, so for any other queue this returns one of the
+  // plan's, and starts a thread forwarding between the two.
+  template<typename T>
+  queue_front<T> watch_task(queue_front<T> q);
+  template<typename T>
+  queue_back<T> watch_task(queue_back<T> q);
+
+  static long long now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+  void add_busy(long long ns) { busy_ += ns; }
+  void add_wait_in(long long ns) { wait_in_ += ns; }
+  void add_wait_out(long long ns) { wait_out_ += ns; }
+  long long waits() { return wait_in_ + wait_out_; }
+
+  void popped(size_t n, __queue_tally* tally) {
+    items_in_ += n;
+    if (tally == NULL) {
+      return;
+    }
+    long long length = tally->pushed - (tally->popped += n);
+    if (tally->fed) {
+      length = std::max(length, 0LL);
+      ++samples_;
+      sample_sum_ += length;
+      long long max = sample_max_;
+      while (length > max && !sample_max_.compare_exchange_weak(max, length)) {
+      }
+    }
+  }
+  void pushed(size_t n, __queue_tally* tally) {
+    items_out_ += n;
+    if (tally != NULL) {
+      tally->pushed += n;
+    }
+  }
+
+  stage_profile profile() {
+    stage_profile p;
+    p.name = name_;
+    p.items_in = items_in_;
+    p.items_out = items_out_;
+    p.busy = std::chrono::nanoseconds(busy_);
+    p.wait_in = std::chrono::nanoseconds(wait_in_);
+    p.wait_out = std::chrono::nanoseconds(wait_out_);
+    p.queue_samples = samples_;
+    p.queue_mean = samples_ == 0 ? 0.0 : double(sample_sum_) / samples_;
+    p.queue_max = sample_max_;
+    return p;
+  }
+
+  // Before n items are pushed to a queue: if the first of them is traced,
+  // enters it in the queue's tally at its place. Items of a stage with no
+  // input enter the plan here, one in trace_every.
+  __trace_mark trace_push(size_t n, __queue_tally* tally) {
+    __trace_mark mark;
+    __trace_context& context = __current_trace();
+    mark.context = context;
+    if (context.stage == this) {
+      context.stage = NULL;
+      if (context.popped < since_) {
+        return mark;  // Left over from an earlier run
+      }
+    } else if (reads_ || !enter(n)) {
+      return mark;
+    }
+    mark.traced = true;
+    mark.pushing = now();
+    mark.start = mark.context.stage == this ? mark.context.start
+                                            : mark.pushing;
+    if (tally->read) {
+      mark.place = tally->pushed;
+      std::lock_guard<std::mutex> lock(tally->trace_mu);
+      tally->traced[mark.place] =
+          std::make_pair(mark.start, mark.pushing);
+      tally->next_traced = tally->traced.begin()->first;
+    }
+    return mark;
+  }
+  // After the push of a traced item. If it failed, the stage holds the
+  // item again.
+  void trace_pushed(const __trace_mark& mark, bool success,
+                    __queue_tally* tally) {
+    if (!success) {
+      if (tally->read) {
+        std::lock_guard<std::mutex> lock(tally->trace_mu);
+        tally->traced.erase(mark.place);
+        tally->next_traced = tally->traced.empty() ?
+            __queue_tally::kNoneTraced : tally->traced.begin()->first;
+      }
+      __current_trace() = mark.context;
+      return;
+    }
+    if (mark.context.stage == this) {
+      in_stage_.add(mark.pushing - mark.context.popped);
+    }
+    if (!tally->read) {
+      inst_->add_end_to_end(mark.pushing - mark.start);  // Left the plan
+    }
+  }
+  // After a pop that began at begin and took n items, perhaps none. Ends
+  // the trace of the item the stage popped last if it went no further, and
+  // takes up that of any of the n items. Items from outside the plan enter
+  // it here, one in trace_every.
+  void trace_popped(long long begin, size_t n, __queue_tally* tally) {
+    __trace_context& context = __current_trace();
+    if (context.stage == this) {
+      context.stage = NULL;
+      if (context.popped >= since_) {
+        in_stage_.add(begin - context.popped);
+        inst_->add_end_to_end(begin - context.start);
+      }
+    }
+    if (n == 0) {
+      return;
+    }
+    if (!tally->fed) {
+      if (enter(n)) {
+        long long t = now();
+        __trace_context entered = { this, t, t };
+        context = entered;
+      }
+      return;
+    }
+    long long end = tally->popped;
+    if (tally->next_traced >= end) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(tally->trace_mu);
+    // Drop any entries the pops of other stages passed over.
+    std::map<long long, std::pair<long long, long long> >::iterator it;
+    while ((it = tally->traced.begin()) != tally->traced.end() &&
+           it->first < end) {
+      if (it->first >= end - static_cast<long long>(n) &&
+          context.stage != this) {
+        long long t = now();
+        queued_.add(t - it->second.second);
+        __trace_context taken = { this, it->second.first, t };
+        context = taken;
+      }
+      tally->traced.erase(it);
+    }
+    tally->next_traced = tally->traced.empty() ?
+        __queue_tally::kNoneTraced : tally->traced.begin()->first;
+  }
+
+  stage_latency latency() {
+    stage_latency l;
+    l.name = name_;
+    l.queued = queued_.histogram();
+    l.in_stage = in_stage_.histogram();
+    return l;
+  }
+
+ private:
+  // Whether one of the next n items to enter the plan here is traced.
+  bool enter(size_t n) {
+    unsigned long long before = entered_.fetch_add(n);
+    return before / trace_every_ != (before + n) / trace_every_;
+  }
+
+  template<typename T>
+  queue_base<T>* guard(queue_base<T>* queue);
+  template<typename T>
+  queue_base<T>* probe(queue_base<T>* queue, bool read);
+  template<typename T>
+  queue_base<T>* wake(queue_base<T>* queue);
+  template<typename T>
+  queue_base<T>* keep(queue_base<T>* queue) {
+    probes_.push_back(std::shared_ptr<void>(queue));
+    return queue;
+  }
+
+  __instance* inst_;
+  string name_;
+  bool profiling_;
+  __stage* primary_;
+  bool fan_in_;
+  size_t trace_every_;
+  bool reads_;  // Whether the stage pops from a queue of the plan.
+  std::atomic<long long> since_;  // When the current run began.
+  std::vector<std::function<void ()> > cancel_actions_;
+  std::vector<std::function<void ()> > rerun_actions_;
+  // The queues made by watch() and watch_task().
+  std::vector<std::shared_ptr<void> > probes_;
+
+  std::atomic<unsigned long long> items_in_;
+  std::atomic<unsigned long long> items_out_;
+  std::atomic<long long> busy_;
+  std::atomic<long long> wait_in_;
+  std::atomic<long long> wait_out_;
+  std::atomic<unsigned long long> samples_;
+  std::atomic<long long> sample_sum_;
+  std::atomic<long long> sample_max_;
+  std::atomic<unsigned long long> entered_;
+  __latency_recorder queued_;
+  __latency_recorder in_stage_;
+};
+
+// Adds the time until it is destroyed, less the stage's waits on its
+// queues meanwhile, to the stage's busy time.
+class __busy_scope {
+ public:
+  explicit __busy_scope(__stage* stage) :
+      stage_(stage->profiling() ? stage : NULL) {
+    if (stage_ != NULL) {
+      begin_ = __stage::now();
+      waits_ = stage_->waits();
+    }
+  }
+  ~__busy_scope() {
+    if (stage_ != NULL) {
+      stage_->add_busy(__stage::now() - begin_ - (stage_->waits() - waits_));
+    }
+  }
+
+ private:
+  __stage* stage_;
+  long long begin_;
+  long long waits_;
+};
+
+// Calls a stage's function, counting the call as busy time.
+template<typename F,
+         typename... A>
+auto __busy_call(__stage* stage, F& f, A&&... a)
+    -> decltype(f(std::forward<A>(a)...)) {
+  __busy_scope busy(stage);
+  return f(std::forward<A>(a)...);
+}
+
+template<typename Q>
+void __reopen(Q* queue) {
+  if (!queue->reopen()) {
+    throw std::runtime_error("pipeline: a queue of the plan cannot reopen");
+  }
+}
+
+// One end of a queue as a stage sees it, recording the items the stage
+// moves and the time it spends blocked.
+template<typename T>
+class __probe_queue : public queue_base<T> {
+ public:
+  __probe_queue(__stage* stage, queue_front<T> front, __queue_tally* tally) :
+      stage_(stage), front_(front), back_(NULL), tally_(tally) {}
+  __probe_queue(__stage* stage, queue_back<T> back, __queue_tally* tally) :
+      stage_(stage), front_(NULL), back_(back), tally_(tally) {}
+
+  virtual void close() {
+    if (front_.has_queue()) {
+      front_.close();
+    } else {
+      back_.close();
+    }
+  }
+  virtual bool is_closed() {
+    return front_.has_queue() ? front_.is_closed() : back_.is_closed();
+  }
+  virtual bool is_empty() {
+    return front_.has_queue() ? front_.is_empty() : back_.is_empty();
+  }
+
+  virtual void push(const T& x) {
+    long long begin = __stage::now();
+    __trace_mark mark = trace_push(1);
+    back_.push(x);
+    stage_->add_wait_out(__stage::now() - begin);
+    pushed(queue_op_status::success, 1, mark);
+  }
+  virtual queue_op_status wait_push(const T& x) {
+    long long begin = __stage::now();
+    __trace_mark mark = trace_push(1);
+    queue_op_status status = back_.wait_push(x);
+    stage_->add_wait_out(__stage::now() - begin);
+    return pushed(status, 1, mark);
+  }
+  virtual queue_op_status try_push(const T& x) {
+    __trace_mark mark = trace_push(1);
+    return pushed(back_.try_push(x), 1, mark);
+  }
+  virtual queue_op_status nonblocking_push(const T& x) {
+    __trace_mark mark = trace_push(1);
+    return pushed(back_.nonblocking_push(x), 1, mark);
+  }
+  virtual void push(T&& x) {
+    long long begin = __stage::now();
+    __trace_mark mark = trace_push(1);
+    back_.push(std::move(x));
+    stage_->add_wait_out(__stage::now() - begin);
+    pushed(queue_op_status::success, 1, mark);
+  }
+  virtual queue_op_status wait_push(T&& x) {
+    long long begin = __stage::now();
+    __trace_mark mark = trace_push(1);
+    queue_op_status status = back_.wait_push(std::move(x));
+    stage_->add_wait_out(__stage::now() - begin);
+    return pushed(status, 1, mark);
+  }
+  virtual queue_op_status try_push(T&& x) {
+    __trace_mark mark = trace_push(1);
+    return pushed(back_.try_push(std::move(x)), 1, mark);
+  }
+  virtual queue_op_status nonblocking_push(T&& x) {
+    __trace_mark mark = trace_push(1);
+    return pushed(back_.nonblocking_push(std::move(x)), 1, mark);
+  }
+  virtual queue_op_status wait_push_n(T* x, size_t n) {
+    long long begin = __stage::now();
+    __trace_mark mark = trace_push(n);
+    queue_op_status status = back_.wait_push_n(x, n);
+    stage_->add_wait_out(__stage::now() - begin);
+    return pushed(status, n, mark);
+  }
+
+  virtual T value_pop() {
+    long long begin = __stage::now();
+    T x = front_.value_pop();
+    stage_->add_wait_in(__stage::now() - begin);
+    stage_->popped(1, tally_);
+    trace_popped(begin, 1);
+    return x;
+  }
+  virtual queue_op_status wait_pop(T& x) {
+    long long begin = __stage::now();
+    queue_op_status status = front_.wait_pop(x);
+    stage_->add_wait_in(__stage::now() - begin);
+    return popped(status, begin);
+  }
+  virtual queue_op_status try_pop(T& x) {
+    long long begin = trace_now();
+    return popped(front_.try_pop(x), begin);
+  }
+  virtual queue_op_status nonblocking_pop(T& x) {
+    long long begin = trace_now();
+    return popped(front_.nonblocking_pop(x), begin);
+  }
+  virtual size_t wait_pop_n(T* x, size_t n,
+                            std::chrono::microseconds linger) {
+    long long begin = __stage::now();
+    n = front_.wait_pop_n(x, n, linger);
+    stage_->add_wait_in(__stage::now() - begin);
+    if (n > 0) {
+      stage_->popped(n, tally_);
+    }
+    trace_popped(begin, n);
+    return n;
+  }
+
+ private:
+  long long trace_now() {
+    return stage_->tracing() ? __stage::now() : 0;
+  }
+  __trace_mark trace_push(size_t n) {
+    return stage_->tracing() ? stage_->trace_push(n, tally_) : __trace_mark();
+  }
+  void trace_popped(long long begin, size_t n) {
+    if (stage_->tracing()) {
+      stage_->trace_popped(begin, n, tally_);
+    }
+  }
+  queue_op_status pushed(queue_op_status status, size_t n,
+                         const __trace_mark& mark) {
+    bool success = status == queue_op_status::success;
+    if (success) {
+      stage_->pushed(n, tally_);
+    }
+    if (mark.traced) {
+      stage_->trace_pushed(mark, success, tally_);
+    }
+    return status;
+  }
+  queue_op_status popped(queue_op_status status, long long begin) {
+    size_t n = 0;
+    if (status == queue_op_status::success) {
+      n = 1;
+      stage_->popped(1, tally_);
+    }
+    trace_popped(begin, n);
+    return status;
+  }
+
+  __stage* stage_;
+  queue_front<T> front_;
+  queue_back<T> back_;
+  __queue_tally* tally_;
+};
+
+// A queue of the plan as a thread stage sees it, waking the blocked tasks
+// after each change.
+template<typename T>
+class __waking_queue : public queue_base<T> {
+ public:
+  __waking_queue(__instance* inst, queue_base<T>* queue) :
+      inst_(inst), queue_(queue) {}
+
+  virtual void close() {
+    queue_->close();
+    inst_->wake_tasks();
+  }
+  virtual bool is_closed() { return queue_->is_closed(); }
+  virtual bool is_empty() { return queue_->is_empty(); }
+  virtual bool reopen() { return queue_->reopen(); }
+
+  virtual void push(const T& x) {
+    queue_->push(x);
+    inst_->wake_tasks();
+  }
+  virtual queue_op_status wait_push(const T& x) {
+    return changed(queue_->wait_push(x));
+  }
+  virtual queue_op_status try_push(const T& x) {
+    return changed(queue_->try_push(x));
+  }
+  virtual queue_op_status nonblocking_push(const T& x) {
+    return changed(queue_->nonblocking_push(x));
+  }
+  virtual void push(T&& x) {
+    queue_->push(std::move(x));
+    inst_->wake_tasks();
+  }
+  virtual queue_op_status wait_push(T&& x) {
+    return changed(queue_->wait_push(std::move(x)));
+  }
+  virtual queue_op_status try_push(T&& x) {
+    return changed(queue_->try_push(std::move(x)));
+  }
+  virtual queue_op_status nonblocking_push(T&& x) {
+    return changed(queue_->nonblocking_push(std::move(x)));
+  }
+  virtual queue_op_status wait_push_n(T* x, size_t n) {
+    return changed(queue_->wait_push_n(x, n));
+  }
+
+  virtual T value_pop() {
+    T x = queue_->value_pop();
+    inst_->wake_tasks();
+    return x;
+  }
+  virtual queue_op_status wait_pop(T& x) {
+    return changed(queue_->wait_pop(x));
+  }
+  virtual queue_op_status try_pop(T& x) {
+    return changed(queue_->try_pop(x));
+  }
+  virtual queue_op_status nonblocking_pop(T& x) {
+    return changed(queue_->nonblocking_pop(x));
+  }
+  virtual size_t wait_pop_n(T* x, size_t n,
+                            std::chrono::microseconds linger) {
+    n = queue_->wait_pop_n(x, n, linger);
+    if (n > 0) {
+      inst_->wake_tasks();
+    }
+    return n;
+  }
+
+ private:
+  queue_op_status changed(queue_op_status status) {
+    if (status == queue_op_status::success) {
+      inst_->wake_tasks();
+    }
+    return status;
+  }
+
+  __instance* inst_;
+  queue_base<T>* queue_;
+};
+
+template<typename T>
+queue_base<T>* __stage::guard(queue_base<T>* queue) {
+  on_cancel([queue]() { queue->close(); });
+  on_rerun([queue]() { __reopen(queue); });
+  return queue;
+}
+
+template<typename T>
+queue_base<T>* __stage::probe(queue_base<T>* queue, bool read) {
+  if (!profiling_ && !tracing()) {
+    return queue;
+  }
+  __queue_tally* tally = inst_->tally(queue);
+  if (read) {
+    tally->read = true;
+    return keep(new __probe_queue<T>(this, queue_front<T>(queue), tally));
+  }
+  tally->fed = true;
+  return keep(new __probe_queue<T>(this, queue_back<T>(queue), tally));
+}
+
+template<typename T>
+queue_base<T>* __stage::wake(queue_base<T>* queue) {
+  if (!inst_->wakes_tasks()) {
+    return queue;
+  }
+  return keep(new __waking_queue<T>(inst_, queue));
+}
+
+template<typename T>
+queue_front<T> __stage::watch(queue_front<T> q) {
+  if (!q.has_queue()) {
+    return q;
+  }
+  reads_ = true;
+  return queue_front<T>(
+      wake(probe(guard(q.queue()), true)));
+}
+
+template<typename T>
+queue_back<T> __stage::watch(queue_back<T> q) {
+  if (!q.has_queue()) {
+    return q;
+  }
+  return queue_back<T>(
+      wake(probe(guard(q.queue()), false)));
+}
+
 void nothing() {};
 
 template<typename T>
@@ -164,24 +1377,67 @@ terminated do_consume(std::function<void (T)> f, T t) {
 }
 
   // START WORKER THREADS
+// Each stops early if the plan is cancelled. Functions given a queue may
+// find it closed by the cancellation, so the queue_op_status a closed queue
+// throws ends their stage too.
+
+// Whether a function reading in_queue itself has nothing left to read. A
+// queue may be closed before its reader starts, with items still in it.
+template<typename T>
+bool __drained(queue_front<T>& in_queue) {
+  return in_queue.is_closed() && in_queue.is_empty();
+}
 
 template<typename IN,
          typename OUT>
 void run_simple_function(queue_front<IN> in_queue,
                          queue_back<OUT> out_queue,
                          std::function<OUT(IN)> func,
-                         __instance* inst) {
-  inst->thread_start();
-  while (1) {
+                         __stage* stage) {
+  stage->start();
+  while (!stage->cancelled()) {
     IN in;
     queue_op_status status = in_queue.wait_pop(in);
     if (status != queue_op_status::success) {
       break;  // Queue closed
     }
-    out_queue.push(func(in));
+    if (out_queue.wait_push(__busy_call(stage, func, in)) !=
+        queue_op_status::success) {
+      break;  // Closed downstream
+    }
   }
   out_queue.close();
-  inst->thread_done();
+  stage->done();
+}
+
+template<typename IN,
+         typename OUT>
+void run_batched_function(queue_front<IN> in_queue,
+                          queue_back<OUT> out_queue,
+                          std::function<OUT(IN)> func,
+                          size_t batch,
+                          std::chrono::microseconds linger,
+                          __stage* stage) {
+  stage->start();
+  std::vector<IN> in(batch);
+  std::vector<OUT> out(batch);
+  while (!stage->cancelled()) {
+    size_t n = in_queue.wait_pop_n(&in[0], batch, linger);
+    if (n == 0) {
+      break;  // Queue closed
+    }
+    {
+      __busy_scope busy(stage);
+      for (size_t i = 0; i < n; ++i) {
+        out[i] = func(std::move(in[i]));
+      }
+    }
+    if (out_queue.wait_push_n(&out[0], n) != queue_op_status::success) {
+      break;  // Closed downstream
+    }
+  }
+  out_queue.close();
+  stage->done();
 }
 
 template<typename IN,
@@ -189,18 +1445,22 @@ template<typename IN,
 void run_multi_out_function(queue_front<IN> in_queue,
                             queue_back<OUT> out_queue,
                             std::function<void (IN, queue_back<OUT>)> func,
-                            __instance* inst) {
-  inst->thread_start();
-  while (1) {
-    IN in;
-    queue_op_status status = in_queue.wait_pop(in);
-    if (status != queue_op_status::success) {
-      break;  // Queue closed
+                            __stage* stage) {
+  stage->start();
+  try {
+    while (!stage->cancelled()) {
+      IN in;
+      queue_op_status status = in_queue.wait_pop(in);
+      if (status != queue_op_status::success) {
+        break;  // Queue closed
+      }
+      __busy_call(stage, func, in, out_queue);
     }
-    func(in, out_queue);
+  } catch (queue_op_status) {
+    // Closed downstream
   }
   out_queue.close();  // TODO(aberkan): something for parallel
-  inst->thread_done();
+  stage->done();
 }
 
 template<typename IN,
@@ -208,13 +1468,20 @@ template<typename IN,
 void run_multi_in_function(queue_front<IN> in_queue,
                            queue_back<OUT> out_queue,
                            std::function<OUT(queue_front<IN>)> func,
-                           __instance* inst) {
-  inst->thread_start();
-  while (!in_queue.is_closed()) {
-    out_queue.push(func(in_queue));
+                           __stage* stage) {
+  stage->start();
+  try {
+    while (!__drained(in_queue) && !stage->cancelled()) {
+      if (out_queue.wait_push(__busy_call(stage, func, in_queue)) !=
+          queue_op_status::success) {
+        break;  // Closed downstream
+      }
+    }
+  } catch (queue_op_status) {
+    // Queue closed
   }
   out_queue.close();  // TODO(aberkan): something for parallel
-  inst->thread_done();
+  stage->done();
 }
 
 template<typename IN,
@@ -222,84 +1489,502 @@ template<typename IN,
 void run_full_function(queue_front<IN> in_queue,
                        queue_back<OUT> out_queue,
                        std::function<void(queue_front<IN>, queue_back<OUT>)> func,
-                       __instance* inst) {
-  inst->thread_start();
-  while (!in_queue.is_closed()) {
-    func(in_queue, out_queue);
+                       __stage* stage) {
+  stage->start();
+  try {
+    while (!__drained(in_queue) && !stage->cancelled()) {
+      __busy_call(stage, func, in_queue, out_queue);
+    }
+  } catch (queue_op_status) {
+    // Queue closed
   }
   out_queue.close();  // TODO(aberkan): something for parallel
-  inst->thread_done();
+  stage->done();
 }
 
 template<typename IN>
 void run_consumer(queue_front<IN> in_queue,
                   std::function<void(IN)> func,
-                  __instance* inst) {
-  inst->thread_start();
-  while (1) {
+                  __stage* stage) {
+  stage->start();
+  while (!stage->cancelled()) {
     IN in;
     queue_op_status status = in_queue.wait_pop(in);
     if (status != queue_op_status::success) {
       break;  // Queue closed
     }
-    func(in);
+    __busy_call(stage, func, in);
+  }
+  stage->done();
+}
+
+template<typename IN>
+void run_batched_consumer(queue_front<IN> in_queue,
+                          std::function<void(IN)> func,
+                          size_t batch,
+                          std::chrono::microseconds linger,
+                          __stage* stage) {
+  stage->start();
+  std::vector<IN> in(batch);
+  while (!stage->cancelled()) {
+    size_t n = in_queue.wait_pop_n(&in[0], batch, linger);
+    if (n == 0) {
+      break;  // Queue closed
+    }
+    __busy_scope busy(stage);
+    for (size_t i = 0; i < n; ++i) {
+      func(std::move(in[i]));
+    }
   }
-  inst->thread_done();
+  stage->done();
 }
 
 template<typename IN>
 void run_multi_in_consumer(queue_front<IN> in_queue,
                            std::function<void(queue_front<IN>)> func,
-                           __instance* inst) {
-  inst->thread_start();
-  while (!in_queue.is_closed()) {
-    func(in_queue);
+                           __stage* stage) {
+  stage->start();
+  try {
+    while (!__drained(in_queue) && !stage->cancelled()) {
+      __busy_call(stage, func, in_queue);
+    }
+  } catch (queue_op_status) {
+    // Queue closed
   }
-  inst->thread_done();
+  stage->done();
 }
 
 
 template<typename OUT>
 void run_producer(std::function<OUT (void)> f,
                   queue_back<OUT> out_queue,
-                  __instance* inst) {
-  inst->thread_start();
-  out_queue.push(f());
+                  __stage* stage) {
+  stage->start();
+  if (!stage->cancelled()) {
+    out_queue.wait_push(__busy_call(stage, f));
+  }
   out_queue.close();  // TODO(aberkan): something for parallel
-  inst->thread_done();
+  stage->done();
 }
 
 template<typename OUT>
 void run_multi_out_producer(std::function<void (queue_back<OUT>)> f,
                             queue_back<OUT> out_queue,
-                            __instance* inst) {
-  inst->thread_start();
-  f(out_queue);
+                            __stage* stage) {
+  stage->start();
+  try {
+    if (!stage->cancelled()) {
+      __busy_call(stage, f, out_queue);
+    }
+  } catch (queue_op_status) {
+    // Closed downstream
+  }
   out_queue.close();  // TODO(aberkan): something for parallel
-  inst->thread_done();
+  stage->done();
 }
 
 template<typename T>
-void run_queue_internal(queue_front<T> ft, queue_back<T> bk) {
-  while (1) {
+void run_queue_internal(queue_front<T> ft, queue_back<T> bk, __stage* stage) {
+  while (!stage->cancelled()) {
     T t;
     queue_op_status status = ft.wait_pop(t);
     if (status != queue_op_status::success) {
       return;  // Queue closed
     }
-    bk.push(t);
+    if (bk.wait_push(std::move(t)) != queue_op_status::success) {
+      return;  // Closed downstream
+    }
   }
 }
 
 template<typename T>
-void run_queue(queue_front<T> ft, queue_back<T> bk, __instance* inst) {
-  inst->thread_start();
-  run_queue_internal(ft, bk);
+void run_queue(queue_front<T> ft, queue_back<T> bk, __stage* stage) {
+  stage->start();
+  run_queue_internal(ft, bk, stage);
   bk.close();
-  inst->thread_done();
+  stage->done();
+}
+
+template<typename T>
+queue_front<T> __stage::watch_task(queue_front<T> q) {
+  if (!q.has_queue()) {
+    return q;
+  }
+  queue_base<T>* queue = guard(q.queue());
+  reads_ = true;
+  if (inst_->made(queue)) {
+    return queue_front<T>(probe(queue, true));
+  }
+  // The task, not the forwarder, records its use of the queue, which the
+  // tallies then take to be filled from outside the plan, as q is.
+  queue_base<T>* inside = guard(keep(inst_->make_queue<T>()));
+  inst_->execute(std::bind(run_queue<T>, q, queue_back<T>(wake(inside)),
+                           this));
+  return queue_front<T>(probe(inside, true));
+}
+
+template<typename T>
+queue_back<T> __stage::watch_task(queue_back<T> q) {
+  if (!q.has_queue()) {
+    return q;
+  }
+  queue_base<T>* queue = guard(q.queue());
+  if (inst_->made(queue)) {
+    return queue_back<T>(probe(queue, false));
+  }
+  queue_base<T>* inside = guard(keep(inst_->make_queue<T>()));
+  inst_->execute(std::bind(run_queue<T>, queue_front<T>(wake(inside)), q,
+                           this));
+  return queue_back<T>(probe(inside, false));
+}
+
+// The branch of a split that an item goes to, or __all_branches.
+const size_t __all_branches = static_cast<size_t>(-1);
+
+// Sends each item to the output its route picks, or to every output. An
+// output closed downstream no longer gets items; the others still do.
+template<typename T>
+void run_split(queue_front<T> in_queue,
+               std::vector<queue_back<T> > out_queues,
+               std::function<size_t (const T&)> route,
+               __stage* stage) {
+  stage->start();
+  while (!stage->cancelled()) {
+    T in;
+    queue_op_status status = in_queue.wait_pop(in);
+    if (status != queue_op_status::success) {
+      break;  // Queue closed
+    }
+    size_t branch = __busy_call(stage, route, in);
+    if (branch != __all_branches) {
+      out_queues[branch].wait_push(std::move(in));
+      continue;
+    }
+    for (size_t i = 0; i + 1 < out_queues.size(); ++i) {
+      out_queues[i].wait_push(in);
+    }
+    out_queues.back().wait_push(std::move(in));
+  }
+  for (size_t i = 0; i < out_queues.size(); ++i) {
+    out_queues[i].close();
+  }
+  stage->done();
+}
+
+// One of several threads forwarding into out_queue. The last of them to
+// finish closes it.
+template<typename T>
+void run_fan_in(queue_front<T> in_queue,
+                queue_back<T> out_queue,
+                std::shared_ptr<std::atomic<size_t> > running,
+                __stage* stage) {
+  stage->start();
+  run_queue_internal(in_queue, out_queue, stage);
+  if (--*running == 0) {
+    out_queue.close();
+  }
+  stage->done();
+}
+
+// END WORKER THREADS
+
+  // START TASKS
+// Non-blocking counterparts of the worker threads above, used in
+// execution_mode::tasks. An item that does not fit downstream is held and
+// offered again on the next step.
+
+const int kTaskStepItems = 64;  // Items moved per step before yielding.
+
+template<typename IN,
+         typename OUT>
+class __transfer_task : public __task {
+ public:
+  __transfer_task(queue_front<IN> in_queue,
+                  queue_back<OUT> out_queue,
+                  std::function<OUT (IN)> func,
+                  __stage* stage) :
+      in_queue_(in_queue), out_queue_(out_queue), func_(func),
+      stage_(stage), has_pending_(false) {}
+
+  virtual __task_status step() {
+    bool moved = false;
+    for (int i = 0; i < kTaskStepItems; ++i) {
+      if (has_pending_) {
+        queue_op_status status = out_queue_.try_push(std::move(pending_));
+        if (status == queue_op_status::full) {
+          break;
+        }
+        if (status != queue_op_status::success) {
+          return __task_status::done;  // Closed downstream
+        }
+        has_pending_ = false;
+        moved = true;
+      }
+      IN in;
+      queue_op_status status = in_queue_.try_pop(in);
+      if (status == queue_op_status::empty) {
+        break;
+      }
+      if (status != queue_op_status::success) {
+        out_queue_.close();
+        return __task_status::done;  // Queue closed
+      }
+      pending_ = __busy_call(stage_, func_, in);
+      has_pending_ = true;
+      moved = true;
+    }
+    return moved ? __task_status::progress : __task_status::blocked;
+  }
+  virtual void reset() {
+    has_pending_ = false;
+  }
+
+ private:
+  queue_front<IN> in_queue_;
+  queue_back<OUT> out_queue_;
+  std::function<OUT (IN)> func_;
+  __stage* stage_;
+  bool has_pending_;
+  OUT pending_;
+};
+
+template<typename T>
+T identity(T t) { return t; }
+
+template<typename IN>
+class __consumer_task : public __task {
+ public:
+  __consumer_task(queue_front<IN> in_queue,
+                  std::function<void (IN)> func,
+                  __stage* stage) :
+      in_queue_(in_queue), func_(func), stage_(stage) {}
+
+  virtual __task_status step() {
+    for (int i = 0; i < kTaskStepItems; ++i) {
+      IN in;
+      queue_op_status status = in_queue_.try_pop(in);
+      if (status == queue_op_status::empty) {
+        return i == 0 ? __task_status::blocked : __task_status::progress;
+      }
+      if (status != queue_op_status::success) {
+        return __task_status::done;  // Queue closed
+      }
+      __busy_call(stage_, func_, in);
+    }
+    return __task_status::progress;
+  }
+
+ private:
+  queue_front<IN> in_queue_;
+  std::function<void (IN)> func_;
+  __stage* stage_;
+};
+
+// Forwards from several queues into one, taking from whichever has data.
+// The output is closed when every input is closed.
+template<typename T>
+class __merge_task : public __task {
+ public:
+  __merge_task(const std::vector<queue_front<T> >& in_queues,
+               queue_back<T> out_queue) :
+      all_in_queues_(in_queues), in_queues_(in_queues), out_queue_(out_queue),
+      next_(0), has_pending_(false) {}
+
+  virtual __task_status step() {
+    bool moved = false;
+    for (int i = 0; i < kTaskStepItems; ++i) {
+      if (has_pending_) {
+        queue_op_status status = out_queue_.try_push(std::move(pending_));
+        if (status == queue_op_status::full) {
+          break;
+        }
+        if (status != queue_op_status::success) {
+          return __task_status::done;  // Closed downstream
+        }
+        has_pending_ = false;
+        moved = true;
+      }
+      if (!pop_any()) {
+        break;
+      }
+      moved = true;
+    }
+    if (in_queues_.empty() && !has_pending_) {
+      out_queue_.close();
+      return __task_status::done;
+    }
+    return moved ? __task_status::progress : __task_status::blocked;
+  }
+  virtual void reset() {
+    in_queues_ = all_in_queues_;
+    next_ = 0;
+    has_pending_ = false;
+  }
+
+ private:
+  // Pops into pending_ from the next input that has data, dropping inputs
+  // that are closed. Returns false if no input had data.
+  bool pop_any() {
+    for (size_t tried = 0; tried < in_queues_.size();) {
+      if (next_ >= in_queues_.size()) {
+        next_ = 0;
+      }
+      queue_op_status status = in_queues_[next_].try_pop(pending_);
+      if (status == queue_op_status::success) {
+        has_pending_ = true;
+        ++next_;
+        return true;
+      }
+      if (status == queue_op_status::closed) {
+        in_queues_.erase(in_queues_.begin() + next_);
+      } else {
+        ++next_;
+        ++tried;
+      }
+    }
+    return false;
+  }
+
+  std::vector<queue_front<T> > all_in_queues_;
+  std::vector<queue_front<T> > in_queues_;  // Those not yet closed.
+  queue_back<T> out_queue_;
+  size_t next_;
+  bool has_pending_;
+  T pending_;
+};
+
+// Like run_split. An item that does not fit in one of its outputs is
+// offered to that output, and the rest, on the next step.
+template<typename T>
+class __split_task : public __task {
+ public:
+  __split_task(queue_front<T> in_queue,
+               const std::vector<queue_back<T> >& out_queues,
+               std::function<size_t (const T&)> route,
+               __stage* stage) :
+      in_queue_(in_queue), out_queues_(out_queues), route_(route),
+      stage_(stage), has_pending_(false), next_(0), end_(0) {}
+
+  virtual __task_status step() {
+    bool moved = false;
+    for (int i = 0; i < kTaskStepItems; ++i) {
+      if (has_pending_ && !offer(&moved)) {
+        break;
+      }
+      queue_op_status status = in_queue_.try_pop(pending_);
+      if (status == queue_op_status::empty) {
+        break;
+      }
+      if (status != queue_op_status::success) {
+        for (size_t j = 0; j < out_queues_.size(); ++j) {
+          out_queues_[j].close();
+        }
+        return __task_status::done;  // Queue closed
+      }
+      size_t branch = __busy_call(stage_, route_, pending_);
+      next_ = branch == __all_branches ? 0 : branch;
+      end_ = branch == __all_branches ? out_queues_.size() : branch + 1;
+      has_pending_ = true;
+      moved = true;
+    }
+    return moved ? __task_status::progress : __task_status::blocked;
+  }
+  virtual void reset() {
+    has_pending_ = false;
+  }
+
+ private:
+  // Pushes the pending item to the outputs it has yet to reach, setting
+  // moved if it reaches any. Returns false if one of them is full.
+  bool offer(bool* moved) {
+    for (; next_ < end_; ++next_) {
+      queue_op_status status = next_ + 1 == end_
+          ? out_queues_[next_].try_push(std::move(pending_))
+          : out_queues_[next_].try_push(pending_);
+      if (status == queue_op_status::full) {
+        return false;
+      }
+      if (status == queue_op_status::success) {
+        *moved = true;
+      }
+    }
+    has_pending_ = false;
+    return true;
+  }
+
+  queue_front<T> in_queue_;
+  std::vector<queue_back<T> > out_queues_;
+  std::function<size_t (const T&)> route_;
+  __stage* stage_;
+  bool has_pending_;
+  T pending_;
+  size_t next_;  // The outputs pending_ has yet to reach, [next_, end_).
+  size_t end_;
+};
+
+// END TASKS
+
+  // START SERIAL
+// Execution_mode::serial turns the plan into nested calls. A sink takes
+// the items a stage would pop from its input queue, and passes on what it
+// makes by calling the next sink.
+
+template<typename T>
+struct __serial_sink {
+  // Returns false once the plan takes no more items.
+  std::function<bool (T)> push;
+  // Called once the input ends.
+  std::function<void ()> close;
+};
+
+template<typename IN,
+         typename OUT>
+__serial_sink<IN> __serial_call(std::function<OUT (IN)> f,
+                                __serial_sink<OUT> next) {
+  __serial_sink<IN> sink;
+  if (f && next.push) {
+    std::function<bool (OUT)> push = next.push;
+    sink.push = [f, push](IN in) { return push(f(in)); };
+    sink.close = next.close;
+  }
+  return sink;
+}
+
+// Pushes what in_queue holds through sink until the queue closes, the
+// sink takes no more, or the budget runs out. Returns false in the last
+// case only.
+template<typename T>
+bool __serial_pop_loop(queue_front<T> in_queue, __serial_sink<T> sink,
+                       __stage* stage, __serial_budget budget) {
+  long long spent = 0;
+  while (!stage->cancelled()) {
+    if (budget && !budget(spent)) {
+      return false;
+    }
+    T in;
+    if (in_queue.wait_pop(in) != queue_op_status::success) {
+      break;  // Queue closed
+    }
+    long long begin = budget ? __stage::now() : 0;
+    bool more;
+    {
+      __busy_scope busy(stage);
+      more = sink.push(std::move(in));
+    }
+    if (budget) {
+      spent = __stage::now() - begin;
+    }
+    if (!more) {
+      break;  // Closed downstream
+    }
+  }
+  if (sink.close) {
+    sink.close();
+  }
+  return true;
 }
 
-// END WORKER THREADS
+  // END SERIAL
 
 template<typename IN,
          typename OUT>
@@ -308,7 +1993,7 @@ class __segment_base {
   virtual ~__segment_base() {};
   virtual void run(__instance* inst, queue_back<OUT> out_queue) = 0;
   virtual __segment_base<IN, OUT>* clone() = 0;
-  virtual queue_back<IN> get_back() = 0;
+  virtual queue_back<IN> get_back(__instance* inst) = 0;
   virtual bool can_merge_on_front() { return false; }
   virtual bool can_merge_on_back() { return false; }
   virtual void merge_on_front(queue_front<IN> in_queue) {
@@ -317,6 +2002,30 @@ class __segment_base {
   virtual queue_front<OUT> merge_back() {
     throw;
   }
+  // For segments that make exactly one output per input, a function doing
+  // the work of the whole segment. Empty for all other segments.
+  virtual std::function<OUT (IN)> item_function() {
+    return std::function<OUT (IN)>();
+  }
+  // Makes the one-item-at-a-time stages of this segment move up to batch
+  // items per queue operation. See segment::batched.
+  virtual void set_batch(size_t batch, std::chrono::microseconds linger) {}
+  // Chooses the queue feeding the first stage. See segment::with_queue.
+  virtual void set_in_queue(typename __link<IN>::maker m, size_t capacity) {}
+  // Names every stage of this segment in profiles. See segment::named.
+  virtual void set_name(const string& name) {}
+  // For execution_mode::serial: a sink doing this segment's work and
+  // passing its output to next, or an empty one if the segment cannot run
+  // serially.
+  virtual __serial_sink<IN> serial_sink(__serial_sink<OUT> next) {
+    return __serial_call(item_function(), next);
+  }
+  // For the segment starting a plan: the loop taking items from the source
+  // and pushing them into sink, or an empty one. Waits count against
+  // stage, and cancelling it ends the loop.
+  virtual __serial_loop serial_source(__stage* stage, __serial_sink<OUT> sink) {
+    return __serial_loop();
+  }
  protected:
   __segment_base() {};
 };
@@ -351,14 +2060,54 @@ class __segment_chain : public __segment_base<IN, OUT> {
   virtual queue_front<OUT> merge_back() {
     return second_->merge_back();
   }
+  virtual std::function<OUT (IN)> item_function() {
+    std::function<MID (IN)> first = first_->item_function();
+    std::function<OUT (MID)> second = second_->item_function();
+    if (!first || !second) {
+      return std::function<OUT (IN)>();
+    }
+    return [first, second](IN in) { return second(first(in)); };
+  }
+  virtual void set_batch(size_t batch, std::chrono::microseconds linger) {
+    first_->set_batch(batch, linger);
+    second_->set_batch(batch, linger);
+  }
+  virtual void set_in_queue(typename __link<IN>::maker m, size_t capacity) {
+    first_->set_in_queue(m, capacity);
+  }
+  virtual void set_name(const string& name) {
+    first_->set_name(name);
+    second_->set_name(name);
+  }
+  virtual __serial_sink<IN> serial_sink(__serial_sink<OUT> next) {
+    __serial_sink<MID> mid = second_->serial_sink(next);
+    if (!mid.push) {
+      return __serial_sink<IN>();
+    }
+    return first_->serial_sink(mid);
+  }
+  virtual __serial_loop serial_source(__stage* stage, __serial_sink<OUT> sink) {
+    // A stage that took over a source queue reads the source itself.
+    __serial_loop loop = second_->serial_source(stage, sink);
+    if (loop) {
+      return loop;
+    }
+    __serial_sink<MID> mid = second_->serial_sink(sink);
+    if (!mid.push) {
+      return __serial_loop();
+    }
+    return first_->serial_source(stage, mid);
+  }
 
 
  private:
   virtual void run(__instance* inst, queue_back<OUT> out_queue) {
-    first_->run(inst, second_->get_back());
+    first_->run(inst, second_->get_back(inst));
     second_->run(inst, out_queue);
   }
-  virtual queue_back<IN> get_back() { return first_->get_back(); }
+  virtual queue_back<IN> get_back(__instance* inst) {
+    return first_->get_back(inst);
+  }
 
   __segment_base<IN, MID>* first_;
   __segment_base<MID, OUT>* second_;
@@ -371,79 +2120,125 @@ class __segment_function : public __segment_base<IN, OUT> {
   virtual ~__segment_function() {}
 
   __segment_function(std::function<OUT (IN)> f) :
-      queue_(10),  // TODO(aberkan): remove limit
       func_(std::bind(run_simple_function<IN, OUT>,
                       std::placeholders::_1,
                       std::placeholders::_2,
                       f,
                       std::placeholders::_3)),
+      item_func_(f),
+      name_("make"),
       has_merged_in_queue_(false),
-      merged_in_queue_(NULL) {}
+      merged_in_queue_(NULL),
+      batch_(1), linger_(0) {}
 
   __segment_function(std::function<OUT (queue_front<IN>)> f) :
-      queue_(10),  // TODO(aberkan): remove limit
       func_(std::bind(run_multi_in_function<IN, OUT>,
                       std::placeholders::_1,
                       std::placeholders::_2,
                       f,
                       std::placeholders::_3)),
+      name_("make"),
       has_merged_in_queue_(false),
-      merged_in_queue_(NULL) {}
+      merged_in_queue_(NULL),
+      batch_(1), linger_(0) {}
 
   __segment_function(std::function<void (IN, queue_back<OUT>)> f) :
-      queue_(10),  // TODO(aberkan): remove limit
       func_(std::bind(run_multi_out_function<IN, OUT>,
                       std::placeholders::_1,
                       std::placeholders::_2,
                       f,
                       std::placeholders::_3)),
+      name_("make"),
       has_merged_in_queue_(false),
-      merged_in_queue_(NULL) {}
+      merged_in_queue_(NULL),
+      batch_(1), linger_(0) {}
 
   __segment_function(std::function<void (queue_front<IN>, queue_back<OUT>)> f) :
-      queue_(10),  // TODO(aberkan): remove limit
       func_(std::bind(run_full_function<IN, OUT>,
                       std::placeholders::_1,
                       std::placeholders::_2,
                       f,
                       std::placeholders::_3)),
+      name_("make"),
       has_merged_in_queue_(false),
-      merged_in_queue_(NULL) {}
+      merged_in_queue_(NULL),
+      batch_(1), linger_(0) {}
 
   virtual bool can_merge_on_front() { return !has_merged_in_queue_;}
   virtual void merge_on_front(queue_front<IN> ft) {
     merged_in_queue_ = ft;
     has_merged_in_queue_ = true;
   }
+  virtual std::function<OUT (IN)> item_function() { return item_func_; }
+  virtual void set_batch(size_t batch, std::chrono::microseconds linger) {
+    batch_ = batch;
+    linger_ = linger;
+  }
+  virtual void set_in_queue(typename __link<IN>::maker m, size_t capacity) {
+    link_.choose(m, capacity);
+  }
+  virtual void set_name(const string& name) { name_ = name; }
+  virtual __serial_loop serial_source(__stage* stage, __serial_sink<OUT> sink) {
+    __serial_sink<IN> own = __serial_call(item_func_, sink);
+    if (!has_merged_in_queue_ || !own.push) {
+      return __serial_loop();
+    }
+    queue_front<IN> in_queue = stage->watch(merged_in_queue_);
+    return [in_queue, own, stage](__serial_budget budget) {
+      return __serial_pop_loop(in_queue, own, stage, budget);
+    };
+  }
 
  private:
   __segment_function(const __segment_function<IN, OUT>& f) :
-      queue_(10),  // TODO(aberkan): remove limit
+      link_(f.link_),
       func_(f.func_),
+      item_func_(f.item_func_),
+      name_(f.name_),
       has_merged_in_queue_(f.has_merged_in_queue_),
-      merged_in_queue_(f.merged_in_queue_) {}
+      merged_in_queue_(f.merged_in_queue_),
+      batch_(f.batch_),
+      linger_(f.linger_) {}
 
   virtual void run(__instance* inst, queue_back<OUT> out_queue) {
     // TODO(aberkan): Check for failures from both functions
-    inst->execute(std::bind(
-        func_,
-        has_merged_in_queue_ ? merged_in_queue_ : queue_front<IN>(queue_),
-        out_queue,
-        inst));
+    __stage* stage = inst->add_stage(name_);
+    queue_front<IN> in_queue(
+        has_merged_in_queue_ ? merged_in_queue_ : link_.get(inst));
+    if (item_func_ && inst->runs_tasks()) {
+      inst->schedule(new __transfer_task<IN, OUT>(
+          stage->watch_task(in_queue), stage->watch_task(out_queue),
+          item_func_, stage));
+      return;
+    }
+    in_queue = stage->watch(in_queue);
+    out_queue = stage->watch(out_queue);
+    if (item_func_ && batch_ > 1) {
+      inst->execute(std::bind(run_batched_function<IN, OUT>, in_queue,
+                              out_queue, item_func_, batch_, linger_, stage));
+    } else {
+      inst->execute(std::bind(func_, in_queue, out_queue, stage));
+    }
   }
   virtual __segment_function<IN, OUT>* clone() {
     return new __segment_function<IN, OUT>(*this);
   }
 
-  virtual queue_back<IN> get_back() {
-    return (has_merged_in_queue_ ? NULL : queue_back<IN>(queue_));
+  virtual queue_back<IN> get_back(__instance* inst) {
+    return (has_merged_in_queue_ ? NULL : queue_back<IN>(link_.get(inst)));
   }
 
-  queue_object<buffer_queue<IN> > queue_;
-  std::function<void (queue_front<IN>, queue_back<OUT>, __instance*)> func_;
+  __link<IN> link_;
+  std::function<void (queue_front<IN>, queue_back<OUT>, __stage*)> func_;
+  // Set only for OUT(IN) functions, which can run as tasks.
+  std::function<OUT (IN)> item_func_;
+  string name_;
 
   bool has_merged_in_queue_;
   queue_front<IN> merged_in_queue_;
+
+  size_t batch_;
+  std::chrono::microseconds linger_;
 };
 
 template<typename OUT>
@@ -453,20 +2248,41 @@ class __segment_producer : public __segment_base<terminated, OUT> {
       func_(std::bind(run_producer<OUT>,
                       f,
                       std::placeholders::_1,
-                      std::placeholders::_2)) {}
+                      std::placeholders::_2)),
+      item_func_(f),
+      name_("from") {}
 
   __segment_producer(std::function<void (queue_back<OUT>)> f) :
       func_(std::bind(run_multi_out_producer<OUT>,
                       f,
                       std::placeholders::_1,
-                      std::placeholders::_2)) {}
+                      std::placeholders::_2)),
+      name_("from") {}
 
   virtual ~__segment_producer() {}
 
   virtual void run(__instance* inst, queue_back<OUT> out_queue) {
-    inst->execute(std::bind(func_, out_queue, inst));
+    __stage* stage = inst->add_stage(name_);
+    inst->execute(std::bind(func_, stage->watch(out_queue), stage));
+  }
+  virtual void set_name(const string& name) { name_ = name; }
+  virtual __serial_loop serial_source(__stage* stage, __serial_sink<OUT> sink) {
+    std::function<OUT (void)> f = item_func_;
+    if (!f) {
+      return __serial_loop();
+    }
+    return [f, sink, stage](__serial_budget) {
+      if (!stage->cancelled()) {
+        __busy_scope busy(stage);
+        sink.push(f());
+      }
+      if (sink.close) {
+        sink.close();
+      }
+      return true;
+    };
   }
-  virtual queue_back<terminated> get_back() {
+  virtual queue_back<terminated> get_back(__instance* inst) {
     // TODO(aberkan): If we want to combine plans, this would need to be
     // implemented.
     throw;  // Unimplemented
@@ -476,13 +2292,16 @@ class __segment_producer : public __segment_base<terminated, OUT> {
   }
 
   // TODO(aberkan): should be private to __segment_parallel
-  __segment_producer(std::function<void (queue_back<OUT>, __instance*)> func) :
-      func_(func) {}
+  __segment_producer(std::function<void (queue_back<OUT>, __stage*)> func) :
+      func_(func), name_("from") {}
  private:
   __segment_producer(const __segment_producer<OUT>& f) :
-      func_(f.func_) {}
+      func_(f.func_), item_func_(f.item_func_), name_(f.name_) {}
 
-  std::function<void (queue_back<OUT>, __instance*)> func_;
+  std::function<void (queue_back<OUT>, __stage*)> func_;
+  // Set only for OUT(void) functions, which can run serially.
+  std::function<OUT (void)> item_func_;
+  string name_;
 };
 
 template<typename OUT>
@@ -490,20 +2309,26 @@ class __segment_queue_producer : public __segment_base<terminated, OUT> {
  public:
   __segment_queue_producer(queue_front<OUT> ft) :
       ft_(ft),
-      has_been_merged_(false) {}
+      has_been_merged_(false),
+      name_("from") {}
 
   virtual ~__segment_queue_producer() {}
 
   virtual void run(__instance* inst, queue_back<OUT> out_queue) {
     if(!has_been_merged_) {
-      inst->execute(std::bind(run_queue<OUT>, ft_, out_queue, inst));
+      __stage* stage = inst->add_stage(name_);
+      queue_front<OUT> in_queue = stage->watch(ft_);
+      out_queue = stage->watch(out_queue);
+      // A task would not learn when the user pushes, so even in
+      // execution_mode::tasks this is a thread.
+      inst->execute(std::bind(run_queue<OUT>, in_queue, out_queue, stage));
     } else {
       // If this has been merged, the mergee will pull directly from our queue and
       // we have nothing to do.
       assert(!out_queue.has_queue());
     }
   }
-  virtual queue_back<terminated> get_back() {
+  virtual queue_back<terminated> get_back(__instance* inst) {
     // TODO(aberkan): If we want to combine plans, this would need to be
     // implemented.
     throw;  // Unimplemented
@@ -513,6 +2338,16 @@ class __segment_queue_producer : public __segment_base<terminated, OUT> {
   }
 
   virtual bool can_merge_on_back() { return !has_been_merged_; }
+  virtual void set_name(const string& name) { name_ = name; }
+  virtual __serial_loop serial_source(__stage* stage, __serial_sink<OUT> sink) {
+    if (has_been_merged_ || !sink.push) {
+      return __serial_loop();
+    }
+    queue_front<OUT> in_queue = stage->watch(ft_);
+    return [in_queue, sink, stage](__serial_budget budget) {
+      return __serial_pop_loop(in_queue, sink, stage, budget);
+    };
+  }
   virtual queue_front<OUT> merge_back() {
     queue_front<OUT> ret = ft_;
     ft_ = NULL;
@@ -522,119 +2357,891 @@ class __segment_queue_producer : public __segment_base<terminated, OUT> {
 
  private:
   __segment_queue_producer(const __segment_queue_producer<OUT>& f) :
-      ft_(f.ft_), has_been_merged_(f.has_been_merged_) {}
+      ft_(f.ft_), has_been_merged_(f.has_been_merged_), name_(f.name_) {}
 
   queue_front<OUT> ft_;
   bool has_been_merged_;
+  string name_;
 };
 
 template<typename IN>
 class __segment_consumer : public __segment_base<IN, terminated> {
  public:
   __segment_consumer(std::function<void (IN)> f) :
-      queue_(10),  // TODO(aberkan): remove limit
       func_(std::bind(run_consumer<IN>,
                       std::placeholders::_1,
                       f,
-                      std::placeholders::_2)) {}
+                      std::placeholders::_2)),
+      item_func_(f),
+      name_("to"),
+      batch_(1), linger_(0) {}
 
   __segment_consumer(std::function<void (queue_front<IN>)> f) :
-      queue_(10),  // TODO(aberkan): remove limit
       func_(std::bind(run_multi_in_consumer<IN>,
                       std::placeholders::_1,
                       f,
-                      std::placeholders::_2)) {}
+                      std::placeholders::_2)),
+      name_("to"),
+      batch_(1), linger_(0) {}
 
   virtual ~__segment_consumer() {}
 
+  virtual void set_batch(size_t batch, std::chrono::microseconds linger) {
+    batch_ = batch;
+    linger_ = linger;
+  }
+  virtual void set_in_queue(typename __link<IN>::maker m, size_t capacity) {
+    link_.choose(m, capacity);
+  }
+  virtual void set_name(const string& name) { name_ = name; }
+  virtual __serial_sink<IN> serial_sink(__serial_sink<terminated> next) {
+    __serial_sink<IN> sink;
+    std::function<void (IN)> f = item_func_;
+    if (f) {
+      sink.push = [f](IN in) {
+        f(in);
+        return true;
+      };
+    }
+    return sink;
+  }
+
  private:
   __segment_consumer(const __segment_consumer<IN>& f) :
-      queue_(10),  // TODO(aberkan): remove limit
-      func_(f.func_) {}
+      link_(f.link_),
+      func_(f.func_),
+      item_func_(f.item_func_),
+      name_(f.name_),
+      batch_(f.batch_),
+      linger_(f.linger_) {}
 
   virtual void run(__instance* inst, queue_back<terminated> out_queue) {
     // TODO(aberkan): Check for failures from both functions
-    inst->execute(std::bind(func_, queue_front<IN>(queue_), inst));
+    __stage* stage = inst->add_stage(name_);
+    queue_front<IN> in_queue(link_.get(inst));
+    if (item_func_ && inst->runs_tasks()) {
+      inst->schedule(new __consumer_task<IN>(stage->watch_task(in_queue),
+                                             item_func_, stage));
+      return;
+    }
+    in_queue = stage->watch(in_queue);
+    if (item_func_ && batch_ > 1) {
+      inst->execute(std::bind(run_batched_consumer<IN>, in_queue, item_func_,
+                              batch_, linger_, stage));
+    } else {
+      inst->execute(std::bind(func_, in_queue, stage));
+    }
   }
   virtual __segment_consumer<IN>* clone() {
     return new __segment_consumer<IN>(*this);
   }
 
-  virtual queue_back<IN> get_back() { return queue_back<IN>(queue_); }
-  queue_object<buffer_queue<IN> > queue_;
+  virtual queue_back<IN> get_back(__instance* inst) {
+    return queue_back<IN>(link_.get(inst));
+  }
+  __link<IN> link_;
+
+  std::function<void (queue_front<IN>, __stage*)> func_;
+  // Set only for void(IN) functions, which can run as tasks.
+  std::function<void (IN)> item_func_;
+  string name_;
+
+  size_t batch_;
+  std::chrono::microseconds linger_;
+};
+
+template<typename IN>
+class __segment_queue_consumer : public __segment_base<IN, terminated> {
+ public:
+  __segment_queue_consumer(queue_back<IN> bk) :
+      bk_(bk) {}
+  virtual ~__segment_queue_consumer() {}
+
+  virtual void run(__instance* inst, queue_back<terminated> out_queue) {
+    // NO-OP
+  }
+  virtual queue_back<IN> get_back(__instance* inst) { return bk_; }
+  virtual __segment_queue_consumer<IN>* clone() {
+    return new __segment_queue_consumer<IN>(bk_);
+  }
+  virtual __serial_sink<IN> serial_sink(__serial_sink<terminated> next) {
+    queue_back<IN> bk = bk_;
+    __serial_sink<IN> sink;
+    sink.push = [bk](IN in) mutable {
+      return bk.wait_push(std::move(in)) == queue_op_status::success;
+    };
+    sink.close = [bk]() mutable { bk.close(); };
+    return sink;
+  }
+ private:
+  queue_back<IN> bk_;
+};
+
+// Forwards from every input into out_queue, closing it once every input
+// is closed: as one task in execution_mode::tasks, else with a thread per
+// input. The stage watches the queues.
+template<typename T>
+void __fan_in(__instance* inst, __stage* stage,
+              const std::vector<queue_base<T>*>& in_queues,
+              queue_back<T> out_queue) {
+  stage->mark_fan_in();
+  std::vector<queue_front<T> > fronts;
+  if (inst->runs_tasks()) {
+    for (size_t i = 0; i < in_queues.size(); ++i) {
+      fronts.push_back(stage->watch_task(queue_front<T>(in_queues[i])));
+    }
+    inst->schedule(new __merge_task<T>(fronts,
+                                       stage->watch_task(out_queue)));
+    return;
+  }
+  out_queue = stage->watch(out_queue);
+  size_t n = in_queues.size();
+  std::shared_ptr<std::atomic<size_t> > running(new std::atomic<size_t>(n));
+  stage->on_rerun([running, n]() { *running = n; });
+  for (size_t i = 0; i < n; ++i) {
+    inst->execute(std::bind(run_fan_in<T>,
+                            stage->watch(queue_front<T>(in_queues[i])),
+                            out_queue, running, stage));
+  }
+}
+
+// One of several backs of a queue, which is closed once each of them is.
+// Lets the replicas of a parallel segment push straight into its output.
+template<typename T>
+class __shared_back : public queue_base<T> {
+ public:
+  __shared_back(queue_base<T>* queue,
+                std::shared_ptr<std::atomic<size_t> > open) :
+      queue_(queue), open_(open), closed_(false) {}
+
+  virtual void close() {
+    if (!closed_.exchange(true) && --*open_ == 0 && queue_ != NULL) {
+      queue_->close();
+    }
+  }
+  virtual bool is_closed() {
+    return closed_ || (queue_ != NULL && queue_->is_closed());
+  }
+  virtual bool is_empty() { return queue_->is_empty(); }
+  virtual bool reopen() {
+    if (closed_.exchange(false)) {
+      ++*open_;
+    }
+    return queue_ == NULL || queue_->reopen();
+  }
+
+  virtual void push(const T& x) { queue_->push(x); }
+  virtual queue_op_status wait_push(const T& x) {
+    return queue_->wait_push(x);
+  }
+  virtual queue_op_status try_push(const T& x) {
+    return queue_->try_push(x);
+  }
+  virtual queue_op_status nonblocking_push(const T& x) {
+    return queue_->nonblocking_push(x);
+  }
+  virtual void push(T&& x) { queue_->push(std::move(x)); }
+  virtual queue_op_status wait_push(T&& x) {
+    return queue_->wait_push(std::move(x));
+  }
+  virtual queue_op_status try_push(T&& x) {
+    return queue_->try_push(std::move(x));
+  }
+  virtual queue_op_status nonblocking_push(T&& x) {
+    return queue_->nonblocking_push(std::move(x));
+  }
+  virtual queue_op_status wait_push_n(T* x, size_t n) {
+    return queue_->wait_push_n(x, n);
+  }
+
+  virtual T value_pop() { return queue_->value_pop(); }
+  virtual queue_op_status wait_pop(T& x) { return queue_->wait_pop(x); }
+  virtual queue_op_status try_pop(T& x) { return queue_->try_pop(x); }
+  virtual queue_op_status nonblocking_pop(T& x) {
+    return queue_->nonblocking_pop(x);
+  }
+
+ private:
+  queue_base<T>* queue_;
+  std::shared_ptr<std::atomic<size_t> > open_;  // Backs not yet closed.
+  std::atomic<bool> closed_;
+};
+
+  // Parallel
+// Replicas take items from one shared queue as they finish the last, so
+// a replica gets work only once it has room for it, and a slow item holds
+// up only its own replica. They push their results straight into the
+// output, which the last of them to finish closes. In execution_mode::tasks
+// each replica has an output of its own, and a merge task forwards from
+// whichever has a result.
+template<typename IN,
+         typename OUT>
+class __segment_parallel : public __segment_base<IN, OUT> {
+ public:
+  __segment_parallel(__segment_base<IN, OUT>* s, size_t n) :
+      s_(s), num_replicas_(n), name_("parallel") {}
+  virtual ~__segment_parallel() {
+    while (!bases_.empty()) {
+      delete bases_.back();
+      bases_.pop_back();
+      delete out_queues_.back();
+      out_queues_.pop_back();
+    }
+    delete s_;
+  }
+  virtual void run(__instance* inst, queue_back<OUT> out_queue) {
+    // The replicas exist only once the instance can make their queues.
+    __segment_queue_producer<IN> p(in_link_.get(inst));
+    size_t first = inst->stage_count();
+    bool tasks = inst->runs_tasks();
+    queue_base<OUT>* out = out_queue.queue();
+    std::shared_ptr<std::atomic<size_t> > open(
+        new std::atomic<size_t>(num_replicas_));
+    for (size_t i = 0; i < num_replicas_; ++i) {
+      bases_.push_back(
+          new __segment_chain<terminated, IN, OUT>(p.clone(), s_->clone()));
+      if (tasks) {
+        out_queues_.push_back(inst->make_queue<OUT>());
+      } else {
+        out_queues_.push_back(new __shared_back<OUT>(out, open));
+        inst->alias_queue(out_queues_[i], out);
+      }
+      bases_[i]->run(inst, out_queues_[i]);
+    }
+    inst->mark_replicas(first, num_replicas_);
+    if (tasks) {
+      // The fan-in is a stage of its own.
+      __stage* stage = inst->add_stage(name_ + ".merge");
+      __fan_in(inst, stage, out_queues_, out_queue);
+    }
+  }
+
+  virtual queue_back<IN> get_back(__instance* inst) {
+    return in_link_.get(inst);
+  }
+  virtual __segment_parallel<IN, OUT>* clone() {
+    __segment_parallel<IN, OUT>* copy =
+        new __segment_parallel<IN, OUT>(s_->clone(), num_replicas_);
+    copy->in_link_.choose_as(in_link_);
+    copy->name_ = name_;
+    return copy;
+  }
+  virtual void set_in_queue(typename __link<IN>::maker m, size_t capacity) {
+    in_link_.choose(m, capacity);
+  }
+  virtual void set_name(const string& name) {
+    s_->set_name(name);
+    name_ = name;
+  }
+  virtual __serial_sink<IN> serial_sink(__serial_sink<OUT> next) {
+    return s_->serial_sink(next);
+  }
+
+private:
+  __link<IN> in_link_;
+  __segment_base<IN, OUT>* s_;
+  size_t num_replicas_;
+  string name_;
+  std::vector<__segment_base<terminated, OUT>*> bases_;
+  std::vector<queue_base<OUT>*> out_queues_;
+};
+
+  // Ordered parallel
+// Replicas take items in sequence order and file their results in a ring
+// of window slots; a replica that fills the oldest slot, unless another is
+// already at it, pushes out the run of completed results behind it. A
+// replica may not take an item more than window places ahead of the oldest
+// one not yet pushed out.
+template<typename IN,
+         typename OUT>
+class __segment_ordered_parallel : public __segment_base<IN, OUT> {
+ public:
+  __segment_ordered_parallel(std::function<OUT (IN)> f, size_t n,
+                             size_t window) :
+      func_(f), num_replicas_(n), window_(std::max(window, n)),
+      name_("ordered_parallel"),
+      has_merged_in_queue_(false), merged_in_queue_(NULL),
+      out_queue_(NULL), live_replicas_(0), next_seq_(0), emitted_(0),
+      emitting_(false), out_closed_(false),
+      slots_(window_), filled_(window_, false) {}
+  virtual ~__segment_ordered_parallel() {}
+
+  virtual void run(__instance* inst, queue_back<OUT> out_queue) {
+    // The replicas share one stage, as they share their queues.
+    __stage* stage = inst->add_stage(name_);
+    queue_front<IN> in_queue = stage->watch(
+        has_merged_in_queue_ ? merged_in_queue_ : in_link_.get(inst));
+    out_queue_ = stage->watch(out_queue);
+    stage->on_cancel([this]() {
+      std::unique_lock<std::mutex> lock(mu_);
+      window_open_.notify_all();
+    });
+    stage->on_rerun([this]() {
+      next_seq_ = 0;
+      emitted_ = 0;
+      emitting_ = false;
+      out_closed_ = false;
+      live_replicas_ = num_replicas_;
+      filled_.assign(window_, false);
+    });
+    live_replicas_ = num_replicas_;
+    for (size_t i = 0; i < num_replicas_; ++i) {
+      inst->execute(std::bind(&__segment_ordered_parallel::run_replica,
+                              this, in_queue, stage));
+    }
+  }
+
+  virtual queue_back<IN> get_back(__instance* inst) {
+    return (has_merged_in_queue_ ? NULL : queue_back<IN>(in_link_.get(inst)));
+  }
+  virtual __segment_ordered_parallel<IN, OUT>* clone() {
+    __segment_ordered_parallel<IN, OUT>* copy =
+        new __segment_ordered_parallel<IN, OUT>(func_, num_replicas_,
+                                                window_);
+    copy->in_link_.choose_as(in_link_);
+    copy->name_ = name_;
+    if (has_merged_in_queue_) {
+      copy->merge_on_front(merged_in_queue_);
+    }
+    return copy;
+  }
+
+  virtual bool can_merge_on_front() { return !has_merged_in_queue_;}
+  virtual void merge_on_front(queue_front<IN> ft) {
+    merged_in_queue_ = ft;
+    has_merged_in_queue_ = true;
+  }
+  virtual std::function<OUT (IN)> item_function() { return func_; }
+  virtual void set_in_queue(typename __link<IN>::maker m, size_t capacity) {
+    in_link_.choose(m, capacity);
+  }
+  virtual void set_name(const string& name) { name_ = name; }
+
+ private:
+  void run_replica(queue_front<IN> in_queue, __stage* stage) {
+    stage->start();
+    while (!stage->cancelled()) {
+      IN in;
+      size_t seq;
+      {
+        // Popping and numbering must happen together to keep input order.
+        std::unique_lock<std::mutex> take(take_mu_);
+        {
+          std::unique_lock<std::mutex> lock(mu_);
+          window_open_.wait(lock, [this, stage]() {
+            return next_seq_ - emitted_ < window_ || out_closed_ ||
+                stage->cancelled();
+          });
+          if (out_closed_) {
+            break;
+          }
+        }
+        if (stage->cancelled()) {
+          break;
+        }
+        queue_op_status status = in_queue.wait_pop(in);
+        if (status != queue_op_status::success) {
+          break;  // Queue closed
+        }
+        seq = next_seq_++;
+      }
+      OUT out = __busy_call(stage, func_, in);
+      std::unique_lock<std::mutex> lock(mu_);
+      slots_[seq % window_] = std::move(out);
+      filled_[seq % window_] = true;
+      if (!emitting_ && !emit(lock)) {
+        break;
+      }
+    }
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      if (--live_replicas_ == 0) {
+        out_queue_.close();
+      }
+    }
+    stage->done();
+  }
+
+  // Pushes out the run of completed results from the oldest, with mu_
+  // released, until the oldest is unfinished. One replica at a time does
+  // so, which keeps the output in order while others file their results.
+  // Returns false if the output closed, after which results are dropped.
+  bool emit(std::unique_lock<std::mutex>& lock) {
+    emitting_ = true;
+    std::vector<OUT> ready;
+    while (!out_closed_ && filled_[emitted_ % window_]) {
+      for (size_t seq = emitted_; filled_[seq % window_] &&
+               ready.size() < window_; ++seq) {
+        ready.push_back(std::move(slots_[seq % window_]));
+        filled_[seq % window_] = false;
+      }
+      lock.unlock();
+      size_t pushed = 0;
+      for (; pushed < ready.size(); ++pushed) {
+        if (out_queue_.wait_push(std::move(ready[pushed])) !=
+            queue_op_status::success) {
+          break;
+        }
+      }
+      lock.lock();
+      if (pushed < ready.size()) {
+        out_closed_ = true;
+      }
+      // The slots taken stay out of the window until pushed.
+      emitted_ += ready.size();
+      ready.clear();
+      window_open_.notify_all();
+    }
+    emitting_ = false;
+    return !out_closed_;
+  }
+
+  __link<IN> in_link_;
+  std::function<OUT (IN)> func_;
+  size_t num_replicas_;
+  size_t window_;
+  string name_;
+  bool has_merged_in_queue_;
+  queue_front<IN> merged_in_queue_;
+  queue_back<OUT> out_queue_;
+
+  std::mutex take_mu_;  // Held while taking and numbering an item.
+  std::mutex mu_;  // Guards everything below.
+  std::condition_variable window_open_;
+  size_t live_replicas_;
+  size_t next_seq_;
+  size_t emitted_;
+  bool emitting_;  // A replica is pushing results out.
+  bool out_closed_;  // A push found the output closed.
+  std::vector<OUT> slots_;
+  std::vector<bool> filled_;
+};
+
+  // Elastic parallel
+// A fixed core of min replicas, each with its own plan thread, and up to
+// max - min extra replicas on threads the controller borrows from the pool
+// while the input is backed up and the replicas are busy. Extras are
+// retired, and their threads donated back, once the replicas go idle. The
+// controller closes the output when every replica has finished.
+template<typename IN,
+         typename OUT>
+class __segment_elastic : public __segment_base<IN, OUT> {
+ public:
+  __segment_elastic(std::function<OUT (IN)> f, size_t min, size_t max,
+                    std::chrono::microseconds interval) :
+      func_(f), min_(std::max<size_t>(min, 1)), max_(std::max(max, min_)),
+      interval_(interval), name_("elastic"),
+      has_merged_in_queue_(false), merged_in_queue_(NULL),
+      in_queue_(NULL), out_queue_(NULL), stage_(NULL), pool_(NULL),
+      live_(0), busy_(0) {}
+  virtual ~__segment_elastic() {}
+
+  virtual void run(__instance* inst, queue_back<OUT> out_queue) {
+    // The replicas share one stage, as they share their queues.
+    stage_ = inst->add_stage(name_);
+    in_queue_ = stage_->watch(
+        has_merged_in_queue_ ? merged_in_queue_ : in_link_.get(inst));
+    out_queue_ = stage_->watch(out_queue);
+    stage_->on_cancel([this]() {
+      std::unique_lock<std::mutex> lock(mu_);
+      changed_.notify_all();
+    });
+    stage_->on_rerun([this]() {
+      live_ = min_;
+    });
+    pool_ = inst->pool();
+    live_ = min_;
+    for (size_t i = 0; i < min_; ++i) {
+      inst->execute(std::bind(&__segment_elastic::run_core, this));
+    }
+    inst->execute(std::bind(&__segment_elastic::run_controller, this));
+  }
+
+  virtual queue_back<IN> get_back(__instance* inst) {
+    return (has_merged_in_queue_ ? NULL : queue_back<IN>(in_link_.get(inst)));
+  }
+  virtual __segment_elastic<IN, OUT>* clone() {
+    __segment_elastic<IN, OUT>* copy =
+        new __segment_elastic<IN, OUT>(func_, min_, max_, interval_);
+    copy->in_link_.choose_as(in_link_);
+    copy->name_ = name_;
+    if (has_merged_in_queue_) {
+      copy->merge_on_front(merged_in_queue_);
+    }
+    return copy;
+  }
+
+  virtual bool can_merge_on_front() { return !has_merged_in_queue_;}
+  virtual void merge_on_front(queue_front<IN> ft) {
+    merged_in_queue_ = ft;
+    has_merged_in_queue_ = true;
+  }
+  virtual std::function<OUT (IN)> item_function() { return func_; }
+  virtual void set_in_queue(typename __link<IN>::maker m, size_t capacity) {
+    in_link_.choose(m, capacity);
+  }
+  virtual void set_name(const string& name) { name_ = name; }
+
+ private:
+  struct extra {
+    extra() : thread(NULL), stop(false), finished(false) {}
+    mutable_thread* thread;
+    std::atomic<bool> stop;
+    std::atomic<bool> finished;
+  };
+
+  // Busy above, or idle below, this share of the replicas' time.
+  static double grow_ratio() { return 0.75; }
+  static double shrink_ratio() { return 0.25; }
+
+  void run_core() {
+    stage_->start();
+    work(NULL);
+    stage_->done();
+  }
+
+  void run_extra(extra* e) {
+    stage_->instance()->enter_thread();
+    work(&e->stop);
+    stage_->instance()->leave_thread();
+    e->finished = true;
+  }
+
+  void work(std::atomic<bool>* stop) {
+    while ((stop == NULL || !*stop) && !stage_->cancelled()) {
+      IN in;
+      queue_op_status status =
+          stop == NULL ? in_queue_.wait_pop(in) : extra_pop(in, stop);
+      if (status == queue_op_status::empty) {
+        continue;
+      }
+      if (status != queue_op_status::success) {
+        break;  // Queue closed
+      }
+      long long begin = __stage::now();
+      OUT out = __busy_call(stage_, func_, in);
+      busy_ += __stage::now() - begin;
+      if (out_queue_.wait_push(std::move(out)) != queue_op_status::success) {
+        break;  // Closed downstream
+      }
+    }
+    std::unique_lock<std::mutex> lock(mu_);
+    --live_;
+    changed_.notify_all();
+  }
+
+  // An extra does not block on the input, where shrink() could not reach
+  // it, but waits on changed_ between tries for up to an interval.
+  queue_op_status extra_pop(IN& in, std::atomic<bool>* stop) {
+    queue_op_status status = in_queue_.try_pop(in);
+    if (status == queue_op_status::empty) {
+      std::unique_lock<std::mutex> lock(mu_);
+      changed_.wait_for(lock, interval_, [this, stop]() {
+        return *stop || stage_->cancelled();
+      });
+    }
+    return status;
+  }
+
+  void run_controller() {
+    stage_->start();
+    long long last = __stage::now();
+    long long last_busy = busy_;
+    std::unique_lock<std::mutex> lock(mu_);
+    while (live_ > 0) {
+      changed_.wait_for(lock, interval_);
+      if (live_ == 0) {
+        break;
+      }
+      long long now = __stage::now();
+      if (now - last < std::chrono::nanoseconds(interval_).count()) {
+        continue;  // Woken early; too short a time to judge.
+      }
+      lock.unlock();
+      reap(false);
+      long long busy = busy_;
+      size_t active = min_ + active_extras();
+      double ratio = double(busy - last_busy) / double((now - last) * active);
+      last = now;
+      last_busy = busy;
+      if (ratio > grow_ratio() && active < max_ && !in_queue_.is_empty() &&
+          !stage_->cancelled()) {
+        grow();
+      } else if (ratio < shrink_ratio() && active > min_) {
+        shrink();
+      }
+      lock.lock();
+    }
+    lock.unlock();
+    reap(true);
+    out_queue_.close();
+    stage_->done();
+  }
+
+  size_t active_extras() {
+    size_t active = 0;
+    for (size_t i = 0; i < extras_.size(); ++i) {
+      if (!extras_[i]->stop) {
+        ++active;
+      }
+    }
+    return active;
+  }
+
+  void grow() {
+    mutable_thread* t = pool_->try_get_unused_thread();
+    if (t == NULL) {
+      return;  // The pool is busy; try again next time.
+    }
+    extra* e = new extra();
+    e->thread = t;
+    extras_.push_back(e);
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      ++live_;
+    }
+    t->execute(std::bind(&__segment_elastic::run_extra, this, e));
+  }
+
+  void shrink() {
+    // Retire the newest extra still working. It stops after its current
+    // item, or at once if it is waiting for one.
+    for (size_t i = extras_.size(); i > 0; --i) {
+      if (!extras_[i - 1]->stop) {
+        extras_[i - 1]->stop = true;
+        std::unique_lock<std::mutex> lock(mu_);
+        changed_.notify_all();
+        return;
+      }
+    }
+  }
+
+  // Donates back the threads of finished extras; if all, waits for every
+  // extra to finish first.
+  void reap(bool all) {
+    for (size_t i = 0; i < extras_.size();) {
+      extra* e = extras_[i];
+      while (all && !e->finished) {
+        std::this_thread::yield();
+      }
+      if (e->finished) {
+        pool_->donate_thread(e->thread);
+        delete e;
+        extras_.erase(extras_.begin() + i);
+      } else {
+        ++i;
+      }
+    }
+  }
+
+  __link<IN> in_link_;
+  std::function<OUT (IN)> func_;
+  size_t min_;
+  size_t max_;
+  std::chrono::microseconds interval_;
+  string name_;
+  bool has_merged_in_queue_;
+  queue_front<IN> merged_in_queue_;
+
+  // Set by run().
+  queue_front<IN> in_queue_;
+  queue_back<OUT> out_queue_;
+  __stage* stage_;
+  simple_thread_pool* pool_;
+
+  std::vector<extra*> extras_;  // Used only by the controller.
+  std::mutex mu_;
+  // Signalled when a replica finishes or an extra is retired.
+  std::condition_variable changed_;
+  size_t live_;  // Replicas running, guarded by mu_.
+  std::atomic<long long> busy_;  // Nanoseconds in func_, all replicas.
+};
+
+  // Split
+// Runs each item through the branch its route picks, or through every
+// branch, and merges what the branches make. Branches ending in a
+// consumer make nothing, and then neither does the split.
+template<typename IN,
+         typename OUT>
+class __segment_split : public __segment_base<IN, OUT> {
+ public:
+  typedef std::function<size_t (const IN&)> router;
+
+  // Takes ownership of the branches.
+  __segment_split(const std::vector<__segment_base<IN, OUT>*>& branches,
+                  router route, const string& name) :
+      branches_(branches), route_(route), name_(name) {}
+  virtual ~__segment_split() {
+    for (size_t i = 0; i < branches_.size(); ++i) {
+      delete branches_[i];
+    }
+    for (size_t i = 0; i < out_queues_.size(); ++i) {
+      delete out_queues_[i];
+    }
+  }
+
+  virtual void run(__instance* inst, queue_back<OUT> out_queue) {
+    __stage* stage = inst->add_stage(name_);
+    queue_front<IN> in_queue(in_link_.get(inst));
+    std::vector<queue_back<IN> > branch_queues;
+    for (size_t i = 0; i < branches_.size(); ++i) {
+      branch_queues.push_back(branches_[i]->get_back(inst));
+    }
+    if (inst->runs_tasks()) {
+      for (size_t i = 0; i < branch_queues.size(); ++i) {
+        branch_queues[i] = stage->watch_task(branch_queues[i]);
+      }
+      inst->schedule(new __split_task<IN>(stage->watch_task(in_queue),
+                                          branch_queues, route_, stage));
+    } else {
+      in_queue = stage->watch(in_queue);
+      for (size_t i = 0; i < branch_queues.size(); ++i) {
+        branch_queues[i] = stage->watch(branch_queues[i]);
+      }
+      inst->execute(std::bind(run_split<IN>, in_queue, branch_queues, route_,
+                              stage));
+    }
+    run_branches(inst, out_queue, std::is_same<OUT, terminated>());
+  }
+  virtual queue_back<IN> get_back(__instance* inst) {
+    return in_link_.get(inst);
+  }
+  virtual __segment_split<IN, OUT>* clone() {
+    std::vector<__segment_base<IN, OUT>*> branches;
+    for (size_t i = 0; i < branches_.size(); ++i) {
+      branches.push_back(branches_[i]->clone());
+    }
+    __segment_split<IN, OUT>* copy =
+        new __segment_split<IN, OUT>(branches, route_, name_);
+    copy->in_link_.choose_as(in_link_);
+    return copy;
+  }
+  virtual void set_in_queue(typename __link<IN>::maker m, size_t capacity) {
+    in_link_.choose(m, capacity);
+  }
+  virtual void set_name(const string& name) {
+    for (size_t i = 0; i < branches_.size(); ++i) {
+      branches_[i]->set_name(name);
+    }
+    name_ = name;
+  }
+
+ private:
+  void run_branches(__instance* inst, queue_back<OUT> out_queue,
+                    std::true_type /* OUT is terminated */) {
+    for (size_t i = 0; i < branches_.size(); ++i) {
+      branches_[i]->run(inst, out_queue);
+    }
+  }
+  void run_branches(__instance* inst, queue_back<OUT> out_queue,
+                    std::false_type) {
+    for (size_t i = 0; i < branches_.size(); ++i) {
+      out_queues_.push_back(inst->make_queue<OUT>());
+      branches_[i]->run(inst, out_queues_[i]);
+    }
+    __stage* stage = inst->add_stage(name_ + ".merge");
+    __fan_in(inst, stage, out_queues_, out_queue);
+  }
 
-  std::function<void (queue_front<IN>, __instance*)> func_;
+  __link<IN> in_link_;
+  std::vector<__segment_base<IN, OUT>*> branches_;
+  router route_;
+  string name_;
+  std::vector<queue_base<OUT>*> out_queues_;
 };
 
-template<typename IN>
-class __segment_queue_consumer : public __segment_base<IN, terminated> {
+  // Merge
+// Interleaves what several producers make, in no particular order.
+template<typename OUT>
+class __segment_merge : public __segment_base<terminated, OUT> {
  public:
-  __segment_queue_consumer(queue_back<IN> bk) :
-      bk_(bk) {}
-  virtual ~__segment_queue_consumer() {}
+  // Takes ownership of the sources.
+  __segment_merge(
+      const std::vector<__segment_base<terminated, OUT>*>& sources) :
+      sources_(sources), name_("merge") {}
+  virtual ~__segment_merge() {
+    for (size_t i = 0; i < sources_.size(); ++i) {
+      delete sources_[i];
+    }
+    for (size_t i = 0; i < out_queues_.size(); ++i) {
+      delete out_queues_[i];
+    }
+  }
 
-  virtual void run(__instance* inst, queue_back<terminated> out_queue) {
-    // NO-OP
+  virtual void run(__instance* inst, queue_back<OUT> out_queue) {
+    for (size_t i = 0; i < sources_.size(); ++i) {
+      out_queues_.push_back(inst->make_queue<OUT>());
+      sources_[i]->run(inst, out_queues_[i]);
+    }
+    __stage* stage = inst->add_stage(name_);
+    __fan_in(inst, stage, out_queues_, out_queue);
   }
-  virtual queue_back<IN> get_back() { return bk_; }
-  virtual __segment_queue_consumer<IN>* clone() {
-    return new __segment_queue_consumer<IN>(bk_);
+  virtual queue_back<terminated> get_back(__instance* inst) {
+    throw;  // Unimplemented, as for the producers
   }
+  virtual __segment_merge<OUT>* clone() {
+    std::vector<__segment_base<terminated, OUT>*> sources;
+    for (size_t i = 0; i < sources_.size(); ++i) {
+      sources.push_back(sources_[i]->clone());
+    }
+    __segment_merge<OUT>* copy = new __segment_merge<OUT>(sources);
+    copy->name_ = name_;
+    return copy;
+  }
+  virtual void set_name(const string& name) { name_ = name; }
+
  private:
-  queue_back<IN> bk_;
+  std::vector<__segment_base<terminated, OUT>*> sources_;
+  string name_;
+  std::vector<queue_base<OUT>*> out_queues_;
 };
 
-  // Parallel
+  // Pinned
+// Runs a segment whose threads are pinned to some CPUs; see
+// segment::pinned.
 template<typename IN,
          typename OUT>
-class __segment_parallel : public __segment_base<IN, OUT> {
+class __segment_pinned : public __segment_base<IN, OUT> {
  public:
-  __segment_parallel(__segment_base<IN, OUT>* s, size_t n) :
-      in_queue_(10), s_(s), bases_(n), out_queues_(n) {
-    __segment_queue_producer<IN> p(in_queue_);
-    for (size_t i = 0; i < n; ++i) {
-      bases_[i] = new __segment_chain<terminated, IN, OUT>(p.clone() ,s->clone());
-      out_queues_[i] = new queue_object<buffer_queue<OUT> >(10);
-    }
-  }
-  virtual ~__segment_parallel() {
-    while (!bases_.empty()) {
-      delete bases_.back();
-      bases_.pop_back();
-      delete out_queues_.back();
-      out_queues_.pop_back();
-    }
+  __segment_pinned(__segment_base<IN, OUT>* s, const std::vector<int>& cpus) :
+      s_(s), cpus_(cpus) {}
+  virtual ~__segment_pinned() {
     delete s_;
   }
+
   virtual void run(__instance* inst, queue_back<OUT> out_queue) {
-    for (size_t i = 0; i < bases_.size(); ++i) {
-      bases_[i]->run(inst, out_queues_[i]->back());
-    }
-    inst->execute(std::bind(&__segment_parallel::run_out_queues,
-                            this, out_queue, inst));
+    size_t first = inst->executed();
+    s_->run(inst, out_queue);
+    inst->pin(first, cpus_);
   }
-
-  virtual queue_back<IN> get_back() { return in_queue_.back(); }
-  virtual __segment_parallel<IN, OUT>* clone() {
-    return new __segment_parallel<IN, OUT>(s_->clone(), bases_.size());
+  virtual __segment_pinned<IN, OUT>* clone() {
+    return new __segment_pinned<IN, OUT>(s_->clone(), cpus_);
   }
-
-private:
-  void run_out_queues(queue_back<OUT> out_queue, __instance* inst) {
-    // TODO(aberkan):  This is terrible...  Ideally we shouldn't have this step
-    // at all, but at least we should check queues in parallel.
-    inst->thread_start();
-    for (size_t i = 0; i < out_queues_.size(); ++i) {
-      run_queue_internal<OUT>(out_queues_[i]->front(), out_queue);
-    }
-    out_queue.close();
-    inst->thread_done();
+  virtual queue_back<IN> get_back(__instance* inst) {
+    return s_->get_back(inst);
+  }
+  virtual bool can_merge_on_front() { return s_->can_merge_on_front(); }
+  virtual bool can_merge_on_back() { return s_->can_merge_on_back(); }
+  virtual void merge_on_front(queue_front<IN> in_queue) {
+    s_->merge_on_front(in_queue);
+  }
+  virtual queue_front<OUT> merge_back() {
+    return s_->merge_back();
+  }
+  virtual std::function<OUT (IN)> item_function() {
+    return s_->item_function();
+  }
+  virtual void set_batch(size_t batch, std::chrono::microseconds linger) {
+    s_->set_batch(batch, linger);
   }
+  virtual void set_in_queue(typename __link<IN>::maker m, size_t capacity) {
+    s_->set_in_queue(m, capacity);
+  }
+  virtual void set_name(const string& name) { s_->set_name(name); }
 
-  queue_object<buffer_queue<IN> > in_queue_;
+ private:
   __segment_base<IN, OUT>* s_;
-  std::vector<__segment_base<terminated, OUT>*> bases_;
-  std::vector<queue_object<buffer_queue<OUT> >* > out_queues_;
+  std::vector<int> cpus_;
 };
 
   // END UTILITIES
@@ -648,9 +3255,65 @@ class segment {
   ~segment() { delete base_; }
 
   execution run(simple_thread_pool* pool);
+  execution run(simple_thread_pool* pool, const run_options& options);
+
+  // Returns a copy whose OUT(IN) and void(IN) stages move items through
+  // their queues in chunks of up to batch items, calling the function in a
+  // loop over each chunk. A stage waits up to linger after its first item
+  // for a chunk to fill, which bounds the latency batching adds. Batching
+  // does not apply in execution_mode::tasks, where tasks already move many
+  // items per step.
+  segment<IN, OUT> batched(size_t batch,
+                           std::chrono::microseconds linger =
+                               std::chrono::microseconds(0)) const {
+    segment<IN, OUT> s(*this);
+    s.base_->set_batch(std::max<size_t>(batch, 1), linger);
+    return s;
+  }
+
+  // Returns a copy whose first stage reads from a Q<IN> holding capacity
+  // items, rather than the queue the run_options choose. Q must wrap in a
+  // queue_object, e.g. buffer_queue, lock_free_buffer_queue or spill_queue.
+  template<template<typename> class Q>
+  segment<IN, OUT> with_queue(size_t capacity) const {
+    segment<IN, OUT> s(*this);
+    s.base_->set_in_queue([](size_t c) -> queue_base<IN>* {
+      return new queue_object<Q<IN> >(c);
+    }, capacity);
+    return s;
+  }
+  // Keeps the run_options queue kind but changes the capacity.
+  segment<IN, OUT> with_queue(size_t capacity) const {
+    segment<IN, OUT> s(*this);
+    s.base_->set_in_queue(typename __link<IN>::maker(), capacity);
+    return s;
+  }
+
+  // Returns a copy whose threads may run only on the given CPUs, e.g. to
+  // keep a stage on the socket holding its data. Tasks run on the plan's
+  // task workers, so pinning does not apply to them.
+  segment<IN, OUT> pinned(const std::vector<int>& cpus) const {
+    return segment<IN, OUT>(new __segment_pinned<IN, OUT>(base_->clone(),
+                                                          cpus));
+  }
+
+  // Returns a copy whose stages are called name in profiles; see
+  // run_options.profile. In execution_mode::tasks, a parallel segment's
+  // fan-in is called name.merge.
+  segment<IN, OUT> named(const string& name) const {
+    segment<IN, OUT> s(*this);
+    s.base_->set_name(name);
+    return s;
+  }
 
   segment(const segment<IN, OUT>& s) :
       base_(s.base_->clone()) {}
+  segment<IN, OUT>& operator=(const segment<IN, OUT>& s) {
+    __segment_base<IN, OUT>* base = s.base_->clone();
+    delete base_;
+    base_ = base;
+    return *this;
+  }
 
   //TODO make private
   // Takes ownership of base.
@@ -662,37 +3325,513 @@ class segment {
   typedef IN in;
 };
 
+// A plan made ready to run many times. Preparing does all that run() does
+// except start the stages: it copies the plan, makes its queues and claims
+// threads from the pool, which it keeps until it is destroyed. Each run()
+// only reopens the queues and starts the stages again on the same threads.
+// Every queue of the plan is reopened, including any it was given, so a
+// source queue closed to end one run can take items again once the next
+// run has started. Queues must support queue_base::reopen.
+class prepared_plan {
+ public:
+  // Throws std::runtime_error if the pool cannot supply enough threads.
+  prepared_plan(const plan& p, simple_thread_pool* pool,
+                const run_options& options = run_options()) :
+      inst_(new __instance(pool, p.base_->clone(), options, false)) {}
+  ~prepared_plan() {
+    delete inst_;
+  }
+
+  // Starts a run. Runs may not overlap: throws std::logic_error if the
+  // previous run has not finished. The execution waits for its run when it
+  // is destroyed. Cancelling a run keeps the threads for the next one.
+  execution run() {
+    inst_->relaunch();
+    return execution(inst_, false);
+  }
+
+ private:
+  prepared_plan(const prepared_plan&);  // undefined
+  prepared_plan& operator=(const prepared_plan&);  // undefined
+
+  __instance* inst_;
+};
+
   // END CLASSES
 
   // START EXECUTION IMPLEMENTATION
 
 template<>
-execution segment<terminated, terminated>::run(simple_thread_pool* pool) {
+execution segment<terminated, terminated>::run(simple_thread_pool* pool,
+                                               const run_options& options) {
   __segment_base<terminated, terminated>* plan = base_->clone();
-  return execution(new __instance(pool, plan));
+  return execution(new __instance(pool, plan, options));
+}
+
+template<>
+execution segment<terminated, terminated>::run(simple_thread_pool* pool) {
+  return run(pool, run_options());
 }
 
 
 __instance::__instance(simple_thread_pool* pool,
-                   __segment_base<terminated, terminated>* p) :
+                       __segment_base<terminated, terminated>* p,
+                       const run_options& options,
+                       bool launch_now) :
     start_(1), end_(1), num_threads_(0),
-    done_(false),
+    done_(false), joined_(false), prepared_(!launch_now), cancelled_(false),
     thread_end_(NULL), pool_(pool),
-    dummy_queue_(1),
+    options_(options),
+    live_tasks_(0), blocked_(0), wakes_(0),
+    sub_(NULL),
     plan_(p) {
-  plan_->run(this, queue_back<terminated>(dummy_queue_));
-  // We can't create the barrier until all of the threads have started running
-  // so we know num_threads_.
-  std::function<size_t()> done_fn = std::bind(&__instance::all_threads_done,
-                                         this);
-  thread_end_ = new flex_barrier(num_threads_, done_fn);
+  try {
+    if (options_.mode == execution_mode::serial ||
+        options_.mode == execution_mode::automatic) {
+      serial_ = plan_->serial_source(add_stage("serial"),
+                                     __serial_sink<terminated>());
+      if (!serial_) {
+        if (options_.mode == execution_mode::serial) {
+          throw std::invalid_argument("pipeline: plan cannot run serially");
+        }
+        delete_stages();
+        options_.mode = execution_mode::threads;
+      }
+    }
+    if (!serial_) {
+      // A plan ends in a consumer, which has no output queue.
+      plan_->run(this, queue_back<terminated>(NULL));
+    } else if (options_.mode == execution_mode::automatic) {
+      execute(std::bind(&__instance::run_automatic, this));
+    }
+    prepare();
+  } catch (...) {
+    for (size_t i = 0; i < tasks_.size(); ++i) {
+      delete tasks_[i];
+    }
+    delete_stages();
+    delete plan_;
+    throw;
+  }
+  if (launch_now) {
+    launch();
+  } else {
+    // Ready for relaunch(), as if a run had finished.
+    done_ = true;
+    joined_ = true;
+    end_.count_down();
+  }
+}
+
+__stage* __instance::add_stage(const string& name) {
+  stages_.push_back(new __stage(this, name));
+  return stages_.back();
+}
+
+__queue_tally* __instance::tally(const void* queue) {
+  __queue_tally*& tally = tallies_[unalias(queue)];
+  if (tally == NULL) {
+    tally = new __queue_tally();
+  }
+  return tally;
+}
+
+std::vector<stage_profile> __instance::profile() {
+  std::vector<stage_profile> profiles;
+  if (profiling()) {
+    for (size_t i = 0; i < stages_.size(); ++i) {
+      profiles.push_back(stages_[i]->profile());
+    }
+  }
+  return profiles;
+}
+
+std::vector<stage_latency> __instance::latency() {
+  std::vector<stage_latency> latencies;
+  if (trace_every() != 0) {
+    for (size_t i = 0; i < stages_.size(); ++i) {
+      latencies.push_back(stages_[i]->latency());
+    }
+  }
+  return latencies;
+}
+
+void __instance::mark_replicas(size_t first, size_t n) {
+  size_t per_replica = (stages_.size() - first) / n;
+  for (size_t i = 1; i < n; ++i) {
+    for (size_t j = 0; j < per_replica; ++j) {
+      stages_[first + i * per_replica + j]->replicate(stages_[first + j]);
+    }
+  }
+}
+
+plan_advice __instance::advise(double items_per_second) {
+  plan_advice advice;
+  if (!profiling()) {
+    return advice;
+  }
+  // Sum the replicas of each stage.
+  std::vector<stage_profile> totals;
+  std::vector<bool> fan_ins;
+  std::map<__stage*, size_t> index;
+  for (size_t i = 0; i < stages_.size(); ++i) {
+    stage_profile p = stages_[i]->profile();
+    std::map<__stage*, size_t>::iterator it =
+        index.find(stages_[i]->primary());
+    if (it == index.end()) {
+      index[stages_[i]] = totals.size();
+      totals.push_back(p);
+      fan_ins.push_back(stages_[i]->fan_in());
+      stage_advice a;
+      a.name = p.name;
+      a.replicas = 1;
+      advice.stages.push_back(a);
+      continue;
+    }
+    stage_profile& total = totals[it->second];
+    total.items_in += p.items_in;
+    total.items_out += p.items_out;
+    total.busy += p.busy;
+    total.wait_in += p.wait_in;
+    total.wait_out += p.wait_out;
+    ++advice.stages[it->second].replicas;
+  }
+  if (totals.empty()) {
+    return advice;
+  }
+
+  // The time between items each stage can manage with its replicas.
+  std::vector<double> interval(totals.size(), 0.0);
+  for (size_t i = 0; i < totals.size(); ++i) {
+    const stage_profile& t = totals[i];
+    stage_advice& a = advice.stages[i];
+    unsigned long long items = std::max(t.items_in, t.items_out);
+    double time = (t.busy + t.wait_in + t.wait_out).count();
+    a.cost = std::chrono::nanoseconds(
+        items == 0 ? 0 : t.busy.count() / static_cast<long long>(items));
+    a.busy = time == 0 ? 0.0 : t.busy.count() / time;
+    a.blocked_in = time == 0 ? 0.0 : t.wait_in.count() / time;
+    a.blocked_out = time == 0 ? 0.0 : t.wait_out.count() / time;
+    interval[i] = double(a.cost.count()) / a.replicas;
+    if (interval[i] > interval[advice.bottleneck]) {
+      advice.bottleneck = i;
+    }
+  }
+  double next = 0.0;
+  for (size_t i = 0; i < interval.size(); ++i) {
+    if (i != advice.bottleneck) {
+      next = std::max(next, interval[i]);
+    }
+  }
+  double slowest = interval[advice.bottleneck];
+  advice.max_rate = slowest == 0 ? 0.0 : 1e9 / slowest;
+  advice.headroom = next == 0 ? 0.0 : slowest / next;
+
+  double target = items_per_second > 0 ? 1e9 / items_per_second : next;
+  for (size_t i = 0; i < totals.size(); ++i) {
+    stage_advice& a = advice.stages[i];
+    a.advised_replicas = a.replicas;
+    // Fan-ins cannot be replicated.
+    if (totals[i].items_in > 0 && !fan_ins[i] && target > 0) {
+      a.advised_replicas = std::max<size_t>(
+          1, std::ceil(a.cost.count() / target - 1e-9));
+    }
+    // A fan-in reads several queues, and the stage listed before it feeds
+    // only one of them, so their stalls say nothing of one queue's size.
+    if (i > 0 && !fan_ins[i] &&
+        advice.stages[i - 1].blocked_out >= kAdviceStall &&
+        a.blocked_in >= kAdviceStall) {
+      advice.small_queues.push_back(a.name);
+    }
+  }
+  return advice;
+}
+
+void __instance::delete_stages() {
+  for (size_t i = 0; i < stages_.size(); ++i) {
+    delete stages_[i];
+  }
+  stages_.clear();
+  for (std::map<const void*, __queue_tally*>::iterator it = tallies_.begin();
+       it != tallies_.end(); ++it) {
+    delete it->second;
+  }
+  tallies_.clear();
+}
+
+void __instance::prepare() {
+  if (!tasks_.empty()) {
+    size_t workers = options_.workers;
+    if (workers == 0) {
+      workers = std::thread::hardware_concurrency();
+    }
+    workers = std::max<size_t>(1, std::min(workers, tasks_.size()));
+    for (size_t i = 0; i < workers; ++i) {
+      execute(std::bind(&__instance::run_tasks, this));
+    }
+  }
+  // Claim every thread before starting any, so that an exhausted pool
+  // leaves nothing running.
+  for (size_t i = 0; i < startup_.size(); ++i) {
+    mutable_thread* t = pool_->try_get_unused_thread();
+    if (t == NULL) {
+      release_threads();
+      throw std::runtime_error("pipeline: not enough threads in pool");
+    }
+    threads_.push_back(t);
+  }
+  // Pin the threads segment::pinned chose, and the rest to the run_options
+  // CPUs in turn. The pool unpins them when they go back.
+  size_t next_cpu = 0;
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    std::vector<int> cpus = thread_cpus_[i];
+    if (cpus.empty() && !options_.cpus.empty()) {
+      cpus.push_back(options_.cpus[next_cpu++ % options_.cpus.size()]);
+    }
+    if (!cpus.empty()) {
+      threads_[i]->set_affinity(cpus);
+    }
+  }
+  if (num_threads_ > 0) {
+    // We can't create the barrier until all of the threads have started
+    // running so we know num_threads_.
+    std::function<size_t()> done_fn =
+        std::bind(&__instance::all_threads_done, this);
+    thread_end_ = new flex_barrier(num_threads_, done_fn);
+  }
+}
+
+void __instance::launch() {
+  if (serial_ && options_.mode == execution_mode::serial) {
+    enter_thread();
+    serial_(__serial_budget());
+    leave_thread();
+  }
+  if (num_threads_ == 0) {
+    done_ = true;
+    end_.count_down();
+    return;
+  }
+  ready_tasks_.assign(tasks_.begin(), tasks_.end());
+  blocked_tasks_.clear();
+  blocked_ = 0;
+  live_tasks_ = tasks_.size();
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    threads_[i]->execute(startup_[i]);
+  }
   start_.count_down();  // Start the threads
 }
 
+void __instance::relaunch() {
+  if (!is_done()) {
+    throw std::logic_error("pipeline: the previous run has not finished");
+  }
+  wait();
+  done_ = false;
+  joined_ = false;
+  cancelled_ = false;
+  start_.reset(1);
+  end_.reset(1);
+  for (std::map<const void*, __queue_tally*>::iterator it = tallies_.begin();
+       it != tallies_.end(); ++it) {
+    it->second->pushed = 0;
+    it->second->popped = 0;
+    it->second->traced.clear();
+    it->second->next_traced = __queue_tally::kNoneTraced;
+  }
+  end_to_end_.reset();
+  for (size_t i = 0; i < stages_.size(); ++i) {
+    stages_[i]->rerun();
+  }
+  for (size_t i = 0; i < tasks_.size(); ++i) {
+    tasks_[i]->reset();
+  }
+  launch();
+}
+
+void __instance::release_threads() {
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    pool_->donate_thread(threads_[i]);
+  }
+  threads_.clear();
+}
+
+void __instance::run_tasks() {
+  thread_start();
+  __current_task_worker() = this;
+  std::unique_lock<std::mutex> lock(task_mu_);
+  while (live_tasks_ > 0 && !cancelled_) {
+    if (ready_tasks_.empty()) {
+      // Every task is blocked until a neighbour moves or wake_tasks().
+      task_ready_.wait(lock);
+      continue;
+    }
+    __task* task = ready_tasks_.front();
+    ready_tasks_.pop_front();
+    unsigned long long wakes = wakes_;
+    lock.unlock();
+    __task_status status = task->step();
+    lock.lock();
+    if (status == __task_status::blocked) {
+      blocked_tasks_.push_back(task);
+      blocked_ = blocked_tasks_.size();
+      if (wakes_ != wakes) {
+        unblock_tasks();  // A queue changed during the step.
+      }
+      continue;
+    }
+    if (status == __task_status::progress) {
+      ready_tasks_.push_back(task);
+    } else {
+      --live_tasks_;
+    }
+    // Progress may have made room or data for a blocked neighbour, even
+    // one whose step is still under way on another worker.
+    ++wakes_;
+    unblock_tasks();
+    task_ready_.notify_all();
+  }
+  lock.unlock();
+  __current_task_worker() = NULL;
+  thread_done();
+}
+
+// Items taken serially before execution_mode::automatic decides.
+const int kAutoSampleItems = 64;
+
+void __instance::run_automatic() {
+  thread_start();
+  long long limit = options_.serial_limit.count();
+  int items = 0;
+  long long spent = 0;
+  bool decided = false;
+  __serial_budget budget = [&](long long last) {
+    if (decided) {
+      return true;
+    }
+    spent += last;
+    if (items++ < kAutoSampleItems) {
+      return true;
+    }
+    decided = true;
+    return spent <= limit * kAutoSampleItems;
+  };
+  if (!serial_(budget)) {
+    // The items are costly, so run the rest of them on threads, reading
+    // the same source. If the pool cannot spare the threads, carry on.
+    __instance* sub = NULL;
+    if (!cancelled_) {
+      run_options options = options_;
+      options.mode = execution_mode::threads;
+      try {
+        sub = new __instance(pool_, plan_->clone(), options);
+      } catch (const std::runtime_error&) {
+      }
+    }
+    if (sub == NULL) {
+      serial_(__serial_budget());
+    } else {
+      {
+        std::unique_lock<std::mutex> lock(sub_mu_);
+        sub_ = sub;
+        if (cancelled_) {
+          sub->cancel();
+        }
+      }
+      sub->wait();
+      {
+        std::unique_lock<std::mutex> lock(sub_mu_);
+        sub_ = NULL;
+      }
+      delete sub;
+    }
+  }
+  thread_done();
+}
+
+void __instance::cancel() {
+  cancelled_ = true;
+  for (size_t i = 0; i < stages_.size(); ++i) {
+    stages_[i]->cancel();
+  }
+  {
+    std::unique_lock<std::mutex> lock(sub_mu_);
+    if (sub_ != NULL) {
+      sub_->cancel();
+    }
+  }
+  {
+    std::unique_lock<std::mutex> lock(task_mu_);
+    task_ready_.notify_all();
+  }
+  wait();
+  if (!prepared_) {
+    release_threads();
+  }
+}
+
 __instance::~__instance() {
   wait();
+  // Every thread has left thread_done(), so they can serve other plans.
+  release_threads();
   delete plan_;
   delete thread_end_;
+  for (size_t i = 0; i < tasks_.size(); ++i) {
+    delete tasks_[i];
+  }
+  delete_stages();
+}
+
+string execution::report() {
+  std::vector<stage_profile> profiles = profile();
+  std::ostringstream out;
+  out << std::left << std::setw(20) << "stage" << std::right
+      << std::setw(10) << "in" << std::setw(10) << "out"
+      << std::setw(10) << "busy ms" << std::setw(10) << "in ms"
+      << std::setw(10) << "out ms" << std::setw(10) << "queue"
+      << std::setw(10) << "max" << "\n";
+  for (size_t i = 0; i < profiles.size(); ++i) {
+    const stage_profile& p = profiles[i];
+    out << std::left << std::setw(20) << p.name << std::right
+        << std::setw(10) << p.items_in << std::setw(10) << p.items_out
+        << std::fixed << std::setprecision(1)
+        << std::setw(10) << p.busy.count() / 1e6
+        << std::setw(10) << p.wait_in.count() / 1e6
+        << std::setw(10) << p.wait_out.count() / 1e6
+        << std::setw(10) << p.queue_mean
+        << std::setw(10) << p.queue_max << "\n";
+  }
+  return out.str();
+}
+string plan_advice::report() const {
+  std::ostringstream out;
+  if (stages.empty()) {
+    return out.str();
+  }
+  out << std::fixed << std::setprecision(1)
+      << "bottleneck: " << stages[bottleneck].name
+      << ", at most " << max_rate << " items/s";
+  if (headroom > 0) {
+    out << ", " << headroom << "x the cost of the next stage";
+  }
+  out << "\n" << std::left << std::setw(20) << "stage" << std::right
+      << std::setw(10) << "replicas" << std::setw(10) << "us/item"
+      << std::setw(10) << "busy %" << std::setw(10) << "in %"
+      << std::setw(10) << "out %" << std::setw(10) << "advised" << "\n";
+  for (size_t i = 0; i < stages.size(); ++i) {
+    const stage_advice& a = stages[i];
+    out << std::left << std::setw(20) << a.name << std::right
+        << std::setw(10) << a.replicas
+        << std::setw(10) << a.cost.count() / 1e3
+        << std::setw(10) << a.busy * 100
+        << std::setw(10) << a.blocked_in * 100
+        << std::setw(10) << a.blocked_out * 100
+        << std::setw(10) << a.advised_replicas << "\n";
+  }
+  for (size_t i = 0; i < small_queues.size(); ++i) {
+    out << "queue into " << small_queues[i] << " is too small\n";
+  }
+  return out.str();
 }
   // END EXECUTION IMPLEMENTATION
 
@@ -779,6 +3918,16 @@ segment<IN, terminated> to(void consumer(IN)) {
   return to(std::function<void (IN)>(consumer));
 }
 
+template<typename IN>
+segment<IN, terminated> to(std::function<void (queue_front<IN>)> consumer) {
+  return segment<IN, terminated>(new __segment_consumer<IN>(consumer));
+}
+
+template<typename IN>
+segment<IN, terminated> to(void consumer(queue_front<IN>)) {
+  return to(std::function<void (queue_front<IN>)>(consumer));
+}
+
 template<typename IN>
 segment<IN, terminated> to(queue_back<IN> bk) {
   return segment<IN, terminated>(
@@ -791,6 +3940,87 @@ segment<typename Q::value_type, terminated> to(Q& q) {
 }
 
 
+// Fusion
+//
+// fuse<IN>(f, g, ...) makes a single stage computing ...g(f(in)), with no
+// queue or thread between the functions. The composition is built from
+// the functions' own types, so the compiler can inline the inner calls;
+// only the stage itself goes through a std::function. Use it for cheap,
+// stateless functions whose queue hop would cost more than their work.
+
+template<typename F,
+         typename G>
+class __fused {
+ public:
+  __fused(F f, G g) : f_(f), g_(g) {}
+
+  template<typename T>
+  auto operator()(T&& t)
+      -> decltype(std::declval<G&>()(std::declval<F&>()(std::forward<T>(t)))) {
+    return g_(f_(std::forward<T>(t)));
+  }
+
+ private:
+  F f_;
+  G g_;
+};
+
+template<typename... F>
+struct __composition;
+
+template<typename F>
+struct __composition<F> {
+  typedef F type;
+  static type make(F f) { return f; }
+};
+
+template<typename F,
+         typename G,
+         typename... H>
+struct __composition<F, G, H...> {
+  typedef typename __composition<__fused<F, G>, H...>::type type;
+  static type make(F f, G g, H... h) {
+    return __composition<__fused<F, G>, H...>::make(__fused<F, G>(f, g),
+                                                    h...);
+  }
+};
+
+template<typename IN,
+         typename... F>
+struct __fused_result {
+  typedef typename std::decay<typename std::result_of<
+      typename __composition<F...>::type&(IN)>::type>::type type;
+};
+
+template<typename IN,
+         typename... F>
+segment<IN, typename __fused_result<IN, F...>::type> fuse(F... f) {
+  typedef typename __fused_result<IN, F...>::type OUT;
+  return make(std::function<OUT (IN)>(__composition<F...>::make(f...)));
+}
+
+template<typename IN,
+         typename MID,
+         typename... G>
+segment<IN, typename __fused_result<IN, MID (*)(IN), G...>::type> fuse(
+    MID f(IN), G... g) {
+  return fuse<IN, MID (*)(IN), G...>(f, g...);
+}
+
+// Collapses a segment built from OUT(IN) functions, such as
+// make(f) | g | h, into one stage. The functions are already type-erased,
+// so each is still called through its std::function. Throws
+// std::invalid_argument for other segments.
+template<typename IN,
+         typename OUT>
+segment<IN, OUT> fuse(const segment<IN, OUT>& s) {
+  std::function<OUT (IN)> f = s.base_->item_function();
+  if (!f) {
+    throw std::invalid_argument("fuse needs one output per input");
+  }
+  return make(f);
+}
+
 // Parallel
 template<typename IN,
          typename OUT>
@@ -798,6 +4028,135 @@ segment<IN, OUT> parallel(segment<IN, OUT> p, int n) {
   return segment<IN, OUT>(new __segment_parallel<IN, OUT>(p.base_->clone(), n));
 }
 
+// Like parallel, but results leave in the order their inputs arrived. At
+// most window items are in flight or waiting for an earlier item to finish.
+// The segment must make exactly one output per input, i.e. be built from
+// OUT(IN) functions; throws std::invalid_argument otherwise.
+template<typename IN,
+         typename OUT>
+segment<IN, OUT> ordered_parallel(segment<IN, OUT> p, int n,
+                                  size_t window = 64) {
+  std::function<OUT (IN)> f = p.base_->item_function();
+  if (!f) {
+    throw std::invalid_argument(
+        "ordered_parallel needs one output per input");
+  }
+  return segment<IN, OUT>(new __segment_ordered_parallel<IN, OUT>(f, n,
+                                                                  window));
+}
+
+// Like parallel, but with between min and max replicas, as many as keep
+// up with the input. min replicas and a controller get threads when the
+// plan starts. Every interval, the controller borrows another thread from
+// the pool if the input is waiting and the replicas were mostly busy, or
+// retires an extra replica if they were mostly idle. Replicas always run on
+// threads, even in execution_mode::tasks. The segment must be built from
+// OUT(IN) functions; throws std::invalid_argument otherwise.
+template<typename IN,
+         typename OUT>
+segment<IN, OUT> elastic(segment<IN, OUT> p, size_t min, size_t max,
+                         std::chrono::microseconds interval =
+                             std::chrono::milliseconds(1)) {
+  std::function<OUT (IN)> f = p.base_->item_function();
+  if (!f) {
+    throw std::invalid_argument("elastic needs one output per input");
+  }
+  return segment<IN, OUT>(new __segment_elastic<IN, OUT>(f, min, max,
+                                                         interval));
+}
+
+// Split, tee and merge
+//
+// These build plans that branch and join rather than run in a line.
+
+// Runs each item through one of the branches, chosen by hashing key(item),
+// and merges their outputs in no particular order. Items with equal keys
+// always take the same branch, so a branch keeping state per key sees all
+// of that key's items, in order. The second form makes n copies of one
+// branch.
+template<typename IN,
+         typename OUT,
+         typename F>
+segment<IN, OUT> split_by(F key,
+                          const std::vector<segment<IN, OUT> >& branches) {
+  typedef typename std::decay<
+      typename std::result_of<F&(const IN&)>::type>::type key_type;
+  size_t n = branches.size();
+  if (n == 0) {
+    throw std::invalid_argument("split_by needs a branch");
+  }
+  std::vector<__segment_base<IN, OUT>*> bases;
+  for (size_t i = 0; i < n; ++i) {
+    bases.push_back(branches[i].base_->clone());
+  }
+  std::function<size_t (const IN&)> route = [key, n](const IN& in) mutable {
+    return std::hash<key_type>()(key(in)) % n;
+  };
+  return segment<IN, OUT>(new __segment_split<IN, OUT>(bases, route,
+                                                       "split_by"));
+}
+template<typename IN,
+         typename OUT,
+         typename F>
+segment<IN, OUT> split_by(F key, const segment<IN, OUT>& branch, size_t n) {
+  return split_by(key, std::vector<segment<IN, OUT> >(n, branch));
+}
+template<typename IN,
+         typename OUT,
+         typename F,
+         typename... S>
+segment<IN, OUT> split_by(F key, const segment<IN, OUT>& first,
+                          const segment<IN, OUT>& second, const S&... rest) {
+  return split_by(key, std::vector<segment<IN, OUT> >{first, second, rest...});
+}
+
+// Runs every item through every branch, and merges their outputs in no
+// particular order. Branches may be consumers, e.g. tee(to(f), to(g)).
+template<typename IN,
+         typename OUT>
+segment<IN, OUT> tee(const std::vector<segment<IN, OUT> >& branches) {
+  if (branches.empty()) {
+    throw std::invalid_argument("tee needs a branch");
+  }
+  std::vector<__segment_base<IN, OUT>*> bases;
+  for (size_t i = 0; i < branches.size(); ++i) {
+    bases.push_back(branches[i].base_->clone());
+  }
+  std::function<size_t (const IN&)> route = [](const IN&) {
+    return __all_branches;
+  };
+  return segment<IN, OUT>(new __segment_split<IN, OUT>(bases, route, "tee"));
+}
+template<typename IN,
+         typename OUT,
+         typename... S>
+segment<IN, OUT> tee(const segment<IN, OUT>& first,
+                     const segment<IN, OUT>& second, const S&... rest) {
+  return tee(std::vector<segment<IN, OUT> >{first, second, rest...});
+}
+
+// Joins several producers into one, taking items from each as they come.
+template<typename OUT>
+segment<terminated, OUT> merge(
+    const std::vector<segment<terminated, OUT> >& sources) {
+  if (sources.empty()) {
+    throw std::invalid_argument("merge needs a source");
+  }
+  std::vector<__segment_base<terminated, OUT>*> bases;
+  for (size_t i = 0; i < sources.size(); ++i) {
+    bases.push_back(sources[i].base_->clone());
+  }
+  return segment<terminated, OUT>(new __segment_merge<OUT>(bases));
+}
+template<typename OUT,
+         typename... S>
+segment<terminated, OUT> merge(const segment<terminated, OUT>& first,
+                               const segment<terminated, OUT>& second,
+                               const S&... rest) {
+  return merge(std::vector<segment<terminated, OUT> >{first, second,
+                                                      rest...});
+}
+
 // END CONSTRUCTORS
 
 // BEGIN PIPES
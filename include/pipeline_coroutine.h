@@ -0,0 +1,341 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Coroutine stages for pipelines.
+//
+// A coroutine stage suspends where a function stage would block:
+//
+//   stage_coroutine double_all(co_front<int> in, co_back<int> out) {
+//     int x;
+//     while (co_await in.pop(x)) {
+//       if (!co_await out.push(x * 2)) {
+//         break;  // Closed downstream
+//       }
+//     }
+//   }
+//
+//   plan p = from(q) | make(double_all) | to(r);
+//
+// Each coroutine stage runs as a task, so however many there are, they
+// share the plan's task workers (see run_options::workers) in any
+// execution_mode. A suspended stage holds only its coroutine frame; it
+// costs no thread and no context switch. The output is closed when the
+// coroutine returns.
+//
+// This header needs compiler support for coroutines; the rest of the
+// library does not. The library's headers do not build as C++17 or later
+// (flex_barrier.h has dynamic exception specifications), so with GCC use
+// -std=c++14 -fcoroutines, as `make test_co14` does for pipeline_test.
+
+#ifndef GCL_PIPELINE_COROUTINE_
+#define GCL_PIPELINE_COROUTINE_
+
+#if !defined(__cpp_impl_coroutine)
+#error "pipeline_coroutine.h needs a compiler with coroutine support"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <utility>
+
+#include "pipeline.h"
+
+namespace gcl {
+
+namespace pipeline {
+
+// A queue operation that a suspended coroutine stage waits on.
+class __co_wait {
+ public:
+  virtual ~__co_wait() {}
+  // Tries the operation again without blocking. Returns true once it has
+  // finished, successfully or not.
+  virtual bool retry() = 0;
+};
+
+// What the queue ends of a coroutine stage share with the task running it.
+struct __co_state {
+  __co_state() : waiting(NULL), budget(0) {}
+  __co_wait* waiting;  // The operation the coroutine is suspended on.
+  int budget;  // Operations left before yielding to other tasks.
+};
+
+// The return type of a coroutine stage. The coroutine starts suspended;
+// the task running it resumes it.
+class stage_coroutine {
+ public:
+  struct promise_type {
+    stage_coroutine get_return_object() {
+      return stage_coroutine(
+          std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() { return std::suspend_always(); }
+    std::suspend_always final_suspend() noexcept {
+      return std::suspend_always();
+    }
+    void return_void() {}
+    // Exceptions leave the stage as they would from a stage function.
+    void unhandled_exception() { throw; }
+  };
+
+  stage_coroutine(stage_coroutine&& c) : handle_(c.handle_) {
+    c.handle_ = std::coroutine_handle<promise_type>();
+  }
+  stage_coroutine& operator=(stage_coroutine&& c) {
+    std::swap(handle_, c.handle_);
+    return *this;
+  }
+  ~stage_coroutine() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  // Runs the coroutine until it suspends or returns. Returns true if it
+  // returned.
+  bool resume() {
+    handle_.resume();
+    return handle_.done();
+  }
+
+ private:
+  explicit stage_coroutine(std::coroutine_handle<promise_type> handle) :
+      handle_(handle) {}
+  stage_coroutine(const stage_coroutine&);  // undefined
+  stage_coroutine& operator=(const stage_coroutine&);  // undefined
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+// Awaits any queue operation: finishes at once if the operation can, else
+// suspends until the task finds that it can. After budget operations the
+// coroutine suspends regardless, so that one busy stage cannot starve the
+// others on its worker.
+template<typename Op>
+class __co_awaiter : public __co_wait {
+ public:
+  __co_awaiter(__co_state* state, Op op) :
+      state_(state), op_(op), status_(queue_op_status::empty) {}
+
+  bool await_ready() {
+    if (state_->budget <= 0) {
+      return false;
+    }
+    --state_->budget;
+    return retry();
+  }
+  void await_suspend(std::coroutine_handle<>) {
+    state_->waiting = this;
+  }
+  // True if the operation succeeded, false if the queue was closed.
+  bool await_resume() {
+    return status_ == queue_op_status::success;
+  }
+
+  virtual bool retry() {
+    status_ = op_();
+    return status_ != queue_op_status::empty &&
+        status_ != queue_op_status::full;
+  }
+
+ private:
+  __co_state* state_;
+  Op op_;
+  queue_op_status status_;
+};
+
+template<typename T>
+class __co_pop {
+ public:
+  __co_pop(queue_front<T> queue, T* item) : queue_(queue), item_(item) {}
+  queue_op_status operator()() { return queue_.try_pop(*item_); }
+
+ private:
+  queue_front<T> queue_;
+  T* item_;
+};
+
+template<typename T>
+class __co_push {
+ public:
+  __co_push(queue_back<T> queue, T&& item) :
+      queue_(queue), item_(std::move(item)) {}
+  // try_push moves from its argument only when it succeeds.
+  queue_op_status operator()() { return queue_.try_push(std::move(item_)); }
+
+ private:
+  queue_back<T> queue_;
+  T item_;
+};
+
+// The input of a coroutine stage. co_await in.pop(item) yields true once
+// an item has been popped into item, or false if the queue is closed and
+// empty.
+template<typename T>
+class co_front {
+ public:
+  co_front(queue_front<T> queue, __co_state* state) :
+      queue_(queue), state_(state) {}
+
+  __co_awaiter<__co_pop<T> > pop(T& item) {
+    return __co_awaiter<__co_pop<T> >(state_, __co_pop<T>(queue_, &item));
+  }
+
+ private:
+  queue_front<T> queue_;
+  __co_state* state_;
+};
+
+// The output of a coroutine stage. co_await out.push(item) yields true
+// once the item has been pushed, or false if the queue is closed.
+template<typename T>
+class co_back {
+ public:
+  co_back(queue_back<T> queue, __co_state* state) :
+      queue_(queue), state_(state) {}
+
+  __co_awaiter<__co_push<T> > push(T item) {
+    return __co_awaiter<__co_push<T> >(state_,
+                                       __co_push<T>(queue_, std::move(item)));
+  }
+
+ private:
+  queue_back<T> queue_;
+  __co_state* state_;
+};
+
+// Runs a coroutine stage on the task workers. Each step retries the
+// operation the coroutine waits on, and resumes it if that finished.
+template<typename IN,
+         typename OUT>
+class __coroutine_task : public __task {
+ public:
+  typedef std::function<stage_coroutine (co_front<IN>, co_back<OUT>)> func;
+
+  __coroutine_task(queue_front<IN> in_queue,
+                   queue_back<OUT> out_queue,
+                   func f,
+                   __stage* stage) :
+      in_queue_(in_queue), out_queue_(out_queue), func_(f), stage_(stage),
+      coroutine_(start()) {}
+
+  virtual __task_status step() {
+    if (stage_->cancelled()) {
+      return __task_status::done;
+    }
+    if (state_.waiting != NULL && !state_.waiting->retry()) {
+      return __task_status::blocked;
+    }
+    state_.waiting = NULL;
+    state_.budget = kTaskStepItems;
+    bool returned;
+    {
+      __busy_scope busy(stage_);
+      returned = coroutine_.resume();
+    }
+    if (returned) {
+      out_queue_.close();
+      return __task_status::done;
+    }
+    return __task_status::progress;
+  }
+  // A coroutine cannot be rewound, so another run starts a new one.
+  virtual void reset() {
+    state_ = __co_state();
+    coroutine_ = start();
+  }
+
+ private:
+  stage_coroutine start() {
+    return func_(co_front<IN>(in_queue_, &state_),
+                 co_back<OUT>(out_queue_, &state_));
+  }
+
+  queue_front<IN> in_queue_;
+  queue_back<OUT> out_queue_;
+  func func_;
+  __stage* stage_;
+  __co_state state_;
+  stage_coroutine coroutine_;
+};
+
+template<typename IN,
+         typename OUT>
+class __segment_coroutine : public __segment_base<IN, OUT> {
+ public:
+  typedef typename __coroutine_task<IN, OUT>::func func;
+
+  __segment_coroutine(func f) :
+      func_(f), name_("make"),
+      has_merged_in_queue_(false), merged_in_queue_(NULL) {}
+
+  virtual bool can_merge_on_front() { return !has_merged_in_queue_; }
+  virtual void merge_on_front(queue_front<IN> ft) {
+    merged_in_queue_ = ft;
+    has_merged_in_queue_ = true;
+  }
+  virtual void set_in_queue(typename __link<IN>::maker m, size_t capacity) {
+    link_.choose(m, capacity);
+  }
+  virtual void set_name(const string& name) { name_ = name; }
+
+ private:
+  __segment_coroutine(const __segment_coroutine<IN, OUT>& s) :
+      link_(s.link_),
+      func_(s.func_),
+      name_(s.name_),
+      has_merged_in_queue_(s.has_merged_in_queue_),
+      merged_in_queue_(s.merged_in_queue_) {}
+
+  virtual void run(__instance* inst, queue_back<OUT> out_queue) {
+    __stage* stage = inst->add_stage(name_);
+    queue_front<IN> in_queue = stage->watch_task(
+        has_merged_in_queue_ ? merged_in_queue_ : link_.get(inst));
+    out_queue = stage->watch_task(out_queue);
+    inst->schedule(new __coroutine_task<IN, OUT>(in_queue, out_queue,
+                                                 func_, stage));
+  }
+  virtual __segment_coroutine<IN, OUT>* clone() {
+    return new __segment_coroutine<IN, OUT>(*this);
+  }
+  virtual queue_back<IN> get_back(__instance* inst) {
+    return (has_merged_in_queue_ ? NULL : queue_back<IN>(link_.get(inst)));
+  }
+
+  __link<IN> link_;
+  func func_;
+  string name_;
+
+  bool has_merged_in_queue_;
+  queue_front<IN> merged_in_queue_;
+};
+
+template<typename IN,
+         typename OUT>
+segment<IN, OUT> make(
+    std::function<stage_coroutine (co_front<IN>, co_back<OUT>)> f) {
+  return segment<IN, OUT>(new __segment_coroutine<IN, OUT>(f));
+}
+template<typename IN,
+         typename OUT>
+segment<IN, OUT> make(stage_coroutine f(co_front<IN>, co_back<OUT>)) {
+  return make(
+      std::function<stage_coroutine (co_front<IN>, co_back<OUT>)>(f));
+}
+
+} // namespace pipeline
+
+} // namespace gcl
+#endif  // GCL_PIPELINE_COROUTINE_
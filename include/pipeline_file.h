@@ -0,0 +1,289 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// File sources and sinks for pipelines.
+//
+//   plan p = from_file("in.txt", delimited_chunks('\n'))
+//       | parse | format
+//       | to_file<string>("out.txt");
+//
+// from_file maps the whole file and hands out file_chunks that point into
+// the mapping, so no record is copied on the way in. to_file gathers what
+// it is given into a large page-aligned buffer, and writes whole buffers
+// at buffer-aligned offsets. Both need POSIX.
+
+#ifndef GCL_PIPELINE_FILE_
+#define GCL_PIPELINE_FILE_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <system_error>
+
+#include "pipeline.h"
+
+namespace gcl {
+
+namespace pipeline {
+
+// Throws the std::system_error for errno.
+inline void __throw_errno(const string& what) {
+  throw std::system_error(errno, std::system_category(), what);
+}
+
+// A file mapped into memory for as long as a chunk of it is in use.
+class __mapped_file {
+ public:
+  explicit __mapped_file(const string& path) : data_(NULL), size_(0) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      __throw_errno("pipeline: cannot open " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      __throw_errno("pipeline: cannot stat " + path);
+    }
+    size_ = st.st_size;
+    if (size_ > 0) {
+      void* data = ::mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        ::close(fd);
+        __throw_errno("pipeline: cannot map " + path);
+      }
+      data_ = static_cast<const char*>(data);
+      // Read ahead aggressively, and drop pages behind the reader early.
+      ::madvise(data, size_, MADV_SEQUENTIAL);
+      ::madvise(data, size_, MADV_WILLNEED);
+    }
+    ::close(fd);  // The mapping keeps the file.
+  }
+  ~__mapped_file() {
+    if (data_ != NULL) {
+      ::munmap(const_cast<char*>(data_), size_);
+    }
+  }
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  __mapped_file(const __mapped_file&);  // undefined
+  __mapped_file& operator=(const __mapped_file&);  // undefined
+
+  const char* data_;
+  size_t size_;
+};
+
+// A record of a file read by from_file. It points into the mapped file,
+// which stays mapped while any chunk of it exists.
+class file_chunk {
+ public:
+  file_chunk() : data_(NULL), size_(0) {}
+  file_chunk(std::shared_ptr<const __mapped_file> file, const char* data,
+             size_t size) :
+      file_(file), data_(data), size_(size) {}
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  // A copy of the bytes, for when they must outlive the chunk.
+  string str() const { return string(data_, size_); }
+
+ private:
+  std::shared_ptr<const __mapped_file> file_;
+  const char* data_;
+  size_t size_;
+};
+
+// Finds the next record in [begin, end), which is never empty. Returns its
+// length, and sets *next to where the record after it starts, past any
+// delimiter.
+typedef std::function<size_t (const char* begin, const char* end,
+                              const char** next)> chunker;
+
+// Records of n bytes; the last may be shorter.
+inline chunker fixed_chunks(size_t n) {
+  return [n](const char* begin, const char* end, const char** next) {
+    size_t size = std::min<size_t>(std::max<size_t>(n, 1), end - begin);
+    *next = begin + size;
+    return size;
+  };
+}
+
+// Records ending in delim, which the records leave out. The last record
+// needs no delim.
+inline chunker delimited_chunks(char delim = '\n') {
+  return [delim](const char* begin, const char* end, const char** next) {
+    const char* found =
+        static_cast<const char*>(::memchr(begin, delim, end - begin));
+    if (found == NULL) {
+      *next = end;
+      return static_cast<size_t>(end - begin);
+    }
+    *next = found + 1;
+    return static_cast<size_t>(found - begin);
+  };
+}
+
+// Chunks moved into the output queue at a time.
+const size_t kFileChunkBatch = 64;
+
+inline void __read_chunks(std::shared_ptr<const __mapped_file> file,
+                          chunker next_chunk, queue_back<file_chunk> out) {
+  file_chunk chunks[kFileChunkBatch];
+  size_t n = 0;
+  const char* end = file->data() + file->size();
+  for (const char* at = file->data(); at < end;) {
+    const char* next;
+    size_t size = next_chunk(at, end, &next);
+    chunks[n++] = file_chunk(file, at, size);
+    at = next;
+    if (n == kFileChunkBatch) {
+      if (out.wait_push_n(chunks, n) != queue_op_status::success) {
+        return;  // Closed downstream
+      }
+      n = 0;
+    }
+  }
+  if (n > 0) {
+    out.wait_push_n(chunks, n);
+  }
+}
+
+// Makes a producer of the records of the file at path, as split by next.
+// The file is mapped at once, and every run of the plan reads it from the
+// start. Throws std::system_error if the file cannot be read.
+inline segment<terminated, file_chunk> from_file(const string& path,
+                                                 chunker next) {
+  std::shared_ptr<const __mapped_file> file(new __mapped_file(path));
+  return from(std::function<void (queue_back<file_chunk>)>(
+      std::bind(__read_chunks, file, next, std::placeholders::_1)));
+}
+
+// A file written from the start by each run of a plan, through a buffer
+// of whole pages.
+class __file_writer {
+ public:
+  __file_writer(const string& path, size_t buffer) :
+      path_(path), buffer_(NULL), capacity_(0), used_(0), offset_(0) {
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd_ < 0) {
+      __throw_errno("pipeline: cannot open " + path);
+    }
+    size_t page = ::sysconf(_SC_PAGESIZE);
+    capacity_ = std::max(page, (buffer + page - 1) / page * page);
+    void* memory;
+    if (::posix_memalign(&memory, page, capacity_) != 0) {
+      ::close(fd_);
+      throw std::bad_alloc();
+    }
+    buffer_ = static_cast<char*>(memory);
+  }
+  ~__file_writer() {
+    ::close(fd_);
+    ::free(buffer_);
+  }
+
+  // Writes every item in in_queue, then truncates the file to them.
+  template<typename T>
+  void write_all(queue_front<T> in_queue) {
+    used_ = 0;
+    offset_ = 0;
+    T item;
+    while (in_queue.wait_pop(item) == queue_op_status::success) {
+      append(item.data(), item.size());
+    }
+    flush();
+    if (::ftruncate(fd_, offset_) != 0) {
+      __throw_errno("pipeline: cannot truncate " + path_);
+    }
+  }
+
+ private:
+  __file_writer(const __file_writer&);  // undefined
+  __file_writer& operator=(const __file_writer&);  // undefined
+
+  void append(const char* data, size_t size) {
+    while (size > 0) {
+      if (used_ == 0 && size >= capacity_) {
+        // Whole buffers' worth goes straight to the file.
+        size_t direct = size / capacity_ * capacity_;
+        write(data, direct);
+        data += direct;
+        size -= direct;
+        continue;
+      }
+      size_t n = std::min(size, capacity_ - used_);
+      ::memcpy(buffer_ + used_, data, n);
+      used_ += n;
+      data += n;
+      size -= n;
+      if (used_ == capacity_) {
+        flush();
+      }
+    }
+  }
+  void flush() {
+    write(buffer_, used_);
+    used_ = 0;
+  }
+  void write(const char* data, size_t size) {
+    while (size > 0) {
+      ssize_t written = ::pwrite(fd_, data, size, offset_);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        __throw_errno("pipeline: cannot write " + path_);
+      }
+      data += written;
+      size -= written;
+      offset_ += written;
+    }
+  }
+
+  string path_;
+  int fd_;
+  char* buffer_;
+  size_t capacity_;
+  size_t used_;
+  off_t offset_;
+};
+
+// Makes a consumer writing the bytes of each item, in the order they
+// arrive, to the file at path. T needs data() and size(), as string and
+// file_chunk have. Writes go through a buffer of at least buffer bytes,
+// rounded up to whole pages. The file is created or truncated at once, and
+// every run of the plan writes it afresh; throws std::system_error if it
+// cannot be opened. Stages writing one file must not run at once.
+template<typename T>
+segment<T, terminated> to_file(const string& path,
+                               size_t buffer = 1 << 20) {
+  std::shared_ptr<__file_writer> writer(new __file_writer(path, buffer));
+  return to(std::function<void (queue_front<T>)>(
+      [writer](queue_front<T> in_queue) { writer->write_all(in_queue); }));
+}
+
+} // namespace pipeline
+
+} // namespace gcl
+#endif  // GCL_PIPELINE_FILE_
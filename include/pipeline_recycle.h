@@ -0,0 +1,280 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Recycled items for pipelines.
+//
+//   recycler<std::vector<char> > buffers;
+//   plan p = from_recycler(buffers, read_block)
+//       | compress
+//       | write_block;
+//
+// A recycler hands out objects as recycled<T>s, which share them as
+// shared_ptrs would. Once the last recycled<T> of an object is gone, the
+// object goes back to its recycler rather than being freed, and comes out
+// again, as it was left, from a later get(). When the source of a plan
+// takes its items from a recycler and the sink lets them go, the plan
+// makes only as many objects as it holds at once, and after that
+// allocates nothing per item.
+//
+// Each thread keeps the objects it last gave back, or took, in a cache of
+// its own, and moves them to and from the recycler kRecycleBatch at a
+// time. A sink thread and a source thread therefore seldom meet on the
+// recycler's lock, and no object is freed by a thread other than the one
+// that gives it back for the last time. A thread caches for one recycler
+// of each type at once.
+
+#ifndef GCL_PIPELINE_RECYCLE_
+#define GCL_PIPELINE_RECYCLE_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "pipeline.h"
+
+namespace gcl {
+
+namespace pipeline {
+
+// Objects moved between a thread's cache and its recycler at a time.
+const size_t kRecycleBatch = 32;
+
+template<typename T>
+class __recycle_pool;
+
+// An object of a recycler, with the count of recycled<T>s sharing it.
+template<typename T>
+struct __recycle_node {
+  explicit __recycle_node(__recycle_pool<T>* p) :
+      refs(0), pool(p), next(NULL), value() {}
+
+  std::atomic<size_t> refs;
+  __recycle_pool<T>* pool;
+  __recycle_node<T>* next;  // While idle.
+  T value;
+};
+
+// Idle objects, linked through the objects themselves so that keeping one
+// allocates nothing.
+template<typename T>
+struct __recycle_list {
+  __recycle_list() : head(NULL), size(0) {}
+
+  void push(__recycle_node<T>* node) {
+    node->next = head;
+    head = node;
+    ++size;
+  }
+  __recycle_node<T>* pop() {
+    __recycle_node<T>* node = head;
+    head = node->next;
+    --size;
+    return node;
+  }
+  // Moves up to n objects from other to this.
+  void take(__recycle_list<T>& other, size_t n) {
+    for (; n > 0 && other.size > 0; --n) {
+      push(other.pop());
+    }
+  }
+  void clear() {
+    while (size > 0) {
+      delete pop();
+    }
+  }
+
+  __recycle_node<T>* head;
+  size_t size;
+};
+
+// The objects a thread has of the one recycler of T it last used. The
+// cache keeps that recycler's pool, and gives the objects back to it when
+// the thread moves on to another recycler or exits.
+template<typename T>
+struct __recycle_cache {
+  ~__recycle_cache() { adopt(std::shared_ptr<__recycle_pool<T> >()); }
+
+  static __recycle_cache<T>& local() {
+    static thread_local __recycle_cache<T> cache;
+    return cache;
+  }
+
+  void adopt(std::shared_ptr<__recycle_pool<T> > p) {
+    if (pool) {
+      pool->give(idle, idle.size);
+    }
+    pool = p;
+  }
+
+  std::shared_ptr<__recycle_pool<T> > pool;
+  __recycle_list<T> idle;
+};
+
+// The objects of a recycler not in use, and not in a thread's cache.
+template<typename T>
+class __recycle_pool :
+    public std::enable_shared_from_this<__recycle_pool<T> > {
+ public:
+  __recycle_pool() : allocated_(0) {}
+  ~__recycle_pool() { idle_.clear(); }
+
+  __recycle_node<T>* get() {
+    __recycle_cache<T>& cache = local_cache();
+    if (cache.idle.size == 0) {
+      std::lock_guard<std::mutex> lock(mu_);
+      cache.idle.take(idle_, kRecycleBatch);
+    }
+    if (cache.idle.size > 0) {
+      return cache.idle.pop();
+    }
+    ++allocated_;
+    return new __recycle_node<T>(this);
+  }
+  void put(__recycle_node<T>* node) {
+    __recycle_cache<T>& cache = local_cache();
+    cache.idle.push(node);
+    if (cache.idle.size >= 2 * kRecycleBatch) {
+      give(cache.idle, kRecycleBatch);
+    }
+  }
+  // Moves up to n objects from a thread's cache to the pool.
+  void give(__recycle_list<T>& idle, size_t n) {
+    std::lock_guard<std::mutex> lock(mu_);
+    idle_.take(idle, n);
+  }
+
+  size_t allocated() const {
+    return allocated_;
+  }
+
+ private:
+  __recycle_cache<T>& local_cache() {
+    __recycle_cache<T>& cache = __recycle_cache<T>::local();
+    if (cache.pool.get() != this) {
+      cache.adopt(this->shared_from_this());
+    }
+    return cache;
+  }
+
+  std::mutex mu_;
+  __recycle_list<T> idle_;  // Guarded by mu_.
+  std::atomic<size_t> allocated_;
+};
+
+template<typename T>
+class recycler;
+
+// An object of a recycler, shared by the copies of the recycled<T> that
+// recycler::get() returned. A default-constructed recycled<T> has none.
+template<typename T>
+class recycled {
+ public:
+  recycled() : node_(NULL) {}
+  recycled(const recycled<T>& other) : node_(other.node_) {
+    if (node_ != NULL) {
+      node_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  recycled(recycled<T>&& other) : node_(other.node_) {
+    other.node_ = NULL;
+  }
+  ~recycled() { release(); }
+
+  recycled<T>& operator=(recycled<T> other) {
+    std::swap(node_, other.node_);
+    return *this;
+  }
+
+  T& operator*() const { return node_->value; }
+  T* operator->() const { return &node_->value; }
+  T* get() const { return node_ != NULL ? &node_->value : NULL; }
+  explicit operator bool() const { return node_ != NULL; }
+
+ private:
+  friend class recycler<T>;
+
+  explicit recycled(__recycle_node<T>* node) : node_(node) {
+    node_->refs.store(1, std::memory_order_relaxed);
+  }
+
+  void release() {
+    if (node_ != NULL &&
+        node_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      node_->pool->put(node_);
+    }
+    node_ = NULL;
+  }
+
+  __recycle_node<T>* node_;
+};
+
+// Hands out default-constructed objects of T, and those given back. A
+// recycler must outlive the recycled<T>s it hands out, and so every
+// execution of a plan using it.
+template<typename T>
+class recycler {
+ public:
+  recycler() : pool_(new __recycle_pool<T>()) {}
+
+  // Safe to call from several threads at once.
+  recycled<T> get() {
+    return recycled<T>(pool_->get());
+  }
+  // The number of objects made so far.
+  size_t allocated() const {
+    return pool_->allocated();
+  }
+
+ private:
+  recycler(const recycler<T>&);  // undefined
+  recycler<T>& operator=(const recycler<T>&);  // undefined
+
+  std::shared_ptr<__recycle_pool<T> > pool_;
+};
+
+template<typename T>
+void __fill_recycled(recycler<T>* pool, std::function<bool (T&)> fill,
+                     queue_back<recycled<T> > out) {
+  for (;;) {
+    recycled<T> item = pool->get();
+    if (!fill(*item)) {
+      return;
+    }
+    if (out.wait_push(std::move(item)) != queue_op_status::success) {
+      return;  // Closed downstream
+    }
+  }
+}
+
+  // BEGIN CONSTRUCTORS
+
+// Makes a producer of objects of pool, each filled by fill, which returns
+// false, leaving the object unused, once there are no more. An object may
+// come with what a previous item left in it, so fill should overwrite it.
+template<typename T,
+         typename F>
+segment<terminated, recycled<T> > from_recycler(recycler<T>& pool, F fill) {
+  return from(std::function<void (queue_back<recycled<T> >)>(
+      std::bind(__fill_recycled<T>, &pool, std::function<bool (T&)>(fill),
+                std::placeholders::_1)));
+}
+
+  // END CONSTRUCTORS
+
+} // namespace pipeline
+
+} // namespace gcl
+#endif  // GCL_PIPELINE_RECYCLE_
@@ -0,0 +1,349 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Statically typed plans.
+//
+//   plan p = static_from(in) | static_make(parse) | static_make(score)
+//       | static_to(out);
+//
+// The type of such a plan spells out every stage. The stage functions are
+// kept by value, lambdas included, and called directly, and the queues
+// between stages are buffer_queues kept inside the plan, so a plan is one
+// object: no stage is allocated on its own, and no item goes through a
+// std::function, a virtual call or a type-erased queue. What operator|
+// makes of a source, functions and a consumer is an ordinary plan, which
+// runs, prepares and cancels like any other. Profiles of it count items and
+// busy time, but not waits, and it is never traced.
+//
+// Every stage has a thread of its own, in execution_mode::tasks as well.
+// Static plans cannot run serially, and in execution_mode::automatic they
+// run on threads from the start.
+
+#ifndef GCL_PIPELINE_STATIC_
+#define GCL_PIPELINE_STATIC_
+
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "buffer_queue.h"
+#include "pipeline.h"
+
+namespace gcl {
+
+namespace pipeline {
+
+// Reopens a queue of a static plan before another run. Queues whose
+// reopen() can fail, such as those derived from queue_base, throw as
+// dynamic plans do.
+template<typename Q>
+auto __static_reopen(Q& queue, int) -> decltype(static_cast<void>(
+    !queue.reopen())) {
+  __reopen(&queue);
+}
+template<typename Q>
+void __static_reopen(Q& queue, long) {
+  queue.reopen();
+}
+
+// Closes q if the plan is cancelled, and reopens it before another run.
+template<typename Q>
+void __static_watch(__stage* stage, Q& q) {
+  stage->on_cancel([&q]() { q.close(); });
+  stage->on_rerun([&q]() { __static_reopen(q, 0); });
+}
+
+template<typename IN,
+         typename OUT,
+         typename F>
+void __run_static_function(IN& in_queue, OUT& out_queue, F& func,
+                           __stage* stage) {
+  stage->start();
+  typename IN::value_type in;
+  bool profiling = stage->profiling();
+  while (!stage->cancelled() &&
+         in_queue.wait_pop(in) == queue_op_status::success) {
+    if (out_queue.wait_push(__busy_call(stage, func, std::move(in))) !=
+        queue_op_status::success) {
+      break;  // Closed downstream
+    }
+    if (profiling) {
+      stage->popped(1, NULL);
+      stage->pushed(1, NULL);
+    }
+  }
+  out_queue.close();
+  stage->done();
+}
+
+template<typename IN,
+         typename F>
+void __run_static_consumer(IN& in_queue, F& func, __stage* stage) {
+  stage->start();
+  typename IN::value_type in;
+  bool profiling = stage->profiling();
+  while (!stage->cancelled() &&
+         in_queue.wait_pop(in) == queue_op_status::success) {
+    __busy_call(stage, func, std::move(in));
+    if (profiling) {
+      stage->popped(1, NULL);
+    }
+  }
+  stage->done();
+}
+
+// The start of a static plan: the items of a queue, of any type with the
+// buffer_queue interface, that is filled and closed outside the plan.
+template<typename Q>
+class __static_from {
+ public:
+  typedef typename Q::value_type out_type;
+
+  explicit __static_from(Q& queue) : queue_(&queue) {}
+
+  Q& queue() const { return *queue_; }
+
+ private:
+  Q* queue_;
+};
+
+// A function of a static plan, before it is given its input.
+template<typename F>
+class __static_make {
+ public:
+  __static_make(F func, size_t capacity) : func_(func), capacity_(capacity) {}
+
+  const F& function() const { return func_; }
+  size_t capacity() const { return capacity_; }
+
+ private:
+  F func_;
+  size_t capacity_;
+};
+
+// The queue a stage of a static plan reads: one of its own, which the
+// stages before it fill...
+template<typename UP>
+class __static_input {
+ public:
+  typedef buffer_queue<typename UP::out_type> queue_type;
+
+  explicit __static_input(size_t capacity) :
+      queue_(capacity), capacity_(capacity) {}
+  // Copies make a queue of their own.
+  __static_input(const __static_input<UP>& in) :
+      queue_(in.capacity_), capacity_(in.capacity_) {}
+
+  queue_type& start(__instance* inst, UP& up) {
+    up.run(inst, queue_);
+    return queue_;
+  }
+
+ private:
+  __static_input<UP>& operator=(const __static_input<UP>&);  // undefined
+
+  queue_type queue_;
+  size_t capacity_;
+};
+
+// ...or the source queue, if the stage is the first.
+template<typename Q>
+class __static_input<__static_from<Q> > {
+ public:
+  explicit __static_input(size_t capacity) {}
+
+  Q& start(__instance* inst, __static_from<Q>& up) {
+    return up.queue();
+  }
+};
+
+// The items of UP, passed through F on a thread of its own.
+template<typename UP,
+         typename F>
+class __static_pipe {
+ public:
+  typedef typename UP::out_type in_type;
+  typedef typename std::decay<
+      typename std::result_of<F(in_type)>::type>::type out_type;
+
+  __static_pipe(const UP& up, const __static_make<F>& make) :
+      up_(up), in_(make.capacity()), func_(make.function()) {}
+
+  // Starts the stages before this one, then this one, which pushes to
+  // out_queue.
+  template<typename Q>
+  void run(__instance* inst, Q& out_queue) {
+    auto& in_queue = in_.start(inst, up_);
+    __stage* stage = inst->add_stage("make");
+    __static_watch(stage, in_queue);
+    __static_watch(stage, out_queue);
+    inst->execute([this, &in_queue, &out_queue, stage]() {
+      __run_static_function(in_queue, out_queue, func_, stage);
+    });
+  }
+
+ private:
+  UP up_;
+  __static_input<UP> in_;
+  F func_;
+};
+
+// The end of a static plan, before it is given its input: a function
+// taking each item...
+template<typename F>
+class __static_to {
+ public:
+  __static_to(F func, size_t capacity) : func_(func), capacity_(capacity) {}
+
+  const F& function() const { return func_; }
+  size_t capacity() const { return capacity_; }
+
+ private:
+  F func_;
+  size_t capacity_;
+};
+
+// ...or a queue, filled by the last function and emptied outside the plan.
+template<typename Q>
+class __static_to_queue {
+ public:
+  explicit __static_to_queue(Q& queue) : queue_(&queue) {}
+
+  Q& queue() const { return *queue_; }
+
+ private:
+  Q* queue_;
+};
+
+// A whole static plan, as the one segment of an ordinary plan.
+template<typename UP,
+         typename F>
+class __segment_static : public __segment_base<terminated, terminated> {
+ public:
+  __segment_static(const UP& up, const __static_to<F>& to) :
+      up_(up), in_(to.capacity()), func_(to.function()) {}
+
+  virtual void run(__instance* inst, queue_back<terminated> out_queue) {
+    auto& in_queue = in_.start(inst, up_);
+    __stage* stage = inst->add_stage("to");
+    __static_watch(stage, in_queue);
+    inst->execute([this, &in_queue, stage]() {
+      __run_static_consumer(in_queue, func_, stage);
+    });
+  }
+  virtual __segment_static<UP, F>* clone() {
+    return new __segment_static<UP, F>(*this);
+  }
+  virtual queue_back<terminated> get_back(__instance* inst) {
+    return NULL;
+  }
+
+ private:
+  UP up_;
+  __static_input<UP> in_;
+  F func_;
+};
+
+template<typename UP,
+         typename Q>
+class __segment_static_queue : public __segment_base<terminated, terminated> {
+ public:
+  __segment_static_queue(const UP& up, const __static_to_queue<Q>& to) :
+      up_(up), queue_(&to.queue()) {}
+
+  virtual void run(__instance* inst, queue_back<terminated> out_queue) {
+    up_.run(inst, *queue_);
+  }
+  virtual __segment_static_queue<UP, Q>* clone() {
+    return new __segment_static_queue<UP, Q>(*this);
+  }
+  virtual queue_back<terminated> get_back(__instance* inst) {
+    return NULL;
+  }
+
+ private:
+  UP up_;
+  Q* queue_;
+};
+
+  // BEGIN CONSTRUCTORS
+
+// Starts a static plan with the items of queue, which must outlive every
+// execution of the plan.
+template<typename Q>
+__static_from<Q> static_from(Q& queue) {
+  return __static_from<Q>(queue);
+}
+
+// A function of a static plan: any callable taking the item before it,
+// whose result goes on. capacity sizes the queue feeding it, if it is not
+// the first function.
+template<typename F>
+__static_make<F> static_make(F func, size_t capacity = 10) {
+  return __static_make<F>(func, capacity);
+}
+
+// Ends a static plan with a callable taking each item, fed by a queue of
+// capacity items.
+template<typename F>
+__static_to<F> static_to(F func, size_t capacity = 10) {
+  return __static_to<F>(func, capacity);
+}
+// Ends a static plan with a queue that outlives every execution of the
+// plan. The last function pushes to it directly, so a plan ending in a
+// queue needs one.
+template<typename Q>
+__static_to_queue<Q> static_to_queue(Q& queue) {
+  return __static_to_queue<Q>(queue);
+}
+
+template<typename Q,
+         typename F>
+__static_pipe<__static_from<Q>, F> operator|(const __static_from<Q>& up,
+                                             const __static_make<F>& make) {
+  return __static_pipe<__static_from<Q>, F>(up, make);
+}
+template<typename UP,
+         typename G,
+         typename F>
+__static_pipe<__static_pipe<UP, G>, F> operator|(
+    const __static_pipe<UP, G>& up, const __static_make<F>& make) {
+  return __static_pipe<__static_pipe<UP, G>, F>(up, make);
+}
+
+template<typename Q,
+         typename F>
+plan operator|(const __static_from<Q>& up, const __static_to<F>& to) {
+  return plan(new __segment_static<__static_from<Q>, F>(up, to));
+}
+template<typename UP,
+         typename G,
+         typename F>
+plan operator|(const __static_pipe<UP, G>& up, const __static_to<F>& to) {
+  return plan(new __segment_static<__static_pipe<UP, G>, F>(up, to));
+}
+template<typename UP,
+         typename G,
+         typename Q>
+plan operator|(const __static_pipe<UP, G>& up,
+               const __static_to_queue<Q>& to) {
+  return plan(new __segment_static_queue<__static_pipe<UP, G>, Q>(up, to));
+}
+
+  // END CONSTRUCTORS
+
+} // namespace pipeline
+
+} // namespace gcl
+#endif  // GCL_PIPELINE_STATIC_
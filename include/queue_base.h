@@ -21,6 +21,7 @@
 #include <iostream>
 
 #include <atomic>
+#include <chrono>
 
 namespace gcl {
 
@@ -158,8 +159,12 @@ class generic_queue_back
         { return queue_->try_push( std::move(x) ); }
     queue_op_status nonblocking_push(value_type&& x)
         { return queue_->nonblocking_push( std::move(x) ); }
+    queue_op_status wait_push_n(value_type* x, size_t n)
+        { return queue_->wait_push_n(x, n); }
 
     bool has_queue() { return queue_ != NULL; }
+    // The queue this end refers to; NULL if none.
+    Queue* queue() const { return queue_; }
 
   protected:
     Queue* queue_;
@@ -201,8 +206,13 @@ class generic_queue_front
         { return queue_->try_pop(x); }
     queue_op_status nonblocking_pop(value_type& x)
         { return queue_->nonblocking_pop(x); }
+    size_t wait_pop_n(value_type* x, size_t n,
+                      std::chrono::microseconds linger)
+        { return queue_->wait_pop_n(x, n, linger); }
 
     bool has_queue() { return queue_ != NULL; }
+    // The queue this end refers to; NULL if none.
+    Queue* queue() const { return queue_; }
 
   protected:
     Queue* queue_;
@@ -257,8 +267,48 @@ class queue_base
     virtual queue_op_status wait_pop(Value&) = 0;
     virtual queue_op_status try_pop(Value&) = 0;
     virtual queue_op_status nonblocking_pop(Value&) = 0;
+
+    /* Bulk operations, which let a queue move many elements under one
+       lock acquisition.  wait_pop_n waits for one element, then for up to
+       linger for n, and pops as many as it has; it returns zero only when
+       the queue is closed and empty.  wait_push_n moves in all n elements,
+       waiting for space as needed.  These defaults work one element at a
+       time; the default wait_pop_n takes what follows the first element
+       without waiting for more, so it does not linger. */
+    virtual size_t wait_pop_n(Value* x, size_t n,
+                              std::chrono::microseconds linger);
+    virtual queue_op_status wait_push_n(Value* x, size_t n);
+
+    /* Opens a closed queue again, discarding any elements left in it, so
+       that it can be reused.  No other thread may be using the queue.  An
+       open queue is left as it is.  Returns false if the queue cannot be
+       reopened, which is the default. */
+    virtual bool reopen() { return false; }
 };
 
+template <typename Value>
+size_t queue_base<Value>::wait_pop_n(Value* x, size_t n,
+                                     std::chrono::microseconds linger)
+{
+    if ( n == 0 || wait_pop( x[0] ) != queue_op_status::success )
+        return 0;
+    size_t popped = 1;
+    while ( popped < n && try_pop( x[popped] ) == queue_op_status::success )
+        ++popped;
+    return popped;
+}
+
+template <typename Value>
+queue_op_status queue_base<Value>::wait_push_n(Value* x, size_t n)
+{
+    for ( size_t i = 0; i < n; ++i ) {
+        queue_op_status s = wait_push( std::move( x[i] ) );
+        if ( s != queue_op_status::success )
+            return s;
+    }
+    return queue_op_status::success;
+}
+
 //TODO(crowl): Use template aliases for queue_back and queue_front?
 
 template <typename Value>
@@ -656,6 +706,42 @@ class queue_object
         { return obj_.try_pop(x); }
     virtual queue_op_status nonblocking_pop(value_type& x)
         { return obj_.nonblocking_pop(x); }
+
+    /* Use the bulk operations of Queue when it has them. */
+    virtual size_t wait_pop_n(value_type* x, size_t n,
+                              std::chrono::microseconds linger)
+        { return bulk_pop(obj_, x, n, linger, 0); }
+    virtual queue_op_status wait_push_n(value_type* x, size_t n)
+        { return bulk_push(obj_, x, n, 0); }
+
+    virtual bool reopen()
+        { return reopen_queue(obj_, 0); }
+
+  private:
+    typedef queue_base<value_type> base_type;
+
+    template <typename Q>
+    auto bulk_pop(Q& q, value_type* x, size_t n,
+                  std::chrono::microseconds linger, int)
+        -> decltype(q.wait_pop_n(x, n, linger))
+        { return q.wait_pop_n(x, n, linger); }
+    template <typename Q>
+    size_t bulk_pop(Q&, value_type* x, size_t n,
+                    std::chrono::microseconds linger, long)
+        { return base_type::wait_pop_n(x, n, linger); }
+    template <typename Q>
+    auto bulk_push(Q& q, value_type* x, size_t n, int)
+        -> decltype(q.wait_push_n(x, n))
+        { return q.wait_push_n(x, n); }
+    template <typename Q>
+    queue_op_status bulk_push(Q&, value_type* x, size_t n, long)
+        { return base_type::wait_push_n(x, n); }
+    template <typename Q>
+    auto reopen_queue(Q& q, int) -> decltype(q.reopen(), true)
+        { q.reopen(); return true; }
+    template <typename Q>
+    bool reopen_queue(Q&, long)
+        { return base_type::reopen(); }
 };
 
 template <typename Queue, typename ... Args>
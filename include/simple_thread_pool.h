@@ -66,7 +66,9 @@ class simple_thread_pool {
   // Returns NULL if no thread is available.
   mutable_thread* try_get_unused_thread();
 
-  // Donates a mutable thread to the thread pool for re-use.
+  // Donates a mutable thread to the thread pool for re-use. A thread pinned
+  // to CPUs with mutable_thread::set_affinity gets back the CPUs it had
+  // before.
   // Returns false if the thread pool is full and cannot receive any more
   // threads.
   bool donate_thread(mutable_thread* t);
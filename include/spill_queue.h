@@ -0,0 +1,619 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A queue that never fills. It keeps up to max_elems values in memory;
+// beyond that, pushes serialize values into a file of its own, which pops
+// read back in order once memory runs dry. A burst that a slow consumer
+// cannot keep up with therefore costs disk, not memory, and does not
+// block the producer.
+//
+// Values are serialized with spill_traits<Value>, which handles trivially
+// copyable types and std::string; specialize it for other types.
+//
+// As a pipeline link:
+//
+//   pipeline::make(parse) | pipeline::to(store).with_queue<spill_queue>(1000)
+//
+// The file is created unlinked under $TMPDIR, or /tmp, on the first
+// spill, and its space is given back whenever the queue drains it. Under
+// a backlog that never drains, pushes move on to a new file once pops
+// have read kSpillRotate bytes of the current one, which goes away when
+// pops have read the rest of it.
+//
+// Files are written and read with the queue's lock released, one write
+// and one read at a time. A pop that needs values another thread is
+// writing or reading waits for it; nonblocking_pop returns busy instead.
+
+#ifndef SPILL_QUEUE_H
+#define SPILL_QUEUE_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include "queue_base.h"
+
+namespace gcl {
+
+// How a spill_queue writes a value to its file, and reads it back.
+template <typename Value>
+struct spill_traits
+{
+    static_assert(std::is_trivially_copyable<Value>::value,
+                  "specialize spill_traits for this type");
+
+    // Appends the bytes of x to bytes.
+    static void save(const Value& x, std::string* bytes)
+    {
+        bytes->append(reinterpret_cast<const char*>(&x), sizeof(Value));
+    }
+    // Makes *x from the size bytes save wrote.
+    static void load(const char* data, size_t size, Value* x)
+    {
+        memcpy(x, data, sizeof(Value));
+    }
+};
+
+template <>
+struct spill_traits<std::string>
+{
+    static void save(const std::string& x, std::string* bytes)
+        { bytes->append(x); }
+    static void load(const char* data, size_t size, std::string* x)
+        { x->assign(data, size); }
+};
+
+// Bytes of records written to, or read from, the file at a time.
+const size_t kSpillBlock = 64 * 1024;
+// Bytes read from a file before pushes move on to a new one.
+const off_t kSpillRotate = 16 * kSpillBlock;
+
+template <typename Value>
+class spill_queue
+{
+  public:
+    typedef Value value_type;
+
+    spill_queue() = delete;
+    spill_queue(const spill_queue&) = delete;
+    explicit spill_queue(size_t max_elems);
+    spill_queue& operator =(const spill_queue&) = delete;
+    ~spill_queue();
+
+    void close();
+    bool is_closed();
+    bool is_empty();
+    // Discards what the queue holds, in memory and on disk.
+    void reopen();
+
+    Value value_pop();
+    queue_op_status wait_pop(Value&);
+    queue_op_status try_pop(Value&);
+    queue_op_status nonblocking_pop(Value&);
+
+    // Pushes never find the queue full.
+    void push(const Value& x);
+    queue_op_status wait_push(const Value& x);
+    queue_op_status try_push(const Value& x);
+    queue_op_status nonblocking_push(const Value& x);
+    void push(Value&& x);
+    queue_op_status wait_push(Value&& x);
+    queue_op_status try_push(Value&& x);
+    queue_op_status nonblocking_push(Value&& x);
+
+    // The values held outside memory, on disk or on their way to it.
+    size_t spilled();
+
+  private:
+    std::mutex mtx_;
+    std::condition_variable not_empty_;
+    // The values in memory: a ring of count_ from ring_[head_].
+    std::vector<Value> ring_;
+    size_t head_;
+    size_t count_;
+    bool closed_;
+
+    // The values after those in memory, in order: records in old_fd_
+    // from file_read_ to old_end_, if there is an old file; records in
+    // fd_ from file_read_ (or 0 after an old file) to file_write_; those
+    // in flush_buf_ while flushing_; then those in write_buf_. Records
+    // read from a file wait in read_buf_ from read_pos_. Each record is
+    // its length as a uint32_t, then what spill_traits saved.
+    int fd_;
+    int old_fd_;
+    off_t old_end_;
+    off_t file_read_;
+    off_t file_write_;
+    std::string write_buf_;
+    std::string read_buf_;
+    size_t read_pos_;
+    size_t spilled_;
+
+    // At most one write and one read of a file go on at a time, each
+    // outside mtx_; io_done_ tells of the end of either.
+    std::condition_variable io_done_;
+    bool flushing_;
+    bool reading_;
+    std::string flush_buf_;
+    std::string fetch_buf_;
+
+    queue_op_status try_pop_common(std::unique_lock<std::mutex>& hold,
+                                   Value& x, bool wait);
+    template <typename V>
+    queue_op_status push_common(std::unique_lock<std::mutex>& hold, V&& x);
+    void spill(std::unique_lock<std::mutex>& hold, const Value& x);
+    bool unspill(std::unique_lock<std::mutex>& hold, bool wait);
+    queue_op_status buffered(std::unique_lock<std::mutex>& hold, size_t n);
+    void read_file(std::unique_lock<std::mutex>& hold, size_t n);
+    void flush_writes(std::unique_lock<std::mutex>& hold);
+    void discard(std::unique_lock<std::mutex>& hold);
+};
+
+inline void spill_queue_error(const char* what)
+{
+    throw std::system_error(errno, std::system_category(), what);
+}
+
+template <typename Value>
+spill_queue<Value>::spill_queue(size_t max_elems)
+:
+    head_( 0 ),
+    count_( 0 ),
+    closed_( false ),
+    fd_( -1 ),
+    old_fd_( -1 ),
+    old_end_( 0 ),
+    file_read_( 0 ),
+    file_write_( 0 ),
+    read_pos_( 0 ),
+    spilled_( 0 ),
+    flushing_( false ),
+    reading_( false )
+{
+    if ( max_elems < 1 )
+        throw std::invalid_argument("number of elements must be at least one");
+    ring_.resize( max_elems );
+}
+
+template <typename Value>
+spill_queue<Value>::~spill_queue()
+{
+    if ( fd_ >= 0 )
+        ::close( fd_ );
+    if ( old_fd_ >= 0 )
+        ::close( old_fd_ );
+}
+
+template <typename Value>
+void spill_queue<Value>::close()
+{
+    std::lock_guard<std::mutex> hold( mtx_ );
+    closed_ = true;
+    not_empty_.notify_all();
+}
+
+template <typename Value>
+bool spill_queue<Value>::is_closed()
+{
+    std::lock_guard<std::mutex> hold( mtx_ );
+    return closed_;
+}
+
+template <typename Value>
+bool spill_queue<Value>::is_empty()
+{
+    std::lock_guard<std::mutex> hold( mtx_ );
+    return count_ == 0 && spilled_ == 0;
+}
+
+template <typename Value>
+void spill_queue<Value>::reopen()
+{
+    std::unique_lock<std::mutex> hold( mtx_ );
+    if ( closed_ ) {
+        head_ = 0;
+        count_ = 0;
+        discard( hold );
+        closed_ = false;
+    }
+}
+
+template <typename Value>
+size_t spill_queue<Value>::spilled()
+{
+    std::lock_guard<std::mutex> hold( mtx_ );
+    return spilled_;
+}
+
+// With wait false, returns busy rather than wait for another thread's
+// read or write of the file.
+template <typename Value>
+queue_op_status spill_queue<Value>::try_pop_common(
+    std::unique_lock<std::mutex>& hold, Value& elem, bool wait)
+{
+    if ( count_ == 0 && spilled_ > 0 && !unspill( hold, wait )
+         && count_ == 0 )
+        return queue_op_status::busy;
+    if ( count_ == 0 ) {
+        if ( closed_ )
+            return queue_op_status::closed;
+        else
+            return queue_op_status::empty;
+    }
+    size_t pdx = head_;
+    head_ = (head_ + 1) % ring_.size();
+    --count_;
+    elem = std::move(ring_[pdx]);
+    return queue_op_status::success;
+}
+
+template <typename Value>
+queue_op_status spill_queue<Value>::try_pop(Value& elem)
+{
+    /* This try block is here to catch exceptions from the mutex
+       operations, the file or the user-defined copy assignment
+       operator. */
+    try {
+        std::unique_lock<std::mutex> hold( mtx_ );
+        return try_pop_common(hold, elem, true);
+    } catch (...) {
+        close();
+        throw;
+    }
+}
+
+template <typename Value>
+queue_op_status spill_queue<Value>::nonblocking_pop(Value& elem)
+{
+    try {
+        std::unique_lock<std::mutex> hold( mtx_, std::try_to_lock );
+        if ( !hold.owns_lock() ) {
+            return queue_op_status::busy;
+        }
+        return try_pop_common(hold, elem, false);
+    } catch (...) {
+        close();
+        throw;
+    }
+}
+
+template <typename Value>
+queue_op_status spill_queue<Value>::wait_pop(Value& elem)
+{
+    try {
+        std::unique_lock<std::mutex> hold( mtx_ );
+        for (;;) {
+            queue_op_status status = try_pop_common(hold, elem, true);
+            if ( status != queue_op_status::empty )
+                return status;
+            not_empty_.wait( hold );
+        }
+    } catch (...) {
+        close();
+        throw;
+    }
+}
+
+template <typename Value>
+Value spill_queue<Value>::value_pop()
+{
+    try {
+        Value elem;
+        if ( wait_pop( elem ) == queue_op_status::closed )
+            throw queue_op_status::closed;
+        return std::move(elem);
+    } catch (...) {
+        close();
+        throw;
+    }
+}
+
+template <typename Value>
+template <typename V>
+queue_op_status spill_queue<Value>::push_common(
+    std::unique_lock<std::mutex>& hold, V&& elem)
+{
+    if ( closed_ )
+        return queue_op_status::closed;
+    // Once values are on disk, newer ones must follow them there.
+    if ( spilled_ == 0 && count_ < ring_.size() ) {
+        ring_[(head_ + count_) % ring_.size()] = std::forward<V>(elem);
+        ++count_;
+    } else {
+        spill( hold, elem );
+    }
+    not_empty_.notify_one();
+    return queue_op_status::success;
+}
+
+template <typename Value>
+queue_op_status spill_queue<Value>::wait_push(const Value& elem)
+{
+    try {
+        std::unique_lock<std::mutex> hold( mtx_ );
+        return push_common(hold, elem);
+    } catch (...) {
+        close();
+        throw;
+    }
+}
+
+template <typename Value>
+queue_op_status spill_queue<Value>::wait_push(Value&& elem)
+{
+    try {
+        std::unique_lock<std::mutex> hold( mtx_ );
+        return push_common(hold, std::move(elem));
+    } catch (...) {
+        close();
+        throw;
+    }
+}
+
+template <typename Value>
+queue_op_status spill_queue<Value>::try_push(const Value& elem)
+{
+    return wait_push(elem);
+}
+
+template <typename Value>
+queue_op_status spill_queue<Value>::try_push(Value&& elem)
+{
+    return wait_push(std::move(elem));
+}
+
+template <typename Value>
+queue_op_status spill_queue<Value>::nonblocking_push(const Value& elem)
+{
+    try {
+        std::unique_lock<std::mutex> hold( mtx_, std::try_to_lock );
+        if ( !hold.owns_lock() )
+            return queue_op_status::busy;
+        return push_common(hold, elem);
+    } catch (...) {
+        close();
+        throw;
+    }
+}
+
+template <typename Value>
+queue_op_status spill_queue<Value>::nonblocking_push(Value&& elem)
+{
+    try {
+        std::unique_lock<std::mutex> hold( mtx_, std::try_to_lock );
+        if ( !hold.owns_lock() )
+            return queue_op_status::busy;
+        return push_common(hold, std::move(elem));
+    } catch (...) {
+        close();
+        throw;
+    }
+}
+
+template <typename Value>
+void spill_queue<Value>::push(const Value& elem)
+{
+    if ( wait_push( elem ) == queue_op_status::closed ) {
+        throw queue_op_status::closed;
+    }
+}
+
+template <typename Value>
+void spill_queue<Value>::push(Value&& elem)
+{
+    if ( wait_push( std::move(elem) ) == queue_op_status::closed ) {
+        throw queue_op_status::closed;
+    }
+}
+
+template <typename Value>
+void spill_queue<Value>::spill(std::unique_lock<std::mutex>& hold,
+                               const Value& elem)
+{
+    size_t at = write_buf_.size();
+    write_buf_.append( sizeof(uint32_t), '\0' );
+    spill_traits<Value>::save( elem, &write_buf_ );
+    uint32_t size = write_buf_.size() - at - sizeof(uint32_t);
+    memcpy( &write_buf_[at], &size, sizeof(size) );
+    ++spilled_;
+    // While another push writes, write_buf_ grows until a later one.
+    if ( write_buf_.size() >= kSpillBlock && !flushing_ )
+        flush_writes( hold );
+}
+
+// Appends write_buf_ to the file, with mtx_ released for the write so
+// that pops, and other pushes, go on meanwhile.
+template <typename Value>
+void spill_queue<Value>::flush_writes(std::unique_lock<std::mutex>& hold)
+{
+    if ( old_fd_ < 0 && fd_ >= 0 && file_read_ >= kSpillRotate ) {
+        // Later records go to a new file, and this one is closed, and
+        // its space given back, once its last records are read.
+        old_fd_ = fd_;
+        old_end_ = file_write_;
+        fd_ = -1;
+        file_write_ = 0;
+    }
+    if ( fd_ < 0 ) {
+        const char* dir = getenv("TMPDIR");
+        std::string path = std::string(dir != NULL ? dir : "/tmp")
+            + "/spill_queue.XXXXXX";
+        fd_ = mkstemp( &path[0] );
+        if ( fd_ < 0 )
+            spill_queue_error("spill_queue: cannot create a file");
+        unlink( path.c_str() );
+    }
+    flush_buf_.swap( write_buf_ );
+    flushing_ = true;
+    int fd = fd_;
+    off_t at = file_write_;
+    hold.unlock();
+    const char* data = flush_buf_.data();
+    size_t size = flush_buf_.size();
+    int error = 0;
+    while ( size > 0 ) {
+        ssize_t written = pwrite( fd, data, size, at );
+        if ( written < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            error = errno;
+            break;
+        }
+        data += written;
+        size -= written;
+        at += written;
+    }
+    hold.lock();
+    flushing_ = false;
+    file_write_ = at;
+    flush_buf_.clear();
+    io_done_.notify_all();
+    if ( error != 0 ) {
+        errno = error;
+        spill_queue_error("spill_queue: cannot write");
+    }
+}
+
+// Reads the next block of the file being read into read_buf_, with mtx_
+// released for the read.
+template <typename Value>
+void spill_queue<Value>::read_file(std::unique_lock<std::mutex>& hold,
+                                   size_t n)
+{
+    int fd = old_fd_ >= 0 ? old_fd_ : fd_;
+    off_t end = old_fd_ >= 0 ? old_end_ : file_write_;
+    off_t at = file_read_;
+    fetch_buf_.resize( std::min<off_t>( end - at,
+                                        std::max( n, kSpillBlock ) ) );
+    reading_ = true;
+    hold.unlock();
+    ssize_t got;
+    do {
+        got = pread( fd, &fetch_buf_[0], fetch_buf_.size(), at );
+    } while ( got < 0 && errno == EINTR );
+    int error = errno;
+    hold.lock();
+    reading_ = false;
+    io_done_.notify_all();
+    if ( got <= 0 ) {
+        errno = error;
+        spill_queue_error("spill_queue: cannot read");
+    }
+    read_buf_.append( fetch_buf_, 0, got );
+    file_read_ += got;
+}
+
+// Makes sure read_buf_ holds n bytes from read_pos_, reading the files or
+// taking write_buf_ as needed. Returns empty if there are not n more, and
+// busy if another thread's read or write must end first.
+template <typename Value>
+queue_op_status spill_queue<Value>::buffered(
+    std::unique_lock<std::mutex>& hold, size_t n)
+{
+    while ( read_buf_.size() - read_pos_ < n ) {
+        if ( reading_ )
+            return queue_op_status::busy;
+        read_buf_.erase( 0, read_pos_ );
+        read_pos_ = 0;
+        if ( old_fd_ >= 0 && file_read_ == old_end_ ) {
+            ::close( old_fd_ );
+            old_fd_ = -1;
+            file_read_ = 0;
+        } else if ( old_fd_ >= 0 || file_read_ < file_write_ ) {
+            read_file( hold, n );
+        } else if ( flushing_ ) {
+            // The records that come next are being written.
+            return queue_op_status::busy;
+        } else if ( !write_buf_.empty() ) {
+            // Everything in the files has been read, so the records not
+            // yet written come next.
+            read_buf_.append( write_buf_ );
+            write_buf_.clear();
+        } else {
+            return queue_op_status::empty;
+        }
+    }
+    return queue_op_status::success;
+}
+
+// Moves spilled values into memory, as many as fit. With wait false,
+// returns false instead of waiting for another thread's read or write.
+template <typename Value>
+bool spill_queue<Value>::unspill(std::unique_lock<std::mutex>& hold,
+                                 bool wait)
+{
+    while ( count_ < ring_.size() && spilled_ > 0 ) {
+        uint32_t size;
+        queue_op_status status = buffered( hold, sizeof(size) );
+        if ( status == queue_op_status::success ) {
+            memcpy( &size, &read_buf_[read_pos_], sizeof(size) );
+            status = buffered( hold, sizeof(size) + size );
+        }
+        if ( status == queue_op_status::busy ) {
+            if ( !wait )
+                return false;
+            // Others may have taken values meanwhile, so start over.
+            io_done_.wait( hold );
+            continue;
+        }
+        if ( status != queue_op_status::success )
+            break;
+        const char* data = &read_buf_[read_pos_ + sizeof(size)];
+        spill_traits<Value>::load( data, size,
+                                   &ring_[(head_ + count_) % ring_.size()] );
+        read_pos_ += sizeof(size) + size;
+        ++count_;
+        --spilled_;
+    }
+    if ( spilled_ == 0 )
+        discard( hold );
+    return true;
+}
+
+// Forgets every spilled value, and gives back the files' space, once any
+// read or write under way is done.
+template <typename Value>
+void spill_queue<Value>::discard(std::unique_lock<std::mutex>& hold)
+{
+    while ( flushing_ || reading_ )
+        io_done_.wait( hold );
+    spilled_ = 0;
+    write_buf_.clear();
+    read_buf_.clear();
+    read_pos_ = 0;
+    file_read_ = 0;
+    if ( old_fd_ >= 0 ) {
+        ::close( old_fd_ );
+        old_fd_ = -1;
+    }
+    if ( file_write_ > 0 ) {
+        file_write_ = 0;
+        if ( ftruncate( fd_, 0 ) != 0 )
+            spill_queue_error("spill_queue: cannot truncate");
+    }
+}
+
+} // namespace gcl
+
+#endif
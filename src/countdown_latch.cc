@@ -46,4 +46,9 @@ void countdown_latch::count_down() {
   }
 }
 
+void countdown_latch::reset(unsigned int count) {
+  std::lock_guard<std::mutex> lock(condition_mutex_);
+  count_ = count;
+}
+
 }  // End namespace gcl
@@ -0,0 +1,367 @@
+// Copyright 2013 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "counter_registry.h"
+
+namespace gcl {
+
+namespace counter {
+
+registry& registry::global()
+{
+    static registry the_registry;
+    return the_registry;
+}
+
+void registry::insert_entry( const std::string& name, const entry& e )
+{
+    std::lock_guard< std::mutex > _( serializer_ );
+    if ( !entries_.insert( map_type::value_type( name, e ) ).second )
+        throw std::invalid_argument( "counter name already registered" );
+}
+
+bool registry::erase( const std::string& name )
+{
+    std::lock_guard< std::mutex > _( serializer_ );
+    return entries_.erase( name ) == 1;
+}
+
+size_t registry::size()
+{
+    std::lock_guard< std::mutex > _( serializer_ );
+    return entries_.size();
+}
+
+void registry::take( snapshot& out )
+{
+    out.timestamp_ms = std::chrono::duration_cast< std::chrono::milliseconds >(
+        std::chrono::system_clock::now().time_since_epoch() ).count();
+    std::lock_guard< std::mutex > _( serializer_ );
+    // Reuse the existing samples so that steady-state snapshots
+    // of an unchanging registry do not allocate.
+    out.samples.resize( entries_.size() );
+    size_t i = 0;
+    for ( map_type::iterator it = entries_.begin();
+          it != entries_.end(); ++it, ++i ) {
+        sample& s = out.samples[ i ];
+        entry& e = it->second;
+        if ( s.name != it->first )
+            s.name = it->first;
+        s.kind = e.kind;
+        if ( e.kind == sample_kind::scalar ) {
+            s.values.resize( 1 );
+            s.values[ 0 ] = e.scalar();
+        } else {
+            e.array( s.values );
+        }
+        s.bounds = e.bounds;
+    }
+}
+
+// Text format.
+
+static void append_number( std::string& out, sample_value value )
+{
+    char digits[ 24 ];
+    int length = snprintf( digits, sizeof( digits ), "%lld", value );
+    out.append( digits, length );
+}
+
+static void append_label( std::string& out, const sample& s, size_t i )
+{
+    out += '[';
+    if ( s.kind == sample_kind::histogram ) {
+        if ( i < s.bounds.size() ) {
+            out += "<=";
+            append_number( out, s.bounds[ i ] );
+        } else {
+            out += '>';
+            append_number( out, s.bounds.empty() ? 0 : s.bounds.back() );
+        }
+    } else {
+        append_number( out, i );
+    }
+    out += ']';
+}
+
+void write_text( const snapshot& in, std::string& out )
+{
+    out.clear();
+    out += "# gcl.counter ";
+    append_number( out, in.timestamp_ms );
+    out += '\n';
+    for ( size_t i = 0; i < in.samples.size(); ++i ) {
+        const sample& s = in.samples[ i ];
+        for ( size_t j = 0; j < s.values.size(); ++j ) {
+            out += s.name;
+            if ( s.kind != sample_kind::scalar )
+                append_label( out, s, j );
+            out += ' ';
+            append_number( out, s.values[ j ] );
+            out += '\n';
+        }
+    }
+}
+
+// Binary format.
+
+static const char binary_magic[] = "GCLC";
+static const char binary_version = 1;
+
+static void append_varint( std::string& out, unsigned long long value )
+{
+    while ( value >= 0x80 ) {
+        out += static_cast< char >( ( value & 0x7f ) | 0x80 );
+        value >>= 7;
+    }
+    out += static_cast< char >( value );
+}
+
+static void append_signed( std::string& out, sample_value value )
+{
+    unsigned long long zigzag = static_cast< unsigned long long >( value ) << 1;
+    if ( value < 0 )
+        zigzag = ~zigzag;
+    append_varint( out, zigzag );
+}
+
+void write_binary( const snapshot& in, std::string& out )
+{
+    out.assign( binary_magic, 4 );
+    out += binary_version;
+    append_signed( out, in.timestamp_ms );
+    append_varint( out, in.samples.size() );
+    for ( size_t i = 0; i < in.samples.size(); ++i ) {
+        const sample& s = in.samples[ i ];
+        append_varint( out, s.name.size() );
+        out += s.name;
+        out += static_cast< char >( s.kind );
+        append_varint( out, s.values.size() );
+        for ( size_t j = 0; j < s.values.size(); ++j )
+            append_signed( out, s.values[ j ] );
+        if ( s.kind == sample_kind::histogram ) {
+            for ( size_t j = 0; j < s.bounds.size(); ++j )
+                append_signed( out, s.bounds[ j ] );
+        }
+    }
+}
+
+void write_snapshot( const snapshot& in, export_format fmt, std::string& out )
+{
+    if ( fmt == export_format::binary )
+        write_binary( in, out );
+    else
+        write_text( in, out );
+}
+
+namespace {
+
+class binary_reader
+{
+public:
+    binary_reader( const std::string& in ) : in_( in ), pos_( 0 ) {}
+    bool varint( unsigned long long& value )
+    {
+        value = 0;
+        for ( int shift = 0; shift < 64; shift += 7 ) {
+            if ( pos_ >= in_.size() )
+                return false;
+            unsigned char byte = in_[ pos_++ ];
+            value |= static_cast< unsigned long long >( byte & 0x7f ) << shift;
+            if ( ( byte & 0x80 ) == 0 )
+                return true;
+        }
+        return false;
+    }
+    bool signed_value( sample_value& value )
+    {
+        unsigned long long zigzag;
+        if ( !varint( zigzag ) )
+            return false;
+        value = static_cast< sample_value >( zigzag >> 1 );
+        if ( zigzag & 1 )
+            value = ~value;
+        return true;
+    }
+    bool bytes( size_t n, std::string& out )
+    {
+        if ( in_.size() - pos_ < n )
+            return false;
+        out.assign( in_, pos_, n );
+        pos_ += n;
+        return true;
+    }
+    bool byte( char& out )
+    {
+        if ( pos_ >= in_.size() )
+            return false;
+        out = in_[ pos_++ ];
+        return true;
+    }
+    bool at_end() { return pos_ == in_.size(); }
+    // Whether n items of at least min_size bytes each could remain.
+    bool could_hold( unsigned long long n, size_t min_size )
+    {
+        return n <= ( in_.size() - pos_ ) / min_size;
+    }
+private:
+    const std::string& in_;
+    size_t pos_;
+};
+
+} // namespace
+
+bool read_binary( const std::string& in, snapshot& out )
+{
+    binary_reader reader( in );
+    std::string magic;
+    char version;
+    unsigned long long count;
+    if ( !reader.bytes( 4, magic ) || magic != binary_magic
+         || !reader.byte( version ) || version != binary_version
+         || !reader.signed_value( out.timestamp_ms )
+         || !reader.varint( count )
+         // A sample takes at least its name length, kind and value count.
+         || !reader.could_hold( count, 3 ) )
+        return false;
+    out.samples.resize( count );
+    for ( size_t i = 0; i < count; ++i ) {
+        sample& s = out.samples[ i ];
+        unsigned long long length;
+        char kind;
+        if ( !reader.varint( length ) || !reader.bytes( length, s.name )
+             || !reader.byte( kind ) || !reader.varint( length )
+             || !reader.could_hold( length, 1 ) )
+            return false;
+        if ( kind != static_cast< char >( sample_kind::scalar )
+             && kind != static_cast< char >( sample_kind::array )
+             && kind != static_cast< char >( sample_kind::histogram ) )
+            return false;
+        s.kind = static_cast< sample_kind >( kind );
+        s.values.resize( length );
+        for ( size_t j = 0; j < length; ++j )
+            if ( !reader.signed_value( s.values[ j ] ) )
+                return false;
+        s.bounds.clear();
+        if ( s.kind == sample_kind::histogram ) {
+            s.bounds.resize( length == 0 ? 0 : length - 1 );
+            for ( size_t j = 0; j < s.bounds.size(); ++j )
+                if ( !reader.signed_value( s.bounds[ j ] ) )
+                    return false;
+        }
+    }
+    return reader.at_end();
+}
+
+// Sinks.
+
+export_sink file_sink( const std::string& path )
+{
+    return [path]( const std::string& bytes ) {
+        FILE* file = fopen( path.c_str(), "ab" );
+        if ( file == NULL )
+            return;
+        fwrite( bytes.data(), 1, bytes.size(), file );
+        fclose( file );
+    };
+}
+
+export_sink memory_sink::sink()
+{
+    return std::bind( &memory_sink::receive, this, std::placeholders::_1 );
+}
+
+void memory_sink::receive( const std::string& bytes )
+{
+    std::lock_guard< std::mutex > _( serializer_ );
+    contents_ = bytes;
+    ++exports_;
+}
+
+std::string memory_sink::contents()
+{
+    std::lock_guard< std::mutex > _( serializer_ );
+    return contents_;
+}
+
+size_t memory_sink::exports()
+{
+    std::lock_guard< std::mutex > _( serializer_ );
+    return exports_;
+}
+
+// Exporter.
+
+exporter::exporter( registry& reg, std::chrono::milliseconds interval,
+                    export_format fmt, export_sink sink )
+:
+    registry_( reg ),
+    interval_( interval ),
+    format_( fmt ),
+    sink_( sink ),
+    stopping_( false ),
+    thread_( &exporter::run, this )
+{
+}
+
+exporter::~exporter()
+{
+    stop();
+}
+
+void exporter::export_now()
+{
+    std::lock_guard< std::mutex > _( export_mu_ );
+    registry_.take( snapshot_ );
+    write_snapshot( snapshot_, format_, bytes_ );
+    sink_( bytes_ );
+}
+
+void exporter::stop()
+{
+    {
+        std::lock_guard< std::mutex > _( state_mu_ );
+        if ( stopping_ )
+            return;
+        stopping_ = true;
+    }
+    wakeup_.notify_all();
+    thread_.join();
+    export_now();
+}
+
+void exporter::run()
+{
+    std::unique_lock< std::mutex > lock( state_mu_ );
+    while ( !stopping_ ) {
+        if ( wakeup_.wait_for( lock, interval_ ) == std::cv_status::timeout
+             && !stopping_ ) {
+            lock.unlock();
+            export_now();
+            lock.lock();
+        }
+    }
+}
+
+} // namespace counter
+
+} // namespace gcl
@@ -12,25 +12,36 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <fstream>
 #include <functional>
+#include <sstream>
+#include <vector>
 
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
 
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include "mutable_thread.h"
 
 namespace gcl {
 
 mutable_thread::mutable_thread() {
   thread_state_ = IDLE; // atomic_init(&thread_state_, IDLE);
+  pinned_ = false;
   t_ = new std::thread(std::bind(&mutable_thread::run, this));
 }
 
 template<class F>
 mutable_thread::mutable_thread(F f) {
   thread_state_ = IDLE; // atomic_init(&thread_state_, IDLE);
+  pinned_ = false;
   execute(f);
   t_ = new std::thread(std::bind(&mutable_thread::run, this));
 }
@@ -46,6 +57,43 @@ std::thread::id mutable_thread::get_id() {
   return t_->get_id();
 }
 
+bool mutable_thread::set_affinity(const std::vector<int>& cpus) {
+#if defined(__linux__)
+  cpu_set_t set;
+  if (!pinned_) {
+    // Remember where the thread may run, which may be fewer CPUs than the
+    // machine has (e.g. under taskset), to go back there when unpinned.
+    if (pthread_getaffinity_np(t_->native_handle(), sizeof(set), &set) != 0) {
+      return false;
+    }
+    unpinned_cpus_.clear();
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) {
+        unpinned_cpus_.push_back(cpu);
+      }
+    }
+  }
+  const std::vector<int>& allowed = cpus.empty() ? unpinned_cpus_ : cpus;
+  CPU_ZERO(&set);
+  for (size_t i = 0; i < allowed.size(); ++i) {
+    if (allowed[i] >= 0 && allowed[i] < CPU_SETSIZE) {
+      CPU_SET(allowed[i], &set);
+    }
+  }
+  if (pthread_setaffinity_np(t_->native_handle(), sizeof(set), &set) != 0) {
+    return false;
+  }
+  pinned_ = !cpus.empty();
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool mutable_thread::is_pinned() {
+  return pinned_;
+}
+
 void mutable_thread::join() {
   {
     if (thread_state_.load() != DONE) {
@@ -88,15 +136,17 @@ bool mutable_thread::try_execute(std::function<void()> fn) {
 }
 
 bool mutable_thread::execute(std::function<void()> fn) {
-  while ((run_fn_ && queued_fn_) && !is_done() && !is_joining()) {
+  std::unique_lock<std::mutex> ul(thread_state_mu_);
+  while (run_fn_ && queued_fn_ && !is_done() && !is_joining()) {
     // Currently spin -- maybe swap this with a condvar instead.
+    ul.unlock();
     std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    ul.lock();
   }
 
   if (is_done() || is_joining()) {
     return false;
   } else {
-    std::unique_lock<std::mutex> ul(thread_state_mu_);
     if  (!run_fn_) {
       run_fn_.swap(fn);
     } else {
@@ -149,6 +199,9 @@ bool mutable_thread::thread_wait() {
 
 // Function to complete 
 void mutable_thread::finish_run() {
+  // Threads donated back to a pool may be handed new work while they are
+  // still finishing the last function, so swap under the lock.
+  std::unique_lock<std::mutex> ul(thread_state_mu_);
   if (queued_fn_) {
     // If there is a queued function swap that into the run_fn.
     std::function<void()> empty;
@@ -158,7 +211,6 @@ void mutable_thread::finish_run() {
     // Set the run function to an empty function.
     std::function<void()> empty;
 
-    // Is swap thread safe? probably not.
     run_fn_.swap(empty);
   }
 
@@ -167,4 +219,62 @@ void mutable_thread::finish_run() {
   thread_state_.compare_exchange_strong(new_state, IDLE);
 }
  
+#if defined(__linux__)
+namespace {
+
+// Reads one number from a file under /sys, or returns -1.
+int read_topology(int cpu, const char* name) {
+  std::ostringstream path;
+  path << "/sys/devices/system/cpu/cpu" << cpu << "/topology/" << name;
+  std::ifstream in(path.str().c_str());
+  int value = -1;
+  in >> value;
+  return in ? value : -1;
+}
+
+struct cpu_place {
+  int package;
+  int core;
+  int cpu;
+  bool operator<(const cpu_place& other) const {
+    if (package != other.package) {
+      return package < other.package;
+    }
+    if (core != other.core) {
+      return core < other.core;
+    }
+    return cpu < other.cpu;
+  }
+};
+
+}  // namespace
+#endif
+
+std::vector<int> cpus_by_locality() {
+  std::vector<int> cpus;
+#if defined(__linux__)
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    std::vector<cpu_place> places;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpu_place place = { read_topology(cpu, "physical_package_id"),
+                            read_topology(cpu, "core_id"), cpu };
+        places.push_back(place);
+      }
+    }
+    std::sort(places.begin(), places.end());
+    for (size_t i = 0; i < places.size(); ++i) {
+      cpus.push_back(places[i].cpu);
+    }
+    return cpus;
+  }
+#endif
+  unsigned int n = std::thread::hardware_concurrency();
+  for (unsigned int cpu = 0; cpu < n; ++cpu) {
+    cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
 }  // namespace gcl
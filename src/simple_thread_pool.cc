@@ -90,6 +90,11 @@ mutable_thread* simple_thread_pool::try_get_unused_thread() {
 }
 
 bool simple_thread_pool::donate_thread(mutable_thread* t) {
+  // Whoever takes the thread next expects it to run wherever the process
+  // may.
+  if (t->is_pinned()) {
+    t->set_affinity(std::vector<int>());
+  }
   std::unique_lock<std::mutex> ul(new_thread_mu_);
   // Check that the pool doesn't already own the thread
   std::set<mutable_thread*>::iterator active_iter = active_threads_.find(t);
@@ -13,10 +13,17 @@
 // limitations under the License.
 
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <thread>
 #include <vector>
 
 #include "counter.h"
+#include "counter_registry.h"
 
 
 // Set up test data.
@@ -116,6 +123,40 @@ void test_weak_duplex( int number )
     delete bkr;
 }
 
+void test_epoch_buffer( int number )
+{
+    simplex< int > ctr;
+    epoch tick;
+    {
+        epoch_buffer< int > buf( ctr, tick );
+        count_suspicious( buf );
+        assert( ctr.load() == 0 );
+        tick.advance();
+        ++buf;
+        assert( ctr.load() == number + 1 );
+        count_suspicious( buf );
+        assert( ctr.load() == number + 1 );
+    }
+    assert( ctr.load() == 2*number + 1 );
+
+    epoch_buffer< int > bounded( ctr, tick, number );
+    count_suspicious( bounded );
+    assert( ctr.load() == 3*number + 1 );
+}
+
+void test_epoch_ticker()
+{
+    simplex< int > ctr;
+    epoch tick;
+    epoch_ticker ticker( tick, std::chrono::milliseconds( 1 ) );
+    epoch_buffer< int > buf( ctr, tick );
+    for ( int i = 0; i < 10000 && ctr.load() == 0; ++i ) {
+        ++buf;
+        std::this_thread::sleep_for( std::chrono::microseconds( 100 ) );
+    }
+    assert( ctr.load() > 0 );
+}
+
 void test_single_counters()
 {
     test_simplex< simplex< int >,
@@ -141,6 +182,8 @@ void test_single_counters()
 
     test_strong_duplex( number );
     test_weak_duplex( number );
+    test_epoch_buffer( number );
+    test_epoch_ticker();
 }
 
 int modulus = 3;
@@ -221,10 +264,339 @@ void test_arrays_counters()
                   buffer_array< int, non_atomic, full_atomic > >( number );
 }
 
-int main()
+template< typename Counter >
+void verify_bulk_values( Counter& ctr, int number )
+{
+    std::vector< int > all( ctr.size() );
+    ctr.load_all( all.data() );
+    for ( int i = 0; i < modulus; ++i )
+        assert( all[ i ] == number / modulus );
+}
+
+void test_strong_duplex_array( int number )
+{
+    strong_duplex_array< int > ctr( modulus );
+    {
+        strong_broker_array< int > bkr( ctr );
+        test_counter_array( ctr, number );
+        hist_suspicious( bkr );
+        verify_array_values( ctr, 2*number );
+        verify_bulk_values( ctr, 2*number );
+        std::vector< int > harvest( modulus );
+        ctr.exchange_all( harvest.data(), 0 );
+        for ( int i = 0; i < modulus; ++i )
+            assert( harvest[ i ] == 2*number / modulus );
+        verify_bulk_values( ctr, 0 );
+        hist_suspicious( bkr );
+        for ( int i = 0; i < modulus; ++i )
+            assert( ctr.exchange( i, 0 ) == number / modulus );
+    }
+    verify_array_values( ctr, 0 );
+}
+
+void test_weak_duplex_array( int number )
+{
+    weak_duplex_array< int > ctr( modulus );
+    {
+        weak_broker_array< int > bkr( ctr );
+        test_counter_array( ctr, number );
+        hist_suspicious( bkr );
+        verify_bulk_values( ctr, 2*number );
+    }
+    verify_array_values( ctr, 2*number );
+}
+
+// Exercises the vector path with sizes that leave a scalar remainder.
+template< typename Integral >
+void test_bulk_sums()
+{
+    const int size = 1027;
+    strong_duplex_array< Integral > ctr( size );
+    strong_broker_array< Integral > bkr1( ctr );
+    strong_broker_array< Integral > bkr2( ctr );
+    for ( int i = 0; i < size; ++i ) {
+        ctr[ i ] += 1;
+        bkr1[ i ] += i % 7;
+        bkr2[ i ] += -( i % 5 );
+    }
+    std::vector< Integral > all( size );
+    ctr.load_all( all.data() );
+    for ( int i = 0; i < size; ++i ) {
+        assert( all[ i ] == Integral( 1 + i % 7 - i % 5 ) );
+        assert( all[ i ] == ctr.load( i ) );
+    }
+}
+
+void test_duplex_arrays()
+{
+    test_strong_duplex_array( number );
+    test_weak_duplex_array( number );
+    test_bulk_sums< signed char >();
+    test_bulk_sums< short >();
+    test_bulk_sums< int >();
+    test_bulk_sums< long long >();
+}
+
+template< atomicity Atomicity >
+void test_gauge()
+{
+    gauge< int, Atomicity > depth;
+    ++depth;
+    depth += 4;
+    assert( depth.load() == 5 );
+    depth.store( 2 );
+    --depth;
+    assert( depth.exchange( 7 ) == 1 );
+    assert( depth.load() == 7 );
+    // A gauge cannot be the prime of a buffer.
+    static_assert( !std::is_convertible< gauge< int, Atomicity >&,
+                                         bumper< int, Atomicity >& >::value,
+                   "gauge is a bumper" );
+}
+
+template< typename Counter >
+void test_extremum( int low, int high, int extreme, int reset )
+{
+    Counter ctr;
+    ctr.offer( low );
+    ctr.offer( high );
+    ctr.offer( ( low + high ) / 2 );
+    assert( ctr.load() == extreme );
+    assert( ctr.exchange( reset ) == extreme );
+    assert( ctr.load() == reset );
+}
+
+void test_extremum_duplex()
+{
+    max_duplex< int > peak;
+    std::vector< std::thread > threads;
+    for ( int t = 0; t < 4; ++t )
+        threads.push_back( std::thread( [&peak, t]() {
+            max_broker< int > local( peak );
+            for ( int i = 0; i < 1000; ++i )
+                local.offer( t * 1000 + i );
+        } ) );
+    for ( size_t t = 0; t < threads.size(); ++t )
+        threads[ t ].join();
+    assert( peak.load() == 3999 );
+
+    min_duplex< int > low( 10 );
+    {
+        min_broker< int > bkr( low );
+        bkr.offer( 12 );
+        assert( low.load() == 10 );
+        bkr.offer( -3 );
+        assert( low.load() == -3 );
+        assert( low.exchange( 100 ) == -3 );
+        bkr.offer( 50 );
+    }
+    assert( low.load() == 50 );
+}
+
+void test_rate()
+{
+    rate< int > events( std::chrono::milliseconds( 200 ), 8 );
+    assert( std::isnan( events.per_second() ) );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 30 ) );
+    events += 300;
+    double per_second = events.per_second();
+    assert( per_second > 0 && per_second <= 300 / 0.030 );
+    buffer< int > local( events );
+    ++local;
+    local.push();
+    assert( events.load() == 301 );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 250 ) );
+    events.sample();
+    assert( !( events.per_second() > 0 ) );
+}
+
+void test_other_counters()
+{
+    test_gauge< non_atomic >();
+    test_gauge< semi_atomic >();
+    test_gauge< full_atomic >();
+    test_extremum< max_simplex< int, non_atomic > >( 3, 9, 9, 0 );
+    test_extremum< max_simplex< int, semi_atomic > >( 3, 9, 9, 0 );
+    test_extremum< max_simplex< int > >( 3, 9, 9, 0 );
+    test_extremum< min_simplex< int, non_atomic > >( 3, 9, 3, 100 );
+    test_extremum< min_simplex< int, semi_atomic > >( 3, 9, 3, 100 );
+    test_extremum< min_simplex< int > >( 3, 9, 3, 100 );
+    test_extremum_duplex();
+    test_rate();
+}
+
+template< typename Counter >
+void test_approximate( int increments )
+{
+    Counter ctr;
+    for ( int i = 0; i < increments; ++i )
+        ++ctr;
+    double error = ( double( ctr.load() ) - increments ) / increments;
+    assert( error < 5 * Counter::relative_error() );
+    assert( error > -5 * Counter::relative_error() );
+    unsigned long long before = ctr.load();
+    assert( ctr.exchange( 0 ) == before );
+    assert( ctr.load() == 0 );
+}
+
+void test_approximate_counters()
+{
+    test_approximate< approximate< unsigned char, 4, non_atomic > >( 100000 );
+    test_approximate< approximate< unsigned short, 8, semi_atomic > >( 100000 );
+    test_approximate< approximate< unsigned short, 8 > >( 1000000 );
+
+    // Saturated counters stop rather than wrap,
+    // and estimates beyond 2^64 saturate too.
+    approximate< unsigned char, 0, non_atomic > tiny;
+    const unsigned char top = std::numeric_limits< unsigned char >::max();
+    tiny.exchange( top );
+    for ( int i = 0; i < 100000; ++i )
+        ++tiny;
+    assert( tiny.exponent() == top );
+    assert( tiny.load() == std::numeric_limits< unsigned long long >::max() );
+    assert( tiny.exchange( 0 )
+            == std::numeric_limits< unsigned long long >::max() );
+    assert( ( approximate< unsigned char, 4 >::capacity() > 8e7 ) );
+
+    // Exponents past sixteen bits keep their tiny probability.
+    approximate< unsigned int, 12, non_atomic > wide;
+    wide.exchange( 70000 );
+    for ( int i = 0; i < 1000; ++i )
+        ++wide;
+    assert( wide.exponent() == 70000 );
+}
+
+// Benchmark of concurrent increments from several threads.
+
+template< typename Body >
+double nanoseconds_per_increment( int threads, int increments, Body body )
+{
+    std::vector< std::thread > workers;
+    std::chrono::steady_clock::time_point start
+        = std::chrono::steady_clock::now();
+    for ( int t = 0; t < threads; ++t )
+        workers.push_back( std::thread( body, increments ) );
+    for ( int t = 0; t < threads; ++t )
+        workers[ t ].join();
+    std::chrono::duration< double, std::nano > elapsed
+        = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / ( double( threads ) * increments );
+}
+
+void benchmark_counters( int increments )
+{
+    const int threads = 4;
+    static simplex< long long > exact;
+    static approximate< unsigned short, 8 > approx;
+    static epoch ticks;
+    double simplex_ns = nanoseconds_per_increment( threads, increments,
+        []( int n ) { for ( int i = 0; i < n; ++i ) ++exact; } );
+    double buffer_ns = nanoseconds_per_increment( threads, increments,
+        []( int n ) { buffer< long long > local( exact );
+                      for ( int i = 0; i < n; ++i ) {
+                          ++local;
+                          if ( ( i & 0xfff ) == 0 ) local.push();
+                      } } );
+    double epoch_ns = nanoseconds_per_increment( threads, increments,
+        []( int n ) { epoch_buffer< long long > local( exact, ticks, 4096 );
+                      for ( int i = 0; i < n; ++i ) ++local; } );
+    double approximate_ns = nanoseconds_per_increment( threads, increments,
+        []( int n ) { for ( int i = 0; i < n; ++i ) ++approx; } );
+    assert( exact.load() == 3LL * threads * increments );
+    std::cout << "ns per increment with " << threads << " threads:"
+              << " simplex " << simplex_ns
+              << " buffer " << buffer_ns
+              << " epoch buffer " << epoch_ns
+              << " approximate " << approximate_ns
+              << " (estimate " << approx.load() << " of "
+              << threads * increments << ")" << std::endl;
+}
+
+void test_registry()
+{
+    registry reg;
+    simplex< int > red_count( 7 );
+    simplex_array< int > shards( 2 );
+    simplex_array< int > latency( 3 );
+    ++shards[ 1 ];
+    latency[ 0 ] += 4;
+    latency[ 2 ] += -1;
+    {
+        registration r1( "red_count", red_count, reg );
+        registration r2( "shards", shards, reg );
+        registration r3( "latency", latency, { 1, 10 }, reg );
+        assert( reg.size() == 3 );
+
+        snapshot snap;
+        reg.take( snap );
+        assert( snap.samples.size() == 3 );
+        assert( snap.samples[ 0 ].name == "latency" );
+        assert( snap.samples[ 0 ].kind == sample_kind::histogram );
+        assert( snap.samples[ 1 ].values[ 0 ] == 7 );
+
+        std::string text;
+        write_text( snap, text );
+        assert( text.find( "red_count 7\n" ) != std::string::npos );
+        assert( text.find( "shards[1] 1\n" ) != std::string::npos );
+        assert( text.find( "latency[<=1] 4\n" ) != std::string::npos );
+        assert( text.find( "latency[>10] -1\n" ) != std::string::npos );
+
+        std::string binary;
+        write_binary( snap, binary );
+        snapshot decoded;
+        assert( read_binary( binary, decoded ) );
+        assert( decoded.timestamp_ms == snap.timestamp_ms );
+        assert( decoded.samples.size() == 3 );
+        assert( decoded.samples[ 0 ].bounds == snap.samples[ 0 ].bounds );
+        assert( decoded.samples[ 0 ].values == snap.samples[ 0 ].values );
+        assert( !read_binary( binary.substr( 1 ), decoded ) );
+        // Counts beyond the input, and unknown kinds, are malformed.
+        snapshot empty;
+        empty.timestamp_ms = snap.timestamp_ms;
+        std::string header;
+        write_binary( empty, header );
+        header.erase( header.size() - 1 );
+        const char huge_count[] = "\xff\xff\xff\xff\xff\xff\xff\x7f";
+        const char huge_values[] = "\x01\x01x\x00\xff\xff\xff\x7f";
+        const char bad_kind[] = "\x01\x01x\x09\x00";
+        const char good[] = "\x01\x01x\x00\x00";
+        assert( !read_binary( header + std::string( huge_count,
+                                                    sizeof huge_count - 1 ),
+                              decoded ) );
+        assert( !read_binary( header + std::string( huge_values,
+                                                    sizeof huge_values - 1 ),
+                              decoded ) );
+        assert( !read_binary( header + std::string( bad_kind,
+                                                    sizeof bad_kind - 1 ),
+                              decoded ) );
+        assert( read_binary( header + std::string( good, sizeof good - 1 ),
+                             decoded ) );
+
+        memory_sink latest;
+        {
+            exporter ex( reg, std::chrono::milliseconds( 1 ),
+                         export_format::binary, latest.sink() );
+            ++red_count;
+        }
+        assert( latest.exports() >= 1 );
+        assert( read_binary( latest.contents(), decoded ) );
+        assert( decoded.samples[ 1 ].values[ 0 ] == 8 );
+    }
+    assert( reg.size() == 0 );
+}
+
+// With --benchmark, times the counters after the tests; a further
+// argument is the number of increments per benchmark thread.
+int main( int argc, char** argv )
 {
     initialize_crowd();
     test_single_counters();
     test_arrays_counters();
+    test_duplex_arrays();
+    test_other_counters();
+    test_approximate_counters();
+    test_registry();
+    if ( argc > 1 && strcmp( argv[ 1 ], "--benchmark" ) == 0 )
+        benchmark_counters( argc > 2 ? atoi( argv[ 2 ] ) : 100000 );
     return 0;
 }
@@ -21,6 +21,11 @@
 #include <atomic>
 #include <condition_variable>
 #include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
 
 #include "called_task.h"
 #include "mutable_thread.h"
@@ -67,5 +72,41 @@ TEST(MutableThreadTest, TestJoin) {
   EXPECT_TRUE(t.is_done());
 }
 
+#if defined(__linux__)
+TEST(MutableThreadTest, TestAffinity) {
+  std::vector<int> cpus = cpus_by_locality();
+  ASSERT_FALSE(cpus.empty());
+  std::vector<int> last(1, cpus.back());
+
+  // The thread starts with this thread's CPUs.
+  cpu_set_t before;
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(before), &before));
+  mutable_thread t;
+  EXPECT_TRUE(t.set_affinity(last));
+  EXPECT_TRUE(t.is_pinned());
+  std::atomic<int> cpu(-1);
+  Called called(1);
+  t.execute([&cpu, &called]() {
+    cpu = sched_getcpu();
+    called.run();
+  });
+  called.wait();
+  EXPECT_EQ(last[0], cpu.load());
+
+  // Unpinned, the thread may use the CPUs it had before, and no others.
+  EXPECT_TRUE(t.set_affinity(std::vector<int>()));
+  EXPECT_FALSE(t.is_pinned());
+  cpu_set_t after;
+  CPU_ZERO(&after);
+  Called unpinned(1);
+  t.execute([&after, &unpinned]() {
+    sched_getaffinity(0, sizeof(after), &after);
+    unpinned.run();
+  });
+  unpinned.wait();
+  EXPECT_TRUE(CPU_EQUAL(&before, &after));
+}
+#endif
+
 }
 }  // namespace gcl
@@ -12,16 +12,27 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <map>
+#include <mutex>
+#include <set>
 #include <string>
 #include <sstream>
+#include <fstream>
 #include <iostream>
 #include <stdio.h>
 #include <vector>
 
 #include "pipeline.h"
+#include "pipeline_file.h"
+#include "pipeline_recycle.h"
+#include "pipeline_static.h"
+#if defined(__cpp_impl_coroutine)
+#include "pipeline_coroutine.h"
+#endif
 #include "buffer_queue.h"
 #include "countdown_latch.h"
 #include "source.h"
+#include "spill_queue.h"
 
 #include "gtest/gtest.h"
 
@@ -113,6 +124,13 @@ void produce_strings(queue_back<string> queue) {
 class PipelineTest : public testing::Test {
 };
 
+// The modes in which stages pass items through queues; tests of what
+// both must do run their plans in each.
+const pipeline::execution_mode kQueuedModes[] = {
+  pipeline::execution_mode::threads,
+  pipeline::execution_mode::tasks,
+};
+
 TEST_F(PipelineTest, ManualBuild) {
   simple_thread_pool pool;
   queue_object< buffer_queue<int> > queue(10);
@@ -187,6 +205,57 @@ TEST_F(PipelineTest, SimpleParallel) {
   EXPECT_TRUE(out_queue.is_closed());
 }
 
+int slow_zero(int i) {
+  if (i == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  return i;
+}
+
+TEST_F(PipelineTest, ParallelByAvailability) {
+  // While one replica works on the slow item, the other takes and passes on
+  // the rest, though they overflow its queue.
+  simple_thread_pool pool;
+  std::mutex mu;
+  std::map<std::thread::id, int> made;  // By each replica's thread.
+  std::thread::id slow_replica;
+  std::function<int (int)> f = [&](int i) {
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      ++made[std::this_thread::get_id()];
+      if (i == 0) {
+        slow_replica = std::this_thread::get_id();
+      }
+    }
+    return slow_zero(i);
+  };
+  queue_object< buffer_queue<int> > in_queue(100);
+  queue_object< buffer_queue<int> > out_queue(100);
+  for (int i = 0; i < 50; ++i) {
+    in_queue.push(i);
+  }
+  in_queue.close();
+
+  pipeline::plan p = pipeline::from(in_queue)
+      | pipeline::parallel(pipeline::make(f), 2)
+      | out_queue;
+  pipeline::run_options options;
+  options.queue_capacity = 2;
+  pipeline::execution pex = p.run(&pool, options);
+  pex.wait();
+  std::vector<int> out;
+  int i;
+  while (out_queue.try_pop(i) == queue_op_status::success) {
+    out.push_back(i);
+  }
+  ASSERT_EQ(50u, out.size());
+  EXPECT_EQ(0, out.back());
+  // A replica takes an item only once it is free, so the one held up took
+  // nothing else. Dealing the items out in turn would have given it half.
+  EXPECT_EQ(2u, made.size());
+  EXPECT_EQ(1, made[slow_replica]);
+}
+
 TEST_F(PipelineTest, ParallelExample) {
   // Two-stage pipeline. Combines string->int and int->User to make
   // string->User
@@ -225,3 +294,940 @@ TEST_F(PipelineTest, ProduceExample) {
   printf("Waiting for Completion\n");
   pex3.wait();
 }
+
+int add_one(int i) { return i + 1; }
+
+pipeline::plan make_long_plan(queue_object< buffer_queue<int> >& queue,
+                              std::atomic<int>* total, int stages) {
+  pipeline::segment<pipeline::terminated, int> s = pipeline::from(queue);
+  for (int i = 0; i < stages; ++i) {
+    s = s | add_one;
+  }
+  std::function<void (int)> sum = [total](int i) { *total += i; };
+  return s | sum;
+}
+
+TEST_F(PipelineTest, TaskMode) {
+  // Thirty stages on two workers from a pool that could not give every
+  // stage its own thread.
+  simple_thread_pool pool(0, 3);
+  queue_object< buffer_queue<int> > queue(10);
+  std::atomic<int> total(0);
+  pipeline::plan p = make_long_plan(queue, &total, 30);
+
+  pipeline::run_options options;
+  options.mode = pipeline::execution_mode::tasks;
+  options.workers = 2;
+  pipeline::execution pex = p.run(&pool, options);
+  for (int i = 0; i < 100; ++i) {
+    queue.push(i);
+  }
+  queue.close();
+  pex.wait();
+  EXPECT_TRUE(pex.is_done());
+  EXPECT_EQ(100 * 99 / 2 + 100 * 30, total.load());
+}
+
+TEST_F(PipelineTest, ExhaustedPool) {
+  simple_thread_pool pool(0, 3);
+  queue_object< buffer_queue<int> > queue(10);
+  std::atomic<int> total(0);
+  pipeline::plan p = make_long_plan(queue, &total, 30);
+  EXPECT_THROW(p.run(&pool), std::runtime_error);
+
+  // The failed run gave back its threads, and so does a finished one.
+  pipeline::run_options options;
+  options.mode = pipeline::execution_mode::tasks;
+  options.workers = 2;
+  for (int run = 0; run < 2; ++run) {
+    queue_object< buffer_queue<int> > in(10);
+    pipeline::plan q = make_long_plan(in, &total, 5);
+    pipeline::execution pex = q.run(&pool, options);
+    in.push(1);
+    in.close();
+    pex.wait();
+  }
+  EXPECT_EQ(2 * 6, total.load());
+}
+
+int slow_square(int i) {
+  // Later items often finish first.
+  std::this_thread::sleep_for(std::chrono::microseconds(100 * (3 - i % 4)));
+  return i * i;
+}
+
+TEST_F(PipelineTest, OrderedParallel) {
+  simple_thread_pool pool;
+  queue_object< buffer_queue<int> > queue(10);
+  std::vector<int> results;
+  std::function<void (int)> collect = [&results](int i) {
+    results.push_back(i);
+  };
+  pipeline::plan p = pipeline::from(queue)
+      | pipeline::ordered_parallel(pipeline::make(slow_square) | add_one, 4, 8)
+      | collect;
+  pipeline::execution pex = p.run(&pool);
+  for (int i = 0; i < 100; ++i) {
+    queue.push(i);
+  }
+  queue.close();
+  pex.wait();
+  ASSERT_EQ(100u, results.size());
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(i * i + 1, results[i]);
+  }
+
+  // A replica blocked pushing to a slow consumer holds up no other, and
+  // cancelling the plan gets it out.
+  std::atomic<int> consumed(0);
+  std::function<void (int)> slow = [&consumed](int) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    ++consumed;
+  };
+  pipeline::run_options options;
+  options.queue_capacity = 1;
+  queue_object< buffer_queue<int> > slow_queue(100);
+  pipeline::execution slow_pex = (pipeline::from(slow_queue)
+      | pipeline::ordered_parallel(pipeline::make(add_one), 4, 8)
+      | slow).run(&pool, options);
+  for (int i = 0; i < 100; ++i) {
+    slow_queue.push(i);
+  }
+  slow_pex.cancel();
+  EXPECT_TRUE(slow_pex.is_done());
+  EXPECT_LT(consumed.load(), 100);
+
+  EXPECT_THROW(pipeline::ordered_parallel(pipeline::make(repeat), 2),
+               std::invalid_argument);
+}
+
+TEST_F(PipelineTest, Batched) {
+  simple_thread_pool pool;
+  queue_object< buffer_queue<int> > queue(100);
+  std::atomic<int> total(0);
+  std::function<void (int)> sum = [&total](int i) { total += i; };
+  pipeline::plan p = pipeline::from(queue)
+      | (pipeline::make(add_one) | add_one | sum).batched(
+          16, std::chrono::microseconds(500));
+  pipeline::execution pex = p.run(&pool);
+  for (int i = 0; i < 1000; ++i) {
+    queue.push(i);
+  }
+  queue.close();
+  pex.wait();
+  EXPECT_EQ(1000 * 999 / 2 + 2 * 1000, total.load());
+}
+
+TEST_F(PipelineTest, BulkQueueOps) {
+  queue_object< buffer_queue<int> > queue(8);
+  int in[5] = { 1, 2, 3, 4, 5 };
+  EXPECT_EQ(queue_op_status::success, queue.wait_push_n(in, 5));
+  int out[8];
+  // Takes what is there without waiting for the rest.
+  EXPECT_EQ(5u, queue.wait_pop_n(out, 8, std::chrono::microseconds(0)));
+  EXPECT_EQ(5, out[4]);
+  queue.push(6);
+  // Gives up waiting for more after the linger.
+  EXPECT_EQ(1u, queue.wait_pop_n(out, 8, std::chrono::microseconds(1000)));
+  queue.close();
+  EXPECT_EQ(0u, queue.wait_pop_n(out, 8, std::chrono::microseconds(0)));
+
+  // An open queue drained by another consumer during the linger is waited
+  // on again, not reported as closed.
+  queue_object< buffer_queue<int> > shared(8);
+  shared.push(1);
+  size_t taken = 0;
+  std::thread lingering([&shared, &taken]() {
+    int batch[8];
+    taken = shared.wait_pop_n(batch, 8, std::chrono::milliseconds(100));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_EQ(1, shared.value_pop());
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  shared.push(2);
+  lingering.join();
+  EXPECT_EQ(1u, taken);
+
+  // The default takes what follows the first element without lingering.
+  queue_object< lock_free_buffer_queue<int> > unbatched(8);
+  unbatched.push(7);
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  EXPECT_EQ(1u, unbatched.wait_pop_n(out, 8, std::chrono::seconds(10)));
+  EXPECT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::seconds(5));
+}
+
+string describe(int i) {
+  std::stringstream o;
+  o << "#" << i;
+  return o.str();
+}
+
+TEST_F(PipelineTest, Fuse) {
+  // A source merged into one fused stage, plus a consumer: two threads.
+  simple_thread_pool pool(0, 2);
+  queue_object< buffer_queue<int> > queue(10);
+  vector<string> results;
+  std::function<void (string)> collect = [&results](string s) {
+    results.push_back(s);
+  };
+  pipeline::segment<int, string> fused =
+      pipeline::fuse(add_one, [](int i) { return i * 2; }, describe);
+  pipeline::plan p = pipeline::from(queue) | fused | collect;
+  pipeline::execution pex = p.run(&pool);
+  queue.push(1);
+  queue.push(2);
+  queue.close();
+  pex.wait();
+  ASSERT_EQ(2u, results.size());
+  EXPECT_EQ("#4", results[0]);
+  EXPECT_EQ("#6", results[1]);
+
+  // Lambdas need the input type spelled out.
+  pipeline::segment<int, int> doubled =
+      pipeline::fuse<int>([](int i) { return i * 2; });
+  EXPECT_EQ(10, doubled.base_->item_function()(5));
+  pipeline::segment<int, int> chain =
+      pipeline::fuse(pipeline::make(add_one) | add_one | add_one);
+  EXPECT_EQ(3, chain.base_->item_function()(0));
+  EXPECT_THROW(pipeline::fuse(pipeline::make(repeat)), std::invalid_argument);
+}
+
+TEST_F(PipelineTest, QueuePolicy) {
+  simple_thread_pool pool;
+  std::atomic<int> total(0);
+  std::function<void (int)> sum = [&total](int i) { total += i; };
+  pipeline::run_options options;
+  options.queue_capacity = 2;
+  for (int kind = 0; kind < 2; ++kind) {
+    options.queue = kind == 0 ? pipeline::queue_kind::buffer
+                              : pipeline::queue_kind::lock_free;
+    queue_object< buffer_queue<int> > queue(10);
+    pipeline::plan p = pipeline::from(queue)
+        | pipeline::make(add_one)
+        | pipeline::make(add_one).with_queue<lock_free_buffer_queue>(4096)
+        | pipeline::parallel(pipeline::make(add_one), 2).with_queue(1)
+        | pipeline::to(sum).with_queue<buffer_queue>(64);
+    pipeline::execution pex = p.run(&pool, options);
+    for (int i = 0; i < 100; ++i) {
+      queue.push(i);
+    }
+    queue.close();
+    pex.wait();
+  }
+  EXPECT_EQ(2 * (100 * 99 / 2 + 3 * 100), total.load());
+}
+
+TEST_F(PipelineTest, SpillQueue) {
+  // The consumer takes nothing until the producer has pushed everything,
+  // which only a link that never fills allows.
+  simple_thread_pool pool;
+  countdown_latch produced(1);
+  std::function<void (queue_back<int>)> produce =
+      [&produced](queue_back<int> out) {
+        for (int i = 0; i < 10000; ++i) {
+          out.push(i);
+        }
+        produced.count_down();
+      };
+  std::vector<int> seen;
+  std::function<void (int)> consume = [&produced, &seen](int i) {
+    produced.wait();
+    seen.push_back(i);
+  };
+  pipeline::plan p = pipeline::from(produce)
+      | pipeline::to(consume).with_queue<spill_queue>(2);
+  p.run(&pool).wait();
+  ASSERT_EQ(10000u, seen.size());
+  for (int i = 0; i < 10000; ++i) {
+    ASSERT_EQ(i, seen[i]);
+  }
+}
+
+int slow_add_one(int i) {
+  std::this_thread::sleep_for(std::chrono::microseconds(200));
+  return i + 1;
+}
+
+TEST_F(PipelineTest, Profile) {
+  simple_thread_pool pool;
+  std::atomic<int> total(0);
+  std::function<void (int)> sum = [&total](int i) { total += i; };
+  pipeline::run_options options;
+  options.profile = true;
+  for (pipeline::execution_mode mode : kQueuedModes) {
+    options.mode = mode;
+    queue_object< buffer_queue<int> > queue(10);
+    pipeline::plan p = pipeline::from(queue)
+        | pipeline::make(slow_add_one).named("slow")
+        | pipeline::parallel(pipeline::make(add_one), 2).named("fast")
+        | pipeline::to(sum);
+    pipeline::execution pex = p.run(&pool, options);
+    for (int i = 0; i < 50; ++i) {
+      queue.push(i);
+    }
+    queue.close();
+    pex.wait();
+
+    // slow (fed by the source), two fast replicas, in tasks mode
+    // fast.merge, and to.
+    std::vector<pipeline::stage_profile> profile = pex.profile();
+    size_t merge = mode == pipeline::execution_mode::tasks ? 1 : 0;
+    ASSERT_EQ(4u + merge, profile.size());
+    EXPECT_EQ("slow", profile[0].name);
+    EXPECT_EQ(50u, profile[0].items_in);
+    EXPECT_EQ(50u, profile[0].items_out);
+    EXPECT_GE(profile[0].busy, std::chrono::microseconds(50 * 200));
+    // The source queue is filled from outside the plan.
+    EXPECT_EQ(0u, profile[0].queue_samples);
+    EXPECT_EQ("fast", profile[1].name);
+    EXPECT_EQ(50u, profile[1].items_in + profile[2].items_in);
+    EXPECT_EQ(50u, profile[1].queue_samples + profile[2].queue_samples);
+    EXPECT_EQ(50u, profile[1].items_out + profile[2].items_out);
+    if (merge != 0) {
+      EXPECT_EQ("fast.merge", profile[3].name);
+      EXPECT_EQ(50u, profile[3].items_out);
+      EXPECT_NE(string::npos, pex.report().find("fast.merge"));
+    }
+    // The replicas' pushes count as the fed queue's.
+    EXPECT_EQ("to", profile[3 + merge].name);
+    EXPECT_EQ(50u, profile[3 + merge].items_in);
+    EXPECT_EQ(50u, profile[3 + merge].queue_samples);
+    EXPECT_LE(profile[3 + merge].queue_max, 10);
+  }
+  EXPECT_EQ(2 * (50 * 49 / 2 + 2 * 50), total.load());
+
+  queue_object< buffer_queue<int> > queue(10);
+  pipeline::execution pex =
+      (pipeline::from(queue) | pipeline::to(sum)).run(&pool);
+  queue.close();
+  pex.wait();
+  EXPECT_TRUE(pex.profile().empty());
+}
+
+TEST_F(PipelineTest, Advise) {
+  simple_thread_pool pool;
+  std::atomic<int> total(0);
+  std::function<void (int)> sum = [&total](int i) { total += i; };
+  pipeline::run_options options;
+  options.profile = true;
+  queue_object< buffer_queue<int> > queue(10);
+  pipeline::plan p = pipeline::from(queue)
+      | pipeline::make(slow_add_one).named("slow")
+      | pipeline::parallel(pipeline::make(add_one), 2).named("fast")
+      | pipeline::to(sum);
+  pipeline::execution pex = p.run(&pool, options);
+  for (int i = 0; i < 50; ++i) {
+    queue.push(i);
+  }
+  queue.close();
+  pex.wait();
+
+  // The replicas of fast count as one stage.
+  pipeline::plan_advice advice = pex.advise();
+  ASSERT_EQ(3u, advice.stages.size());
+  EXPECT_EQ("fast", advice.stages[1].name);
+  EXPECT_EQ(2u, advice.stages[1].replicas);
+  EXPECT_EQ(0u, advice.bottleneck);
+  EXPECT_GE(advice.stages[0].cost, std::chrono::microseconds(200));
+  EXPECT_LE(advice.max_rate, 5000.0);
+  EXPECT_GT(advice.headroom, 1.0);
+  EXPECT_GT(advice.stages[0].advised_replicas, 1u);
+  EXPECT_NE(string::npos, advice.report().find("bottleneck: slow"));
+
+  // Keeping up with 20000 items a second takes a replica per 50us.
+  advice = pex.advise(20000);
+  EXPECT_GE(advice.stages[0].advised_replicas, 4u);
+  EXPECT_EQ(1u, advice.stages[1].advised_replicas);
+
+  // A fan-in is never advised replicas, whatever it is called.
+  queue_object< buffer_queue<int> > left(10);
+  queue_object< buffer_queue<int> > right(10);
+  pipeline::execution merged =
+      (pipeline::merge(pipeline::from(left), pipeline::from(right))
+       | pipeline::to(sum)).run(&pool, options);
+  for (int i = 0; i < 50; ++i) {
+    left.push(i);
+    right.push(i);
+  }
+  left.close();
+  right.close();
+  merged.wait();
+  advice = merged.advise(1e9);
+  ASSERT_EQ(4u, advice.stages.size());
+  EXPECT_EQ("merge", advice.stages[2].name);
+  EXPECT_EQ(1u, advice.stages[2].advised_replicas);
+  EXPECT_GT(advice.stages[3].advised_replicas, 1u);
+
+  queue_object< buffer_queue<int> > unprofiled(10);
+  pipeline::execution plain =
+      (pipeline::from(unprofiled) | pipeline::to(sum)).run(&pool);
+  unprofiled.close();
+  plain.wait();
+  EXPECT_TRUE(plain.advise().stages.empty());
+}
+
+TEST_F(PipelineTest, Latency) {
+  simple_thread_pool pool;
+  std::atomic<int> total(0);
+  std::function<void (int)> sum = [&total](int i) { total += i; };
+  pipeline::run_options options;
+  options.trace_every = 5;
+  for (pipeline::execution_mode mode : kQueuedModes) {
+    options.mode = mode;
+    queue_object< buffer_queue<int> > queue(10);
+    pipeline::plan p = pipeline::from(queue)
+        | pipeline::make(slow_add_one).named("slow")
+        | pipeline::make(add_one).named("fast")
+        | pipeline::to(sum);
+    pipeline::execution pex = p.run(&pool, options);
+    for (int i = 0; i < 50; ++i) {
+      queue.push(i);
+    }
+    queue.close();
+    pex.wait();
+
+    // One item in five is traced from the source queue to the end.
+    pipeline::latency_histogram end_to_end = pex.end_to_end_latency();
+    EXPECT_GT(end_to_end.count, 0u);
+    EXPECT_LE(end_to_end.count, 10u);
+    EXPECT_GE(end_to_end.mean(), std::chrono::microseconds(200));
+    EXPECT_GE(end_to_end.quantile(1.0), end_to_end.quantile(0.5));
+    EXPECT_LE(end_to_end.quantile(1.0), end_to_end.max);
+    std::vector<pipeline::stage_latency> latency = pex.latency();
+    ASSERT_EQ(3u, latency.size());
+    EXPECT_EQ("slow", latency[0].name);
+    // The source queue is filled from outside the plan.
+    EXPECT_EQ(0u, latency[0].queued.count);
+    EXPECT_GE(latency[0].in_stage.mean(), std::chrono::microseconds(200));
+    EXPECT_EQ("fast", latency[1].name);
+    EXPECT_GT(latency[1].queued.count, 0u);
+    EXPECT_EQ(end_to_end.count, latency[2].in_stage.count);
+    EXPECT_TRUE(pex.profile().empty());
+  }
+  EXPECT_EQ(2 * (50 * 49 / 2 + 2 * 50), total.load());
+
+  queue_object< buffer_queue<int> > queue(10);
+  pipeline::execution pex =
+      (pipeline::from(queue) | pipeline::to(sum)).run(&pool);
+  queue.close();
+  pex.wait();
+  EXPECT_TRUE(pex.latency().empty());
+  EXPECT_EQ(0u, pex.end_to_end_latency().count);
+}
+
+TEST_F(PipelineTest, Elastic) {
+  // A replica (which the source merges into), the controller and the
+  // sink, and up to three extra replicas.
+  simple_thread_pool pool(0, 6);
+  std::atomic<int> total(0);
+  std::function<void (int)> sum = [&total](int i) { total += i; };
+  std::atomic<int> running(0);
+  std::atomic<int> most(0);
+  std::function<int (int)> slow = [&running, &most](int i) {
+    int now = ++running;
+    int seen = most;
+    while (now > seen && !most.compare_exchange_weak(seen, now)) {
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+    --running;
+    return i + 1;
+  };
+  queue_object< buffer_queue<int> > queue(100);
+  pipeline::plan p = pipeline::from(queue)
+      | pipeline::elastic(pipeline::make(slow), 1, 4)
+      | pipeline::to(sum);
+  pipeline::execution pex = p.run(&pool);
+  for (int i = 0; i < 500; ++i) {
+    queue.push(i);
+  }
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (total.load() != 500 * 499 / 2 + 500 &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  // A backed-up input brought in extra replicas, but never too many.
+  EXPECT_GT(most.load(), 1);
+  EXPECT_LE(most.load(), 4);
+
+  // With the input idle but still open, the extras retire and give their
+  // threads back.
+  size_t returned = 0;
+  while (returned < 3 && std::chrono::steady_clock::now() < deadline) {
+    std::vector<mutable_thread*> threads;
+    mutable_thread* t;
+    while ((t = pool.try_get_unused_thread()) != NULL) {
+      threads.push_back(t);
+    }
+    returned = threads.size();
+    for (size_t i = 0; i < threads.size(); ++i) {
+      pool.donate_thread(threads[i]);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(3u, returned);
+  queue.close();
+  pex.wait();
+  EXPECT_EQ(500 * 499 / 2 + 500, total.load());
+
+  EXPECT_THROW(pipeline::elastic(pipeline::make(repeat), 1, 2),
+               std::invalid_argument);
+}
+
+TEST_F(PipelineTest, Cancel) {
+  // Two threads per run, from a pool of three: a cancelled run must give
+  // its threads back for the next one to start.
+  simple_thread_pool pool(0, 3);
+  for (pipeline::execution_mode mode : kQueuedModes) {
+    pipeline::run_options options;
+    options.mode = mode;
+    options.workers = 1;
+    std::atomic<int> consumed(0);
+    std::function<void (int)> count = [&consumed](int) { ++consumed; };
+    // The first item keeps its stage busy until the plan is cancelled.
+    std::function<int (int)> stuck = [](int i) {
+      pipeline::cancellation_token token =
+          pipeline::current_cancellation_token();
+      while (i == 0 && !token.is_cancelled()) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+      return i;
+    };
+    queue_object< buffer_queue<int> > queue(100);
+    pipeline::plan p = pipeline::from(queue) | pipeline::make(stuck) | count;
+    pipeline::execution pex = p.run(&pool, options);
+    for (int i = 0; i < 100; ++i) {
+      queue.push(i);
+    }
+    EXPECT_FALSE(pex.token().is_cancelled());
+    pex.cancel();
+    EXPECT_TRUE(pex.is_done());
+    EXPECT_TRUE(pex.is_cancelled());
+    // The buffered items were dropped, and the source was closed.
+    EXPECT_LE(consumed.load(), 1);
+    EXPECT_EQ(queue_op_status::closed, queue.wait_push(1));
+  }
+  EXPECT_FALSE(pipeline::current_cancellation_token().is_cancelled());
+}
+
+TEST_F(PipelineTest, PreparedPlan) {
+  // The prepared plan holds all three of its threads between runs. In
+  // execution_mode::tasks, one of them forwards from the queue to the
+  // tasks on the other two.
+  simple_thread_pool pool(0, 3);
+  std::atomic<int> total(0);
+  std::function<void (int)> sum = [&total](int i) { total += i; };
+  for (pipeline::execution_mode mode : kQueuedModes) {
+    queue_object< buffer_queue<int> > queue(10);
+    pipeline::plan p = pipeline::from(queue)
+        | pipeline::make(add_one) | add_one | sum;
+    pipeline::run_options options;
+    options.mode = mode;
+    options.workers = 2;
+    pipeline::prepared_plan prepared(p, &pool, options);
+    EXPECT_TRUE(pool.try_get_unused_thread() == NULL);
+    total = 0;
+    for (int run = 0; run < 20; ++run) {
+      pipeline::execution pex = prepared.run();
+      EXPECT_THROW(prepared.run(), std::logic_error);
+      for (int i = 0; i < 10; ++i) {
+        queue.push(i);
+      }
+      queue.close();
+      pex.wait();
+    }
+    EXPECT_EQ(20 * (10 * 9 / 2 + 2 * 10), total.load());
+
+    // A cancelled run leaves the plan ready for the next.
+    {
+      pipeline::execution pex = prepared.run();
+      queue.push(1);
+      pex.cancel();
+    }
+    total = 0;
+    pipeline::execution pex = prepared.run();
+    queue.push(1);
+    queue.close();
+    pex.wait();
+    EXPECT_EQ(3, total.load());
+  }
+}
+
+TEST_F(PipelineTest, ReopenQueue) {
+  queue_object< lock_free_buffer_queue<int> > queue(4);
+  queue.push(1);
+  queue.close();
+  EXPECT_TRUE(queue.reopen());
+  EXPECT_FALSE(queue.is_closed());
+  EXPECT_TRUE(queue.is_empty());
+  queue.push(2);
+  EXPECT_EQ(2, queue.value_pop());
+}
+
+int times_two(int i) { return i * 2; }
+
+TEST_F(PipelineTest, SplitBy) {
+  // Items with one key go through one branch, so they stay in order.
+  simple_thread_pool pool;
+  for (pipeline::execution_mode mode : kQueuedModes) {
+    queue_object< buffer_queue<int> > queue(10);
+    std::mutex mu;
+    std::map<int, int> last;  // Last item seen for each key.
+    bool in_order = true;
+    int count = 0;
+    std::function<void (int)> check = [&](int i) {
+      std::lock_guard<std::mutex> lock(mu);
+      std::map<int, int>::iterator it = last.find(i % 8);
+      if (it != last.end() && it->second >= i) {
+        in_order = false;
+      }
+      last[i % 8] = i;
+      ++count;
+    };
+    std::function<int (int)> key = [](int i) { return i % 8; };
+    pipeline::plan p = pipeline::from(queue)
+        | pipeline::split_by(key, pipeline::make(pass_through), 3)
+        | check;
+    pipeline::run_options options;
+    options.mode = mode;
+    pipeline::execution pex = p.run(&pool, options);
+    for (int i = 0; i < 1000; ++i) {
+      queue.push(i);
+    }
+    queue.close();
+    pex.wait();
+    EXPECT_EQ(1000, count);
+    EXPECT_TRUE(in_order);
+  }
+}
+
+TEST_F(PipelineTest, TeeAndMerge) {
+  simple_thread_pool pool;
+  for (pipeline::execution_mode mode : kQueuedModes) {
+    queue_object< buffer_queue<int> > left(10);
+    queue_object< buffer_queue<int> > right(10);
+    std::atomic<int> total(0);
+    std::atomic<int> seen(0);
+    std::function<void (int)> sum = [&total](int i) { total += i; };
+    std::function<void (int)> count = [&seen](int) { ++seen; };
+    // Both sources feed both branches; the doubled and incremented copies
+    // join again before the sum, while the counter sees each item once.
+    pipeline::plan p = pipeline::merge(pipeline::from(left),
+                                       pipeline::from(right))
+        | pipeline::tee(pipeline::make(add_one) | sum,
+                        pipeline::make(times_two) | sum,
+                        pipeline::to(count));
+    pipeline::run_options options;
+    options.mode = mode;
+    pipeline::execution pex = p.run(&pool, options);
+    for (int i = 0; i < 100; ++i) {
+      left.push(i);
+      right.push(i);
+    }
+    left.close();
+    right.close();
+    pex.wait();
+    EXPECT_EQ(200, seen.load());
+    EXPECT_EQ(2 * (3 * 99 * 100 / 2 + 100), total.load());
+  }
+}
+
+TEST_F(PipelineTest, Serial) {
+  simple_thread_pool pool(0, 0);
+  queue_object< buffer_queue<int> > in_queue(200);
+  queue_object< buffer_queue<int> > out_queue(200);
+  for (int i = 0; i < 100; ++i) {
+    in_queue.push(i);
+  }
+  in_queue.close();
+  std::thread::id caller = std::this_thread::get_id();
+  bool on_caller = true;
+  std::function<int (int)> check = [caller, &on_caller](int i) {
+    on_caller = on_caller && std::this_thread::get_id() == caller;
+    return i;
+  };
+  pipeline::run_options options;
+  options.mode = pipeline::execution_mode::serial;
+  // Needs no threads, and is done when run() returns.
+  pipeline::plan p = pipeline::from(in_queue)
+      | pipeline::make(add_one) | times_two
+      | pipeline::parallel(pipeline::make(check), 4)
+      | out_queue;
+  pipeline::execution pex = p.run(&pool, options);
+  EXPECT_TRUE(pex.is_done());
+  EXPECT_TRUE(on_caller);
+  EXPECT_TRUE(out_queue.is_closed());
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(2 * (i + 1), out_queue.value_pop());
+  }
+
+  // Stages that take queues need threads of their own.
+  pipeline::plan q = pipeline::from(in_queue) | pipeline::make(repeat)
+      | out_queue;
+  EXPECT_THROW(q.run(&pool, options), std::invalid_argument);
+}
+
+TEST_F(PipelineTest, Automatic) {
+  simple_thread_pool pool;
+  pipeline::run_options options;
+  options.mode = pipeline::execution_mode::automatic;
+  options.serial_limit = std::chrono::microseconds(100);
+  for (int slow = 0; slow < 2; ++slow) {
+    queue_object< buffer_queue<int> > queue(10);
+    std::mutex mu;
+    std::set<std::thread::id> threads;
+    std::atomic<int> total(0);
+    std::function<void (int)> sum = [&](int i) {
+      std::lock_guard<std::mutex> lock(mu);
+      threads.insert(std::this_thread::get_id());
+      total += i;
+    };
+    pipeline::plan p = pipeline::from(queue)
+        | pipeline::make(slow ? slow_add_one : add_one) | sum;
+    pipeline::execution pex = p.run(&pool, options);
+    for (int i = 0; i < 200; ++i) {
+      queue.push(i);
+    }
+    queue.close();
+    pex.wait();
+    EXPECT_EQ(200 * 199 / 2 + 200, total.load());
+    // Cheap items stay on one thread; costly ones move to threads of their
+    // own part way through.
+    EXPECT_EQ(slow ? 2u : 1u, threads.size());
+  }
+}
+
+// Makes an empty file to use in a test, and returns its path.
+string temp_file() {
+  char path[] = "/tmp/pipeline_test_XXXXXX";
+  int fd = mkstemp(path);
+  EXPECT_LE(0, fd);
+  close(fd);
+  return path;
+}
+
+string read_file(const string& path) {
+  std::ifstream in(path.c_str(), std::ios::binary);
+  std::ostringstream out;
+  out << in.rdbuf();
+  return out.str();
+}
+
+string with_newline(pipeline::file_chunk chunk) {
+  return chunk.str() + "\n";
+}
+
+TEST_F(PipelineTest, Files) {
+  simple_thread_pool pool;
+  string in_path = temp_file();
+  string out_path = temp_file();
+  std::ostringstream text;
+  for (int i = 0; i < 1000; ++i) {
+    text << "line " << i << "\n";
+  }
+  {
+    std::ofstream out(in_path.c_str(), std::ios::binary);
+    out << text.str();
+  }
+
+  // Lines come out without their newlines; a small buffer forces many
+  // writes, and every run rewrites the file.
+  pipeline::plan lines =
+      pipeline::from_file(in_path, pipeline::delimited_chunks('\n'))
+      | pipeline::make(with_newline)
+      | pipeline::to_file<string>(out_path, 100);
+  for (int run = 0; run < 2; ++run) {
+    lines.run(&pool).wait();
+    EXPECT_EQ(text.str(), read_file(out_path));
+  }
+
+  // Fixed chunks go back out as they came in, without a copy.
+  std::atomic<int> chunks(0);
+  std::function<pipeline::file_chunk (pipeline::file_chunk)> count =
+      [&chunks](pipeline::file_chunk c) {
+        ++chunks;
+        return c;
+      };
+  pipeline::plan copy =
+      pipeline::from_file(in_path, pipeline::fixed_chunks(4096))
+      | pipeline::make(count)
+      | pipeline::to_file<pipeline::file_chunk>(out_path);
+  copy.run(&pool).wait();
+  EXPECT_EQ(text.str(), read_file(out_path));
+  EXPECT_EQ(int((text.str().size() + 4095) / 4096), chunks.load());
+
+  EXPECT_THROW(pipeline::from_file("/nonexistent/file",
+                                   pipeline::fixed_chunks(1)),
+               std::system_error);
+  unlink(in_path.c_str());
+  unlink(out_path.c_str());
+}
+
+typedef pipeline::recycled<std::vector<char> > buffer;
+
+TEST_F(PipelineTest, Recycle) {
+  pipeline::recycler<std::vector<char> > buffers;
+  {
+    // An object given back comes out again, as it was left.
+    buffer b = buffers.get();
+    b->assign(10, 'x');
+    buffer copy = b;
+    b = buffer();
+    EXPECT_EQ(10u, copy->size());
+    std::vector<char>* object = copy.get();
+    copy = buffer();
+    buffer again = buffers.get();
+    EXPECT_EQ(object, again.get());
+    EXPECT_EQ(1u, buffers.allocated());
+  }
+
+  // The buffers go round the plan, which makes far fewer than it passes.
+  simple_thread_pool pool;
+  const int kItems = 10000;
+  int filled = 0;
+  std::function<bool (std::vector<char>&)> fill =
+      [&filled](std::vector<char>& v) {
+        v.assign(100, static_cast<char>(filled));
+        return ++filled <= kItems;
+      };
+  std::function<buffer (buffer)> touch = [](buffer b) {
+    (*b)[0] = 1;
+    return b;
+  };
+  std::atomic<long> total(0);
+  std::function<void (buffer)> sink = [&total](buffer b) {
+    total += b->size();
+  };
+  pipeline::plan p = pipeline::from_recycler(buffers, fill)
+      | pipeline::make(touch)
+      | sink;
+  for (int run = 0; run < 2; ++run) {
+    filled = 0;
+    p.run(&pool).wait();
+  }
+  EXPECT_EQ(2 * 100L * kItems, total.load());
+  EXPECT_GT(1000u, buffers.allocated());
+}
+
+TEST_F(PipelineTest, StaticPlan) {
+  simple_thread_pool pool;
+  std::atomic<int> total(0);
+  int offset = 2;
+  buffer_queue<int> queue(10);
+  pipeline::plan p = pipeline::static_from(queue)
+      | pipeline::static_make([offset](int i) { return i + offset; })
+      | pipeline::static_make([](int i) { return std::to_string(i); }, 4)
+      | pipeline::static_to([&total](string s) { total += stoi(s); });
+  pipeline::run_options options;
+  options.profile = true;
+  pipeline::prepared_plan prepared(p, &pool, options);
+  for (int run = 0; run < 2; ++run) {
+    pipeline::execution pex = prepared.run();
+    for (int i = 0; i < 100; ++i) {
+      queue.push(i);
+    }
+    queue.close();
+    pex.wait();
+    std::vector<pipeline::stage_profile> profile = pex.profile();
+    ASSERT_EQ(3u, profile.size());
+    EXPECT_EQ("to", profile[2].name);
+    EXPECT_EQ(100u, profile[2].items_in);
+  }
+  EXPECT_EQ(2 * (100 * 99 / 2 + 2 * 100), total.load());
+
+  // A plan ending in a queue.
+  queue_object< buffer_queue<int> > in(10);
+  queue_object< buffer_queue<int> > out(100);
+  pipeline::execution pex =
+      (pipeline::static_from(in)
+       | pipeline::static_make([](int i) { return i * 2; })
+       | pipeline::static_to_queue(out)).run(&pool);
+  for (int i = 0; i < 50; ++i) {
+    in.push(i);
+  }
+  in.close();
+  pex.wait();
+  int sum = 0;
+  int x;
+  while (out.wait_pop(x) == queue_op_status::success) {
+    sum += x;
+  }
+  EXPECT_EQ(50 * 49, sum);
+}
+
+#if defined(__linux__)
+TEST_F(PipelineTest, Placement) {
+  std::vector<int> cpus = cpus_by_locality();
+  ASSERT_FALSE(cpus.empty());
+  simple_thread_pool pool(0, 3);
+  queue_object< buffer_queue<int> > queue(10);
+  std::atomic<int> first_cpu(-1);
+  std::atomic<int> last_cpu(-1);
+  std::function<int (int)> first = [&first_cpu](int i) {
+    first_cpu = sched_getcpu();
+    return i;
+  };
+  std::function<void (int)> last = [&last_cpu](int) {
+    last_cpu = sched_getcpu();
+  };
+  // The first stage takes the run_options CPU; the pinned consumer keeps
+  // its own.
+  pipeline::plan p = pipeline::from(queue)
+      | pipeline::make(first)
+      | pipeline::to(last).pinned(std::vector<int>(1, cpus.front()));
+  pipeline::run_options options;
+  options.cpus.push_back(cpus.back());
+  {
+    pipeline::execution pex = p.run(&pool, options);
+    queue.push(1);
+    queue.close();
+    pex.wait();
+  }
+  EXPECT_EQ(cpus.back(), first_cpu.load());
+  EXPECT_EQ(cpus.front(), last_cpu.load());
+  // The threads went back to the pool unpinned.
+  for (int i = 0; i < 3; ++i) {
+    mutable_thread* t = pool.try_get_unused_thread();
+    ASSERT_TRUE(t != NULL);
+    EXPECT_FALSE(t->is_pinned());
+  }
+}
+#endif
+
+#if defined(__cpp_impl_coroutine)
+pipeline::stage_coroutine co_add_one(pipeline::co_front<int> in,
+                                     pipeline::co_back<int> out) {
+  int x;
+  while (co_await in.pop(x)) {
+    if (!co_await out.push(x + 1)) {
+      break;
+    }
+  }
+}
+
+TEST_F(PipelineTest, Coroutine) {
+  // A hundred coroutine stages share two task workers.
+  simple_thread_pool pool(0, 8);
+  for (pipeline::execution_mode mode : kQueuedModes) {
+    queue_object< buffer_queue<int> > queue(10);
+    std::atomic<int> total(0);
+    std::function<void (int)> sum = [&total](int i) { total += i; };
+    pipeline::plan p = pipeline::from(queue)
+        | pipeline::parallel(pipeline::make(co_add_one), 100)
+        | sum;
+    pipeline::run_options options;
+    options.mode = mode;
+    options.workers = 2;
+    options.queue_capacity = 2;
+    pipeline::execution pex = p.run(&pool, options);
+    for (int i = 0; i < 1000; ++i) {
+      queue.push(i);
+    }
+    queue.close();
+    pex.wait();
+    EXPECT_EQ(1000 * 999 / 2 + 1000, total.load());
+  }
+}
+#endif
@@ -0,0 +1,182 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <thread>
+
+#include "spill_queue.h"
+
+#include "gtest/gtest.h"
+
+using gcl::queue_object;
+using gcl::queue_op_status;
+using gcl::spill_queue;
+
+const int kSmall = 4;
+const int kLarge = 1000;
+// Enough ints to go through the file in several blocks.
+const int kHuge = 100000;
+
+class SpillQueueTest
+:
+    public testing::Test
+{
+};
+
+// Pushes count multiples of multiplier, which never finds the queue full.
+template <typename Queue>
+void seq_try_fill(int count, int multiplier, Queue* q)
+{
+  for ( int i = 1; i <= count; ++i ) {
+    ASSERT_EQ(queue_op_status::success, q->try_push(i * multiplier));
+    ASSERT_FALSE(q->is_empty());
+  }
+}
+
+// Pops what seq_try_fill pushed.
+template <typename Queue>
+void seq_try_drain(int count, int multiplier, Queue* q)
+{
+  for ( int i = 1; i <= count; ++i ) {
+    int popped;
+    ASSERT_FALSE(q->is_empty());
+    ASSERT_EQ(queue_op_status::success, q->try_pop(popped));
+    ASSERT_EQ(i * multiplier, popped);
+  }
+  ASSERT_TRUE(q->is_empty());
+}
+
+// Verifies that we cannot create a queue of size zero
+TEST_F(SpillQueueTest, InvalidArg0) {
+  try {
+    spill_queue<int> body(0);
+    FAIL();
+  } catch (std::invalid_argument& expected) {
+  } catch (...) {
+    FAIL();
+  }
+}
+
+// Verify multiple try push/pop operations within memory.
+TEST_F(SpillQueueTest, MultipleTry) {
+  spill_queue<int> q(kSmall);
+  seq_try_fill(kSmall, 1, &q);
+  EXPECT_EQ(0u, q.spilled());
+  seq_try_drain(kSmall, 1, &q);
+}
+
+// Verify that pushes beyond memory spill, and come back in order.
+TEST_F(SpillQueueTest, Spill) {
+  spill_queue<int> q(kSmall);
+  seq_try_fill(kHuge, 1, &q);
+  EXPECT_EQ(static_cast<size_t>(kHuge - kSmall), q.spilled());
+  seq_try_drain(kHuge, 1, &q);
+  EXPECT_EQ(0u, q.spilled());
+
+  // The queue spills afresh once drained.
+  seq_try_fill(kLarge, 2, &q);
+  seq_try_drain(kLarge, 2, &q);
+}
+
+// Verify that values of varying size, some larger than a block, spill.
+TEST_F(SpillQueueTest, Strings) {
+  spill_queue<std::string> q(1);
+  for (int i = 0; i < 100; ++i) {
+    q.push(std::string(i * 1000, 'a' + i % 26));
+  }
+  q.close();
+  std::string s;
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(queue_op_status::success, q.wait_pop(s));
+    ASSERT_EQ(std::string(i * 1000, 'a' + i % 26), s);
+  }
+  EXPECT_EQ(queue_op_status::closed, q.wait_pop(s));
+}
+
+// Verify operations on a closed queue that has spilled, through the
+// queue_base interface.
+TEST_F(SpillQueueTest, Closed) {
+  queue_object< spill_queue<int> > q(kSmall);
+  seq_try_fill(kLarge, 1, &q);
+  q.close();
+  ASSERT_TRUE(q.is_closed());
+  try {
+    q.push(kLarge);
+    FAIL();
+  } catch (queue_op_status expected) {
+    ASSERT_TRUE(expected == queue_op_status::closed);
+  }
+  seq_try_drain(kLarge, 1, &q);
+  try {
+    q.value_pop();
+    FAIL();
+  } catch (queue_op_status expected) {
+    ASSERT_TRUE(expected == queue_op_status::closed);
+  }
+}
+
+// Verify that reopening discards what spilled.
+TEST_F(SpillQueueTest, Reopen) {
+  spill_queue<int> q(kSmall);
+  seq_try_fill(kLarge, 1, &q);
+  q.close();
+  q.reopen();
+  EXPECT_TRUE(q.is_empty());
+  EXPECT_EQ(0u, q.spilled());
+  seq_try_fill(kLarge, 3, &q);
+  seq_try_drain(kLarge, 3, &q);
+}
+
+// Verify that a consumer slower than its producer sees every value in
+// order.
+TEST_F(SpillQueueTest, ProducerConsumer) {
+  spill_queue<int> q(kSmall);
+  std::thread producer([&q]() {
+    for (int i = 1; i <= kHuge; ++i) {
+      q.push(i);
+    }
+    q.close();
+  });
+  int expected = 1;
+  int popped;
+  while (q.wait_pop(popped) == queue_op_status::success) {
+    ASSERT_EQ(expected, popped);
+    ++expected;
+  }
+  producer.join();
+  EXPECT_EQ(kHuge + 1, expected);
+}
+
+// Verify that a backlog that never drains moves through several files,
+// and keeps its values in order.
+TEST_F(SpillQueueTest, Backlog) {
+  spill_queue<int> q(kSmall);
+  int pushed = 0;
+  int expected = 1;
+  int popped;
+  while (pushed < 4 * kHuge) {
+    q.push(++pushed);
+    q.push(++pushed);
+    ASSERT_EQ(queue_op_status::success, q.try_pop(popped));
+    ASSERT_EQ(expected, popped);
+    ++expected;
+  }
+  EXPECT_LT(0u, q.spilled());
+  while (expected <= pushed) {
+    ASSERT_EQ(queue_op_status::success, q.try_pop(popped));
+    ASSERT_EQ(expected, popped);
+    ++expected;
+  }
+  EXPECT_TRUE(q.is_empty());
+}